@@ -0,0 +1,109 @@
+#pragma once
+
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+
+#include <context.h>
+
+// A fresh directory under the system temp directory, removed with everything in it on destruction.
+class TempDir {
+public:
+    TempDir()
+            : path_(boost::filesystem::temp_directory_path() /
+                    boost::filesystem::unique_path("image_warrior_bench_%%%%-%%%%-%%%%")) {
+        boost::filesystem::create_directories(path_);
+    }
+
+    ~TempDir() {
+        boost::system::error_code error;
+        boost::filesystem::remove_all(path_, error);
+    }
+
+    TempDir(const TempDir &) = delete;
+
+    TempDir &operator=(const TempDir &) = delete;
+
+    [[nodiscard]] const boost::filesystem::path &get_path() const {
+        return path_;
+    }
+
+private:
+    boost::filesystem::path path_;
+};
+
+// A Context with the settings of config.json that matter for databases and file transfers, written into `dir`.
+// `index_type` is "brute_force" or "ivf", `precision` a features.precision.
+inline std::unique_ptr<Context> MakeContext(const TempDir &dir, const std::string &index_type = "brute_force",
+                                            const std::string &precision = "fp32") {
+    boost::property_tree::ptree config;
+    config.put("input_dir", (dir.get_path() / "input").string());
+    config.put("output_dir", (dir.get_path() / "output").string());
+    config.put("log_pattern", "[%^%l%$] %v");
+    // AddSyntheticObjects warns about every file it can't hash:
+    config.put("log_level", "error");
+    config.put("similarity_index.type", index_type);
+    config.put("similarity_index.lists", 1024);
+    config.put("similarity_index.probes", 16);
+    config.put("features.precision", precision);
+    config.put("scheduler.parallel_tasks", 8);
+    config.put("scheduler.worker_threads", 0);
+    config.put("file_transfer.threads", 8);
+    config.put("file_transfer.queue_capacity", 4096);
+    config.put("file_transfer.sync_batch", 512);
+    config.put("scan.threads", 16);
+    config.put("metrics.enabled", false);
+    config.put("metrics.path", (dir.get_path() / "metrics.prom").string());
+    config.put("metrics.format", "prometheus");
+    config.put("metrics.interval_ms", 0);
+    config.put("trace.enabled", false);
+    config.put("trace.path", (dir.get_path() / "trace.json").string());
+    config.put("trace.max_events", 0);
+
+    const auto config_path = dir.get_path() / "config.json";
+    boost::property_tree::write_json(config_path.string(), config);
+    return std::make_unique<Context>(config_path.string());
+}
+
+// `count` objects named 0.jpg, 1.jpg, ... in `db`, with random (unnormalized) features of `dim` floats unless `dim`
+// is 0. The files don't exist, which is fine for everything but hashes and transfers.
+inline std::vector<std::shared_ptr<Object>> AddSyntheticObjects(ObjectDatabase &db, size_t count, size_t dim,
+                                                                uint32_t seed = 42) {
+    std::vector<FileEntry> entries;
+    entries.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        entries.push_back({db.get_dir() / (std::to_string(i) + ".jpg"), 1024, 0});
+    }
+    auto objects = db.AddEntries(entries);
+    if (dim == 0) {
+        return objects;
+    }
+
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> distribution;
+    std::vector<float> features(dim);
+    for (const auto &object: objects) {
+        for (auto &value: features) {
+            value = distribution(rng);
+        }
+        db.set_features(object, features, 1);
+    }
+    db.invalidate_index();
+    return objects;
+}
+
+// Creates `count` small files named 0.jpg, 1.jpg, ... spread over `dirs` subdirectories of `root`.
+inline void CreateFiles(const boost::filesystem::path &root, size_t count, size_t dirs = 1) {
+    for (size_t d = 0; d < dirs; ++d) {
+        boost::filesystem::create_directories(root / std::to_string(d));
+    }
+    const std::string content(1024, 'x');
+    for (size_t i = 0; i < count; ++i) {
+        boost::filesystem::ofstream file(root / std::to_string(i % dirs) / (std::to_string(i) + ".jpg"));
+        file << content;
+    }
+}
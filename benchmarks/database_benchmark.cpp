@@ -0,0 +1,104 @@
+#include <benchmark/benchmark.h>
+
+#include <benchmark_support.h>
+
+namespace {
+    constexpr size_t kLookupObjects = 100'000;
+    // Update and move_object work on real files:
+    constexpr size_t kTreeFiles = 10'000;
+    constexpr size_t kTreeDirs = 100;
+    constexpr size_t kMovedFiles = 1'000;
+}
+
+static void BM_FindByPath(benchmark::State &state) {
+    TempDir dir;
+    auto ctx = MakeContext(dir);
+    ObjectDatabase db(*ctx, dir.get_path());
+    auto objects = AddSyntheticObjects(db, kLookupObjects, 0);
+    std::vector<boost::filesystem::path> paths;
+    for (const auto &object: objects) {
+        paths.push_back(object->path_);
+    }
+    size_t i = 0;
+    for (auto _: state) {
+        benchmark::DoNotOptimize(db.find_by_path(paths[i]).get());
+        i = (i + 1) % paths.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_FindByPath);
+
+// Half of the paths aren't in the database:
+static void BM_Contains(benchmark::State &state) {
+    TempDir dir;
+    auto ctx = MakeContext(dir);
+    ObjectDatabase db(*ctx, dir.get_path());
+    AddSyntheticObjects(db, kLookupObjects / 2, 0);
+    std::vector<boost::filesystem::path> paths;
+    for (size_t i = 0; i < kLookupObjects; ++i) {
+        paths.push_back(dir.get_path() / (std::to_string(i) + ".jpg"));
+    }
+    size_t i = 0;
+    for (auto _: state) {
+        benchmark::DoNotOptimize(db.contains(paths[i]));
+        i = (i + 1) % paths.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_Contains);
+
+// Scans a tree of kTreeFiles files in kTreeDirs directories into an empty database. The tree is in the page cache
+// after the first run, so this measures the walk and the database, not the disk.
+static void BM_Update(benchmark::State &state) {
+    TempDir dir;
+    auto ctx = MakeContext(dir);
+    const auto root = dir.get_path() / "tree";
+    CreateFiles(root, kTreeFiles, kTreeDirs);
+    for (auto _: state) {
+        state.PauseTiming();
+        auto db = std::make_unique<ObjectDatabase>(*ctx, root);
+        state.ResumeTiming();
+        db->Update();
+        benchmark::DoNotOptimize(db->size());
+        state.PauseTiming();
+        db.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * kTreeFiles));
+}
+
+BENCHMARK(BM_Update)->Unit(benchmark::kMillisecond);
+
+// Moves kMovedFiles files into another database (on the same file system), including waiting for the transfers:
+static void BM_MoveObject(benchmark::State &state) {
+    TempDir dir;
+    auto ctx = MakeContext(dir);
+    size_t run = 0;
+    for (auto _: state) {
+        state.PauseTiming();
+        const auto from_dir = dir.get_path() / ("from_" + std::to_string(run));
+        const auto to_dir = dir.get_path() / ("to_" + std::to_string(run));
+        ++run;
+        CreateFiles(from_dir, kMovedFiles);
+        boost::filesystem::create_directories(to_dir);
+        ObjectDatabase from(*ctx, from_dir);
+        ObjectDatabase to(*ctx, to_dir);
+        from.Update();
+        auto objects = from.get_objects();
+        state.ResumeTiming();
+
+        {
+            ScopedBatch from_batch(from);
+            ScopedBatch to_batch(to);
+            for (const auto &object: objects) {
+                move_object(from, to, object);
+            }
+        }
+        ctx->get_file_transfer().Wait();
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * kMovedFiles));
+}
+
+BENCHMARK(BM_MoveObject)->Unit(benchmark::kMillisecond);
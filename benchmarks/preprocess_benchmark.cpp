@@ -0,0 +1,107 @@
+#include <benchmark/benchmark.h>
+
+#include <torch/torch.h>
+#include <opencv2/opencv.hpp>
+
+#include <benchmark_support.h>
+#include <image_decode.h>
+#include <image_kernels.h>
+
+namespace {
+    constexpr int kInputSize = 224;
+
+    constexpr float kMean[3] = {0.485f, 0.456f, 0.406f};
+    constexpr float kStd[3] = {0.229f, 0.224f, 0.225f};
+
+    cv::Mat random_image() {
+        cv::Mat image(kInputSize, kInputSize, CV_8UC3);
+        cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(255));
+        return image;
+    }
+
+    // A 4000x3000 camera-sized JPEG: a gradient with some noise, so it compresses like a photo rather than like noise.
+    boost::filesystem::path write_photo(const TempDir &dir) {
+        cv::Mat photo(3000, 4000, CV_8UC3);
+        for (int y = 0; y < photo.rows; ++y) {
+            for (int x = 0; x < photo.cols; ++x) {
+                photo.at<cv::Vec3b>(y, x) = {static_cast<uint8_t>(x * 255 / photo.cols),
+                                             static_cast<uint8_t>(y * 255 / photo.rows), 128};
+            }
+        }
+        cv::Mat noise(photo.size(), CV_8UC3);
+        cv::randu(noise, cv::Scalar::all(0), cv::Scalar::all(16));
+        photo += noise;
+        auto path = dir.get_path() / "photo.jpg";
+        cv::imwrite(path.string(), photo, {cv::IMWRITE_JPEG_QUALITY, 90});
+        return path;
+    }
+}
+
+// The sequence ImageLoaderThread used to run per image, up to the contiguous copy torch::stack made of it:
+static void BM_PreprocessTorchOps(benchmark::State &state) {
+    auto image = random_image();
+    for (auto _: state) {
+        torch::Tensor image_tensor = torch::from_blob(image.data, {image.rows, image.cols, 3}, torch::kByte);
+        image_tensor = image_tensor.permute({2, 0, 1});
+        image_tensor = image_tensor.to(torch::kFloat32).div(255);
+        image_tensor[0] = image_tensor[0].sub_(kMean[0]).div_(kStd[0]);
+        image_tensor[1] = image_tensor[1].sub_(kMean[1]).div_(kStd[1]);
+        image_tensor[2] = image_tensor[2].sub_(kMean[2]).div_(kStd[2]);
+        image_tensor = image_tensor.contiguous();
+        benchmark::DoNotOptimize(image_tensor.data_ptr<float>());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_PreprocessTorchOps);
+
+static void BM_PreprocessFusedKernel(benchmark::State &state) {
+    auto image = random_image();
+    const size_t plane = static_cast<size_t>(kInputSize) * kInputSize;
+    std::vector<float> out(3 * plane);
+    for (auto _: state) {
+        bgr_to_normalized_rgb_planar(image.ptr<uint8_t>(), plane, kMean, kStd, out.data(), plane);
+        benchmark::DoNotOptimize(out.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(image_kernels_isa());
+}
+
+BENCHMARK(BM_PreprocessFusedKernel);
+
+static void BM_PreprocessFusedKernelChannelsLast(benchmark::State &state) {
+    auto image = random_image();
+    const size_t plane = static_cast<size_t>(kInputSize) * kInputSize;
+    std::vector<float> out(3 * plane);
+    for (auto _: state) {
+        bgr_to_normalized_rgb_interleaved(image.ptr<uint8_t>(), plane, kMean, kStd, out.data());
+        benchmark::DoNotOptimize(out.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(image_kernels_isa());
+}
+
+BENCHMARK(BM_PreprocessFusedKernelChannelsLast);
+
+// What ImageLoaderThread does per image, from the file to the input the model gets: decode (reduced when the argument
+// is 1, like image_processor.reduced_decode), resize and normalize.
+static void BM_DecodeResizeNormalize(benchmark::State &state) {
+    TempDir dir;
+    const auto path = write_photo(dir);
+    const bool reduced_decode = state.range(0) != 0;
+    const size_t plane = static_cast<size_t>(kInputSize) * kInputSize;
+    std::vector<float> out(3 * plane);
+    cv::Mat resized_image;
+    for (auto _: state) {
+        auto image = reduced_decode ? DecodeImage(path, cv::IMREAD_COLOR, kInputSize) : cv::imread(path.string());
+        cv::resize(image, resized_image, cv::Size(kInputSize, kInputSize));
+        bgr_to_normalized_rgb_planar(resized_image.ptr<uint8_t>(), plane, kMean, kStd, out.data(), plane);
+        benchmark::DoNotOptimize(out.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_DecodeResizeNormalize)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
@@ -0,0 +1,93 @@
+#include <benchmark/benchmark.h>
+
+#include <benchmark_support.h>
+#include <vector_kernels.h>
+
+namespace {
+    // ResNet-152 features are 2048 floats; the index benchmarks use shorter vectors so 1M of them fit in 1 GiB:
+    constexpr size_t kFeatureDim = 2048;
+    constexpr size_t kIndexedFeatureDim = 256;
+    constexpr float kSimilarityThreshold = 0.999f;
+
+    // A database of synthetic objects. Filling (and indexing) 1M objects takes far longer than querying it, so the
+    // last one is kept around across the runs Google Benchmark makes of a benchmark:
+    struct SyntheticDatabase {
+        std::string index_type;
+        std::string precision;
+        size_t count;
+        TempDir dir;
+        std::unique_ptr<Context> ctx;
+        std::unique_ptr<ObjectDatabase> db;
+        std::vector<std::shared_ptr<Object>> objects;
+    };
+
+    SyntheticDatabase &GetSyntheticDatabase(const std::string &index_type, const std::string &precision,
+                                            size_t count) {
+        static std::unique_ptr<SyntheticDatabase> database;
+        if (!database || database->index_type != index_type || database->precision != precision ||
+            database->count != count) {
+            database.reset();
+            database = std::make_unique<SyntheticDatabase>();
+            database->index_type = index_type;
+            database->precision = precision;
+            database->count = count;
+            database->ctx = MakeContext(database->dir, index_type, precision);
+            database->db = std::make_unique<ObjectDatabase>(*database->ctx, database->dir.get_path());
+            database->objects = AddSyntheticObjects(*database->db, count, kIndexedFeatureDim);
+            // Builds (and for ivf trains) the index:
+            benchmark::DoNotOptimize(database->db->find_similar(database->objects[0], kSimilarityThreshold));
+        }
+        return *database;
+    }
+
+    void FindSimilar(benchmark::State &state, const std::string &index_type, const std::string &precision = "fp32") {
+        auto &database = GetSyntheticDatabase(index_type, precision, static_cast<size_t>(state.range(0)));
+        size_t query = 0;
+        for (auto _: state) {
+            auto matches = database.db->find_similar(database.objects[query], kSimilarityThreshold);
+            benchmark::DoNotOptimize(matches.data());
+            query = (query + 7919) % database.objects.size();
+        }
+        state.SetItemsProcessed(state.iterations());
+        state.SetLabel(vector_kernels_isa());
+    }
+}
+
+static void BM_Similarity(benchmark::State &state) {
+    TempDir dir;
+    auto ctx = MakeContext(dir);
+    ObjectDatabase db(*ctx, dir.get_path());
+    auto objects = AddSyntheticObjects(db, 2, kFeatureDim);
+    for (auto _: state) {
+        benchmark::DoNotOptimize(similarity(*objects[0], *objects[1]));
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(vector_kernels_isa());
+}
+
+BENCHMARK(BM_Similarity);
+
+static void BM_FindSimilarBruteForce(benchmark::State &state) {
+    FindSimilar(state, "brute_force");
+}
+
+BENCHMARK(BM_FindSimilarBruteForce)->Arg(10'000)->Arg(100'000)->Arg(1'000'000)->Unit(benchmark::kMicrosecond);
+
+// The same scan over compressed features:
+static void BM_FindSimilarBruteForceFp16(benchmark::State &state) {
+    FindSimilar(state, "brute_force", "fp16");
+}
+
+BENCHMARK(BM_FindSimilarBruteForceFp16)->Arg(100'000)->Arg(1'000'000)->Unit(benchmark::kMicrosecond);
+
+static void BM_FindSimilarBruteForceInt8(benchmark::State &state) {
+    FindSimilar(state, "brute_force", "int8");
+}
+
+BENCHMARK(BM_FindSimilarBruteForceInt8)->Arg(100'000)->Arg(1'000'000)->Unit(benchmark::kMicrosecond);
+
+static void BM_FindSimilarIvf(benchmark::State &state) {
+    FindSimilar(state, "ivf");
+}
+
+BENCHMARK(BM_FindSimilarIvf)->Arg(10'000)->Arg(100'000)->Arg(1'000'000)->Unit(benchmark::kMicrosecond);
@@ -1,142 +1,237 @@
+#include <algorithm>
 #include <iostream>
-#include <format>
+#include <mutex>
+#include <random>
+
+#include <csignal>
+
+#include <boost/program_options.hpp>
 
 #include <context.h>
+#include <deduplicator.h>
+#include <directory_watcher.h>
+#include <duplicate_clusters.h>
+#include <feature_projection.h>
 #include <object_database.h>
-#include <filesystem>
+#include <processors/image_processor.h>
 
-std::string text_temperature(const std::string &input, float value) {
-    if (value > 1) {
-        value = 1.0f;
+namespace {
+    DirectoryWatcher *active_watcher = nullptr;
+
+    void stop_watching(int) {
+        if (active_watcher) {
+            active_watcher->Stop();
+        }
     }
-    if (value < 0) {
-        value = 0.0f;
+
+    // Dedupes new files in input_dir as they arrive, until SIGINT or SIGTERM. Only the new files are looked at, and
+    // the databases are saved every watch.save_interval_s and when watching stops rather than after every batch:
+    // a save rewrites both feature stores.
+    void watch(Context &context, Deduplicator &deduplicator, DirectoryWatcher &watcher) {
+        active_watcher = &watcher;
+        std::signal(SIGINT, stop_watching);
+        std::signal(SIGTERM, stop_watching);
+
+        auto &input_db = context.get_input_database();
+        const std::chrono::seconds save_interval(context.get_config_tree().get<size_t>("watch.save_interval_s"));
+        auto last_save = std::chrono::steady_clock::now();
+        bool unsaved = false;
+        spdlog::info("Watching for new files...");
+        while (!watcher.stopped()) {
+            auto files = watcher.WaitForFiles(std::chrono::seconds(1));
+            size_t new_count;
+            if (watcher.take_overflow()) {
+                new_count = input_db.Update();
+            } else {
+                new_count = input_db.AddFiles(files);
+            }
+            if (new_count > 0) {
+                spdlog::info("{} new files", new_count);
+                auto start_time = std::chrono::high_resolution_clock::now();
+                // Every earlier batch was settled completely, so the input database holds only the new files:
+                deduplicator.ResolveObjects(std::vector(input_db.get_objects()));
+                auto end_time = std::chrono::high_resolution_clock::now();
+                long elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
+                spdlog::info("Deduplicated {} new files in {}s", new_count, static_cast<double>(elapsed_ms) / 1000.0);
+                unsaved = true;
+            }
+            if (unsaved && std::chrono::steady_clock::now() - last_save >= save_interval) {
+                context.save_databases();
+                last_save = std::chrono::steady_clock::now();
+                unsaved = false;
+            }
+        }
+        spdlog::info("Stopped watching");
+        if (unsaved) {
+            context.save_databases();
+        }
+
+        std::signal(SIGINT, SIG_DFL);
+        std::signal(SIGTERM, SIG_DFL);
+        active_watcher = nullptr;
     }
 
-    float r, g, b;
-
-    float h = 1.0f - value; // Convert the value to a hue (we reverse it to go from violet to red)
-    h *= 0.5;
-    float s = 1.0;
-    float v = 1.0;
-
-    int i = std::floor(h * 6);
-    float f = h * 6 - static_cast<float>(i);
-    float p = v * (1 - s);
-    float q = v * (1 - f * s);
-    float t = v * (1 - (1 - f) * s);
-
-    switch (i % 6) {
-        case 0:
-            r = v, g = t, b = p;
-            break;
-        case 1:
-            r = q, g = v, b = p;
-            break;
-        case 2:
-            r = p, g = v, b = t;
-            break;
-        case 3:
-            r = p, g = q, b = v;
-            break;
-        case 4:
-            r = t, g = p, b = v;
-            break;
-        case 5:
-            r = v, g = p, b = q;
-            break;
+    // Groups the similar images of input_dir (see FindDuplicateClusters) and reports them, without touching a file.
+    void cluster(Context &context, const std::string &report_path) {
+        auto &input_db = context.get_input_database();
+        input_db.Update();
+        spdlog::info("Input database updated, size: {}", input_db.size());
+        context.initialize_processors();
+        auto *image_processor = context.get_image_processor();
+        if (!image_processor) {
+            spdlog::error("Clustering needs image_processor.enabled");
+            exit(1);
+        }
+        image_processor->Process(input_db);
+        // Not save_databases, the output database was never updated and would be saved empty:
+        input_db.Save();
+
+        const auto threshold = context.get_config_tree().get<float>("dedupe.similarity_threshold");
+        const auto clusters = FindDuplicateClusters(input_db, threshold, context.get_worker_pool());
+        WriteClusterReport(clusters, report_path);
+        spdlog::info("Wrote {} clusters to {}", clusters.size(), report_path);
     }
 
-    std::ostringstream oss;
-    oss << "\033[38;2;" << static_cast<int>(r * 255) << ";"
-        << static_cast<int>(g * 255) << ";"
-        << static_cast<int>(b * 255) << "m"
-        << input << "\033[0m";
-    return oss.str();
+    // Fits the feature projection (see FeatureProjection) on a sample of output_dir and saves it next to the model.
+    // Reports for a few lengths how the dedupe decisions on the sample change, to pick projection.dim by.
+    void fit_projection(Context &context) {
+        const auto &config = context.get_config_tree();
+        auto &output_db = context.get_output_database();
+        output_db.Update();
+        spdlog::info("Output database updated, size: {}", output_db.size());
+        context.initialize_processors();
+        auto *image_processor = context.get_image_processor();
+        if (!image_processor) {
+            spdlog::error("Fitting a feature projection needs image_processor.enabled");
+            exit(1);
+        }
+
+        std::vector<boost::filesystem::path> paths;
+        for (const auto &object: output_db.get_objects()) {
+            if (object->type_ == Object::Type::IMAGE) {
+                paths.push_back(object->path_);
+            }
+        }
+        // Fixed seed, so fitting again on the same library gives the same projection:
+        std::vector<boost::filesystem::path> sample;
+        std::sample(paths.begin(), paths.end(), std::back_inserter(sample),
+                    config.get<size_t>("projection.fit_samples"), std::mt19937(0));
+        spdlog::info("Computing the features of {} sample images...", sample.size());
+
+        // The model output, not what a previously fitted projection makes of it:
+        std::mutex features_mutex;
+        std::vector<std::vector<float>> features;
+        auto job = image_processor->Start([&features_mutex, &features](const boost::filesystem::path &,
+                                                                       std::span<const float> image_features) {
+            std::lock_guard<std::mutex> lock(features_mutex);
+            features.emplace_back(image_features.begin(), image_features.end());
+        }, /*raw=*/true);
+        for (const auto &path: sample) {
+            if (!image_processor->Submit(*job, path)) {
+                break;
+            }
+        }
+        image_processor->Finish(*job);
+        if (features.size() < 2) {
+            spdlog::error("Fitting a feature projection needs at least two images in output_dir");
+            exit(1);
+        }
+
+        const size_t input_dim = features.front().size();
+        torch::Tensor samples = torch::empty({static_cast<int64_t>(features.size()), static_cast<int64_t>(input_dim)},
+                                             torch::kFloat32);
+        for (size_t i = 0; i < features.size(); ++i) {
+            std::copy(features[i].begin(), features[i].end(), samples.data_ptr<float>() + i * input_dim);
+        }
+
+        // The configured length and the usual ones below the model's, all truncations of one fit:
+        const auto dim = std::min(config.get<size_t>("projection.dim"), input_dim);
+        std::vector<size_t> dims = {dim};
+        for (size_t candidate: {64, 128, 256, 512, 1024}) {
+            if (candidate < input_dim && candidate != dim) {
+                dims.push_back(candidate);
+            }
+        }
+        std::sort(dims.begin(), dims.end());
+        const auto fitted = FeatureProjection::Fit(samples, dims.back(), config.get<bool>("projection.whiten"));
+
+        const auto threshold = config.get<float>("dedupe.similarity_threshold");
+        spdlog::info("Dedupe decisions on {} sample images at similarity threshold {}, {} values before projection:",
+                     features.size(), threshold, input_dim);
+        for (size_t candidate: dims) {
+            const auto projection = fitted.truncated(candidate);
+            const auto agreement = CompareDecisions(samples, projection, threshold);
+            spdlog::info("{:>5} values{}: {:.2f}% of the variance, {} of {} similar pairs kept, {} added, "
+                         "similarity changed by up to {:.4f} near the threshold",
+                         candidate, candidate == dim ? " (projection.dim)" : "",
+                         projection.explained_variance() * 100.0, agreement.kept_pairs,
+                         agreement.full_pairs, agreement.added_pairs, agreement.max_change);
+        }
+
+        const auto projection_path = ImageProcessor::ProjectionPath(config);
+        fitted.truncated(dim).Save(projection_path);
+        spdlog::info("Saved the {} value projection to {}, it is used with projection.enabled", dim,
+                     projection_path.generic_string());
+    }
 }
 
+int main(int argc, char **argv) {
+    boost::program_options::options_description options("Options");
+    options.add_options()
+            ("help,h", "Show this help")
+            ("config,c", boost::program_options::value<std::string>()->default_value("config.json"), "Config file")
+            ("watch,w", "Keep running and dedupe new files as they appear in input_dir")
+            ("stream,s", "Overlap scanning, model loading, decoding and inference instead of running them in turn")
+            ("cluster", boost::program_options::value<std::string>(),
+             "Don't dedupe, write the clusters of similar images in input_dir to this report (.json or .csv)")
+            ("fit-projection", "Don't dedupe, fit the feature projection on a sample of output_dir and report how it "
+                               "changes dedupe decisions");
+    boost::program_options::variables_map arguments;
+    try {
+        boost::program_options::store(boost::program_options::parse_command_line(argc, argv, options), arguments);
+        boost::program_options::notify(arguments);
+    } catch (const boost::program_options::error &e) {
+        std::cout << e.what() << std::endl << options << std::endl;
+        return 1;
+    }
+    if (arguments.count("help")) {
+        std::cout << options << std::endl;
+        return 0;
+    }
+
+    Context context(arguments["config"].as<std::string>());
 
-std::string center(const std::string &input, int block_size) {
-    int padding = block_size - static_cast<int>(input.size());
-    if (padding < 0) {
-        return input;
+    // Watch before the first scan, so files arriving during the first pass aren't missed:
+    std::unique_ptr<DirectoryWatcher> watcher;
+    if (arguments.count("watch")) {
+        watcher = std::make_unique<DirectoryWatcher>(
+                context.get_config_tree().get<std::string>("input_dir"),
+                std::chrono::milliseconds(context.get_config_tree().get<size_t>("watch.settle_ms")));
     }
 
-    int left_padding = padding / 2;
-    int right_padding = padding - left_padding;
+    context.load_databases();
 
-    std::string result;
-    result.reserve(block_size);
-    for (int i = 0; i < left_padding; ++i) {
-        result += " ";
+    if (arguments.count("cluster")) {
+        cluster(context, arguments["cluster"].as<std::string>());
+        return 0;
     }
-    result += input;
-    for (int i = 0; i < right_padding; ++i) {
-        result += " ";
+    if (arguments.count("fit-projection")) {
+        fit_projection(context);
+        return 0;
     }
-    return result;
-}
 
-int main() {
-     std::filesystem::copy("input_backup", "input", std::filesystem::copy_options::recursive | std::filesystem::copy_options::overwrite_existing);
-//     return 0;
-    // TODO: remove
+    Deduplicator deduplicator(context);
+    if (arguments.count("stream")) {
+        deduplicator.RunStreaming();
+    } else {
+        context.update_databases();
+        context.initialize_processors();
+        deduplicator.Run();
+    }
 
-    auto start_time = std::chrono::high_resolution_clock::now();
-    Context context("config.json");
-    context.load_databases();
-    context.update_databases();
-    context.initialize_processors();
-    context.process_databases();
-    auto end_time = std::chrono::high_resolution_clock::now();
-    long elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
-    spdlog::info("Done preprocessing in {}s", static_cast<double>(elapsed_ms) / 1000.0);
-
-    spdlog::info("Copying unique objects...");
-    start_time = std::chrono::high_resolution_clock::now();
-    int copy_count = 0;
-    auto objects = context.get_input_database().get_objects();
-    for (size_t i = 0; i < objects.size(); ++i) {
-        const auto &similar_objects = context.get_output_database().find_similar(objects[i], 0.999);
-        if (similar_objects.empty()) {
-            spdlog::debug("Copying {}", objects[i]->path_.generic_string());
-            move_object(context.get_input_database(), context.get_output_database(), objects[i]);
-            ++copy_count;
-        } else {
-            context.get_input_database().remove_object(objects[i]);
-        }
-        spdlog::info("Processed {}/{} objects\033[A", i + 1, objects.size());
+    if (watcher) {
+        watch(context, deduplicator, *watcher);
     }
-    spdlog::info("Processed {}/{} objects", objects.size(), objects.size());
-    end_time = std::chrono::high_resolution_clock::now();
-    elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
-    spdlog::info("Done copying unique objects in {}s", static_cast<double>(elapsed_ms) / 1000.0);
-    spdlog::info("Copied {} objects", copy_count);
-
-//    const auto &objects = context.get_input_database().get_objects();
-//    for (int i = 0; i < objects.size(); ++i) {
-//        std::cout << std::format("{:^3}: {}\n", i, objects[i]->path_.generic_string());
-//        for (auto &object : context.get_input_database().find_similar(objects[i], 0.9)) {
-//            std::cout << std::format("\t{}\n", object->path_.generic_string());
-//        }
-//    }
-//
-//    const int block_size = 8;
-//    for (int i = 0; i < objects.size(); ++i) {
-//        if (i == 0) {
-//            std::cout << center("", block_size) << " ";
-//            for (int j = 0; j < objects.size(); ++j) {
-//                std::cout << center(std::to_string(j + 1), block_size) << " ";
-//            }
-//            std::cout << "\n";
-//        }
-//        std::cout << center(std::to_string(i + 1), block_size) << " ";
-//        for (int j = 0; j < objects.size(); ++j) {
-//            const auto similarity_value = similarity(*objects[i], *objects[j]);
-//            std::cout << text_temperature(center(std::format("{:.4f}", similarity_value), block_size), similarity_value) << " ";
-//        }
-//        std::cout << "\n";
-//    }
 
     return 0;
 }
\ No newline at end of file
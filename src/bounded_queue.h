@@ -0,0 +1,133 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// Blocking multi-producer multi-consumer queue with a fixed capacity.
+//
+// Producers block while the queue is full (backpressure), consumers block while it is empty. close() lets the
+// consumers drain what is left, cancel() drops it; after either, push() fails and never blocks again.
+template<typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity == 0 ? 1 : capacity), closed_(false) {}
+
+    BoundedQueue(const BoundedQueue &) = delete;
+
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    // Returns false (and drops the item) if the queue was closed.
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+        if (closed_) {
+            return false;
+        }
+        items_.push_back(std::move(item));
+        lock.unlock();
+        not_empty_.notify_one();
+        full_batch_.notify_all();
+        return true;
+    }
+
+    // nullopt once the queue is closed and drained.
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+        if (items_.empty()) {
+            return std::nullopt;
+        }
+        T item = std::move(items_.front());
+        items_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return item;
+    }
+
+    // Waits for a first item, then until there are `max_count` items or `max_wait` has passed since the first one
+    // arrived, and moves up to `max_count` items into `out`. Returns the number of items taken, 0 once the queue is
+    // closed and drained.
+    size_t pop_batch(std::vector<T> &out, size_t max_count, std::chrono::steady_clock::duration max_wait) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+        return take_batch(lock, out, max_count, max_wait);
+    }
+
+    // Like pop_batch, but gives up when no first item arrives within `timeout` and returns 0 then as well
+    // (closed() tells the two apart).
+    size_t pop_batch_for(std::vector<T> &out, size_t max_count, std::chrono::steady_clock::duration max_wait,
+                         std::chrono::steady_clock::duration timeout) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!not_empty_.wait_for(lock, timeout, [this] { return closed_ || !items_.empty(); })) {
+            return 0;
+        }
+        return take_batch(lock, out, max_count, max_wait);
+    }
+
+    // No more items will be pushed; consumers still get the queued ones.
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        notify_all();
+    }
+
+    // Like close(), but also drops the queued items.
+    void cancel() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+            items_.clear();
+        }
+        notify_all();
+    }
+
+    [[nodiscard]] bool closed() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return closed_;
+    }
+
+    [[nodiscard]] size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return items_.size();
+    }
+
+private:
+    size_t take_batch(std::unique_lock<std::mutex> &lock, std::vector<T> &out, size_t max_count,
+                      std::chrono::steady_clock::duration max_wait) {
+        const auto deadline = std::chrono::steady_clock::now() + max_wait;
+        // Producers blocked on a full queue can never complete the batch, so don't wait for them:
+        full_batch_.wait_until(lock, deadline, [this, max_count] {
+            return closed_ || items_.size() >= std::min(max_count, capacity_);
+        });
+        const size_t count = std::min(max_count, items_.size());
+        for (size_t i = 0; i < count; ++i) {
+            out.push_back(std::move(items_.front()));
+            items_.pop_front();
+        }
+        lock.unlock();
+        not_full_.notify_all();
+        return count;
+    }
+
+    void notify_all() {
+        not_full_.notify_all();
+        not_empty_.notify_all();
+        full_batch_.notify_all();
+    }
+
+    const size_t capacity_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::condition_variable full_batch_;
+    std::deque<T> items_;
+    bool closed_;
+};
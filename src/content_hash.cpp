@@ -0,0 +1,216 @@
+#include "content_hash.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+    constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+    constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+    constexpr uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+    constexpr uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+    constexpr uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+
+    constexpr size_t kPartialHashBlock = 64 * 1024;
+    constexpr size_t kReadBlock = 1024 * 1024;
+
+    uint64_t rotl(uint64_t value, int bits) {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    uint64_t read64(const uint8_t *data) {
+        uint64_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    uint32_t read32(const uint8_t *data) {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    uint64_t round(uint64_t accumulator, uint64_t input) {
+        accumulator += input * kPrime2;
+        accumulator = rotl(accumulator, 31);
+        return accumulator * kPrime1;
+    }
+
+    uint64_t merge_round(uint64_t accumulator, uint64_t value) {
+        accumulator ^= round(0, value);
+        return accumulator * kPrime1 + kPrime4;
+    }
+
+    // Reads up to `size` bytes at `offset`, returns the number of bytes read.
+    size_t read_at(int fd, uint8_t *buffer, size_t size, uint64_t offset) {
+        size_t done = 0;
+        while (done < size) {
+            ssize_t result = pread(fd, buffer + done, size - done, static_cast<off_t>(offset + done));
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Failed to read file: " + std::string(std::strerror(errno)));
+            }
+            if (result == 0) {
+                break;
+            }
+            done += result;
+        }
+        return done;
+    }
+
+    struct FileDescriptor {
+        explicit FileDescriptor(const boost::filesystem::path &path)
+                : fd(open(path.c_str(), O_RDONLY | O_CLOEXEC)) {
+            if (fd < 0) {
+                throw std::runtime_error("Failed to open file: " + path.generic_string());
+            }
+        }
+
+        ~FileDescriptor() {
+            close(fd);
+        }
+
+        int fd;
+    };
+}
+
+Xxh64::Xxh64(uint64_t seed)
+        : accumulators_{seed + kPrime1 + kPrime2, seed + kPrime2, seed, seed - kPrime1},
+          buffer_{},
+          buffered_(0),
+          total_size_(0),
+          seed_(seed) {
+
+}
+
+void Xxh64::update(const void *data, size_t size) {
+    const auto *input = static_cast<const uint8_t *>(data);
+    total_size_ += size;
+
+    if (buffered_ + size < sizeof(buffer_)) {
+        std::memcpy(buffer_ + buffered_, input, size);
+        buffered_ += size;
+        return;
+    }
+
+    if (buffered_ > 0) {
+        const size_t fill = sizeof(buffer_) - buffered_;
+        std::memcpy(buffer_ + buffered_, input, fill);
+        for (size_t lane = 0; lane < 4; ++lane) {
+            accumulators_[lane] = round(accumulators_[lane], read64(buffer_ + lane * 8));
+        }
+        input += fill;
+        size -= fill;
+        buffered_ = 0;
+    }
+
+    while (size >= sizeof(buffer_)) {
+        for (size_t lane = 0; lane < 4; ++lane) {
+            accumulators_[lane] = round(accumulators_[lane], read64(input + lane * 8));
+        }
+        input += sizeof(buffer_);
+        size -= sizeof(buffer_);
+    }
+
+    std::memcpy(buffer_, input, size);
+    buffered_ = size;
+}
+
+uint64_t Xxh64::digest() const {
+    uint64_t hash;
+    if (total_size_ >= sizeof(buffer_)) {
+        hash = rotl(accumulators_[0], 1) + rotl(accumulators_[1], 7) +
+               rotl(accumulators_[2], 12) + rotl(accumulators_[3], 18);
+        for (uint64_t accumulator: accumulators_) {
+            hash = merge_round(hash, accumulator);
+        }
+    } else {
+        hash = seed_ + kPrime5;
+    }
+    hash += total_size_;
+
+    const uint8_t *tail = buffer_;
+    size_t remaining = buffered_;
+    while (remaining >= 8) {
+        hash ^= round(0, read64(tail));
+        hash = rotl(hash, 27) * kPrime1 + kPrime4;
+        tail += 8;
+        remaining -= 8;
+    }
+    if (remaining >= 4) {
+        hash ^= static_cast<uint64_t>(read32(tail)) * kPrime1;
+        hash = rotl(hash, 23) * kPrime2 + kPrime3;
+        tail += 4;
+        remaining -= 4;
+    }
+    while (remaining > 0) {
+        hash ^= *tail * kPrime5;
+        hash = rotl(hash, 11) * kPrime1;
+        ++tail;
+        --remaining;
+    }
+
+    hash ^= hash >> 33;
+    hash *= kPrime2;
+    hash ^= hash >> 29;
+    hash *= kPrime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+uint64_t PartialFileHash(const boost::filesystem::path &path, uint64_t size) {
+    FileDescriptor file(path);
+    Xxh64 hash;
+    hash.update(&size, sizeof(size));
+
+    std::vector<uint8_t> buffer(kPartialHashBlock);
+    hash.update(buffer.data(), read_at(file.fd, buffer.data(), kPartialHashBlock, 0));
+    if (size > kPartialHashBlock) {
+        const uint64_t tail_offset = size > 2 * kPartialHashBlock ? size - kPartialHashBlock : kPartialHashBlock;
+        hash.update(buffer.data(), read_at(file.fd, buffer.data(), kPartialHashBlock, tail_offset));
+    }
+    return hash.digest();
+}
+
+uint64_t FullFileHash(const boost::filesystem::path &path) {
+    FileDescriptor file(path);
+    posix_fadvise(file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    Xxh64 hash;
+
+    std::vector<uint8_t> buffer(kReadBlock);
+    uint64_t offset = 0;
+    while (size_t read = read_at(file.fd, buffer.data(), kReadBlock, offset)) {
+        hash.update(buffer.data(), read);
+        offset += read;
+    }
+    return hash.digest();
+}
+
+bool FilesEqual(const boost::filesystem::path &a, const boost::filesystem::path &b) {
+    FileDescriptor file_a(a);
+    FileDescriptor file_b(b);
+    posix_fadvise(file_a.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(file_b.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    std::vector<uint8_t> buffer_a(kReadBlock);
+    std::vector<uint8_t> buffer_b(kReadBlock);
+    uint64_t offset = 0;
+    while (true) {
+        const size_t read_a = read_at(file_a.fd, buffer_a.data(), kReadBlock, offset);
+        const size_t read_b = read_at(file_b.fd, buffer_b.data(), kReadBlock, offset);
+        if (read_a != read_b || std::memcmp(buffer_a.data(), buffer_b.data(), read_a) != 0) {
+            return false;
+        }
+        if (read_a == 0) {
+            return true;
+        }
+        offset += read_a;
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <boost/filesystem.hpp>
+
+// Streaming XXH64 (https://github.com/Cyan4973/xxHash), a fast non-cryptographic 64-bit hash.
+class Xxh64 {
+public:
+    explicit Xxh64(uint64_t seed = 0);
+
+    void update(const void *data, size_t size);
+
+    [[nodiscard]] uint64_t digest() const;
+
+private:
+    uint64_t accumulators_[4];
+    uint8_t buffer_[32];
+    size_t buffered_;
+    uint64_t total_size_;
+    uint64_t seed_;
+};
+
+// Cheap prefilter: hash of the file size, its first and its last kPartialHashBlock bytes.
+// Files with different partial hashes are never byte-identical.
+uint64_t PartialFileHash(const boost::filesystem::path &path, uint64_t size);
+
+// Hash of the whole file content.
+uint64_t FullFileHash(const boost::filesystem::path &path);
+
+// Whether the two files have the same content, compared byte for byte. Hashes only tell files apart.
+bool FilesEqual(const boost::filesystem::path &a, const boost::filesystem::path &b);
@@ -1,6 +1,7 @@
 #include "context.h"
 
 #include <processors/image_processor.h>
+#include <processors/perceptual_hash_processor.h>
 
 Context::Context(const std::string &config_path) {
     try {
@@ -12,6 +13,13 @@ Context::Context(const std::string &config_path) {
 
     spdlog::set_pattern(config_tree_.get<std::string>("log_pattern"));
     spdlog::set_level(spdlog::level::from_str(config_tree_.get<std::string>("log_level")));
+
+    metrics_ = std::make_unique<Metrics>(config_tree_);
+    worker_pool_ = std::make_unique<ThreadPool>(config_tree_.get<size_t>("scheduler.worker_threads"));
+    scheduler_ = std::make_unique<ProcessorScheduler>(config_tree_.get<size_t>("scheduler.parallel_tasks"));
+    file_transfer_ = std::make_unique<FileTransfer>(config_tree_.get<size_t>("file_transfer.threads"),
+                                                    config_tree_.get<size_t>("file_transfer.queue_capacity"),
+                                                    config_tree_.get<size_t>("file_transfer.sync_batch"));
 }
 
 ObjectDatabase &Context::get_input_database() {
@@ -62,32 +70,96 @@ void Context::update_databases() {
 void Context::initialize_processors() {
     spdlog::info("Initializing processors...");
 
+    if (config_tree_.get<bool>("image_cache.enabled")) {
+        // Big enough for the processor that needs the most pixels:
+        const int short_side = config_tree_.get<bool>("image_processor.enabled")
+                               ? ImageProcessor::kInputSize : PerceptualHashProcessor::kMinDecodeSize;
+        image_cache_ = std::make_unique<ImageCache>(config_tree_.get<size_t>("image_cache.budget_mb") << 20,
+                                                    short_side);
+        spdlog::info("Image cache: {} MB, images downscaled to a short side of {}",
+                     config_tree_.get<size_t>("image_cache.budget_mb"), short_side);
+    }
+
+    if (config_tree_.get<bool>("perceptual_hash_processor.enabled")) {
+        spdlog::info("Initializing perceptual hash processor...");
+        perceptual_hash_processor_ = std::make_shared<PerceptualHashProcessor>(*this);
+        prefilter_processors_.emplace_back(perceptual_hash_processor_);
+        spdlog::info("Perceptual hash processor initialized");
+    }
+
     if (config_tree_.get<bool>("image_processor.enabled")) {
         spdlog::info("Initializing image processor...");
-        spdlog::info("Using model: {}", boost::filesystem::absolute(
-                config_tree_.get<std::string>("image_processor.model_path")).generic_string());
-        processors_.emplace_back(std::make_shared<ImageProcessor>(*this));
+        const auto model_path = config_tree_.get<bool>("image_processor.int8.enabled")
+                                ? config_tree_.get<std::string>("image_processor.int8.model_path")
+                                : config_tree_.get<std::string>("image_processor.model_path");
+        spdlog::info("Using model: {}", boost::filesystem::absolute(model_path).generic_string());
+        image_processor_ = std::make_shared<ImageProcessor>(*this);
+        processors_.emplace_back(image_processor_);
         spdlog::info("Image processor initialized");
     }
 
     spdlog::info("Processors initialized");
 }
 
+PerceptualHashProcessor *Context::get_perceptual_hash_processor() const {
+    return perceptual_hash_processor_.get();
+}
+
+ImageProcessor *Context::get_image_processor() const {
+    return image_processor_.get();
+}
+
+ImageCache *Context::get_image_cache() const {
+    return image_cache_.get();
+}
+
+FileTransfer &Context::get_file_transfer() {
+    return *file_transfer_;
+}
+
+ThreadPool &Context::get_worker_pool() {
+    return *worker_pool_;
+}
+
+Metrics &Context::get_metrics() {
+    return *metrics_;
+}
+
+void Context::prefilter_databases() {
+    run_processors(prefilter_processors_);
+}
+
 void Context::process_databases() {
-    spdlog::info("Processing input database...");
+    run_processors(processors_);
+}
 
-    for (const auto &processor: processors_) {
-        spdlog::info("Processing input database with processor: {}", processor->GetName());
-        processor->Process(get_input_database());
+void Context::run_processors(const std::vector<std::shared_ptr<Processor>> &processors) {
+    Span span(*metrics_, "run_processors");
+    spdlog::info("Processing input and output database...");
+    scheduler_->Run(processors, {input_db_.get(), output_db_.get()});
+    input_db_->invalidate_index();
+    output_db_->invalidate_index();
+    if (image_cache_) {
+        image_cache_->LogStatistics();
     }
+    spdlog::info("Input and output database processed");
+}
 
-    spdlog::info("Input database processed");
 
-    spdlog::info("Processing output database...");
-    for (const auto &processor: processors_) {
-        spdlog::info("Processing output database with processor: {}", processor->GetName());
-        processor->Process(get_output_database());
+void Context::save_databases() {
+    // Records are only worth saving for files that are in place:
+    if (file_transfer_->Wait() > 0) {
+        spdlog::warn("Some files couldn't be moved, they are left in the input directory");
     }
 
-    spdlog::info("Output database processed");
-}
+    Span span(*metrics_, "save_databases");
+    spdlog::info("Saving database features...");
+    try {
+        input_db_->Save();
+        output_db_->Save();
+    } catch (const std::exception &e) {
+        spdlog::error("Failed to save database features: {}", e.what());
+        return;
+    }
+    spdlog::info("Database features saved");
+}
\ No newline at end of file
@@ -11,9 +11,16 @@
 
 #include <spdlog/spdlog.h>
 
+#include <file_transfer.h>
+#include <image_cache.h>
+#include <metrics.h>
 #include <utils.h>
 #include <object_database.h>
 #include <processors/processor.h>
+#include <processors/processor_scheduler.h>
+#include <thread_pool.h>
+
+class PerceptualHashProcessor;
 
 class Context {
 public:
@@ -31,13 +38,49 @@ public:
 
     void initialize_processors();
 
+    // The processors by type, nullptr when disabled or not initialized yet:
+    [[nodiscard]] PerceptualHashProcessor *get_perceptual_hash_processor() const;
+
+    [[nodiscard]] ImageProcessor *get_image_processor() const;
+
+    // Decoded images shared by the processors, nullptr when "image_cache.enabled" is off:
+    [[nodiscard]] ImageCache *get_image_cache() const;
+
+    // Moves and copies files between the databases, see "file_transfer":
+    [[nodiscard]] FileTransfer &get_file_transfer();
+
+    // Persistent workers for the CPU-bound parts of processors, see "scheduler.worker_threads":
+    [[nodiscard]] ThreadPool &get_worker_pool();
+
+    // Pipeline metrics and the trace, see "metrics" and "trace":
+    [[nodiscard]] Metrics &get_metrics();
+
+    // Runs the cheap processors whose results settle obvious duplicates before the expensive ones run:
+    void prefilter_databases();
+
     void process_databases();
 
+    void save_databases();
+
 private:
     boost::property_tree::ptree config_tree_;
 
+    // Destroyed last, everything else may still update it:
+    std::unique_ptr<Metrics> metrics_;
+
     std::shared_ptr<ObjectDatabase> input_db_;
     std::shared_ptr<ObjectDatabase> output_db_;
 
+    std::unique_ptr<ThreadPool> worker_pool_;
+    std::unique_ptr<FileTransfer> file_transfer_;
+    std::unique_ptr<ImageCache> image_cache_;
+    std::unique_ptr<ProcessorScheduler> scheduler_;
+
+    void run_processors(const std::vector<std::shared_ptr<Processor>> &processors);
+
+    std::vector<std::shared_ptr<Processor>> prefilter_processors_;
     std::vector<std::shared_ptr<Processor>> processors_;
+
+    std::shared_ptr<PerceptualHashProcessor> perceptual_hash_processor_;
+    std::shared_ptr<ImageProcessor> image_processor_;
 };
@@ -0,0 +1,404 @@
+#include "deduplicator.h"
+
+#include <bit>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <thread>
+
+#include <bounded_queue.h>
+#include <processors/image_processor.h>
+#include <processors/perceptual_hash_processor.h>
+
+namespace {
+    // Files handed from the input scan to the pipeline at most at a time, and how long a batch waits to fill up:
+    constexpr size_t kStreamBatchSize = 256;
+    constexpr std::chrono::milliseconds kStreamBatchWait(50);
+    // Files found but not looked at yet, before the walker has to wait:
+    constexpr size_t kStreamQueueCapacity = 64 * 1024;
+    // dHashes with fewer set or cleared bits than this come from flat or low-texture images (night sky, snow,
+    // documents), which all hash alike; they tell nothing either way:
+    constexpr int kMinHashEntropyBits = 8;
+}
+
+Deduplicator::Deduplicator(Context &ctx)
+        : ctx_(ctx),
+          metrics_(ctx_.get_metrics()),
+          resolve_exact_seconds_(metrics_.get_histogram(
+                  "image_warrior_resolve_exact_seconds", "Looking for a byte-identical copy of an input object",
+                  Metrics::LatencyBounds())),
+          resolve_perceptual_seconds_(metrics_.get_histogram(
+                  "image_warrior_resolve_perceptual_seconds", "Settling an input object by its perceptual hash",
+                  Metrics::LatencyBounds())),
+          resolve_by_features_seconds_(metrics_.get_histogram(
+                  "image_warrior_resolve_by_features_seconds", "Settling an input object by its features",
+                  Metrics::LatencyBounds())),
+          moved_count_(metrics_.get_counter(
+                  "image_warrior_objects_moved_total", "Input objects moved to the output database")),
+          removed_count_(metrics_.get_counter(
+                  "image_warrior_objects_removed_total", "Input objects removed as duplicates")),
+          perceptual_enabled_(ctx_.get_config_tree().get<bool>("perceptual_hash_processor.enabled")),
+          perceptual_duplicate_distance_(ctx_.get_config_tree().get<int>("dedupe.perceptual_duplicate_distance")),
+          perceptual_distinct_distance_(ctx_.get_config_tree().get<int>("dedupe.perceptual_distinct_distance")),
+          similarity_threshold_(ctx_.get_config_tree().get<float>("dedupe.similarity_threshold")) {
+
+}
+
+void Deduplicator::Run() {
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    // Byte-identical re-imports are resolved from content hashes alone, before any of them gets to a processor:
+    RemoveExactDuplicates();
+
+    ctx_.prefilter_databases();
+    if (perceptual_enabled_) {
+        // Perceptual hashes settle the obvious cases, only the ambiguous ones are left for the CNN:
+        ResolvePerceptualDuplicates();
+    }
+
+    ctx_.process_databases();
+    ctx_.save_databases();
+    auto end_time = std::chrono::high_resolution_clock::now();
+    long elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
+    spdlog::info("Done preprocessing in {}s", static_cast<double>(elapsed_ms) / 1000.0);
+
+    spdlog::info("Copying unique objects...");
+    start_time = std::chrono::high_resolution_clock::now();
+    size_t copy_count = MoveUniqueObjects();
+    end_time = std::chrono::high_resolution_clock::now();
+    elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
+    spdlog::info("Done copying unique objects in {}s", static_cast<double>(elapsed_ms) / 1000.0);
+    spdlog::info("Copied {} objects", copy_count);
+
+    ctx_.save_databases();
+}
+
+void Deduplicator::RunStreaming() {
+    const auto start_time = std::chrono::steady_clock::now();
+    auto seconds_since_start = [&start_time]() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    };
+    auto &input_db = ctx_.get_input_database();
+    auto &output_db = ctx_.get_output_database();
+
+    // The walker threads push what they find, bounded so a huge tree doesn't pile up in memory while the model loads:
+    BoundedQueue<FileEntry> discovered(kStreamQueueCapacity);
+    std::exception_ptr scan_error;
+    std::thread scanning_thread([&input_db, &discovered, &scan_error]() {
+        try {
+            input_db.Scan([&discovered](std::vector<FileEntry> &&entries) {
+                for (auto &entry: entries) {
+                    if (!discovered.push(std::move(entry))) {
+                        return;
+                    }
+                }
+            });
+        } catch (...) {
+            scan_error = std::current_exception();
+        }
+        discovered.close();
+    });
+
+    // Stops the scan if anything below throws, so the thread can be joined:
+    struct ScanGuard {
+        BoundedQueue<FileEntry> &discovered;
+        std::thread &thread;
+
+        ~ScanGuard() {
+            discovered.cancel();
+            thread.join();
+        }
+    } scan_guard{discovered, scanning_thread};
+
+    // Loading the model is mostly disk and graph optimization, neither of which the scans need:
+    auto processors_initialized = std::async(std::launch::async, [this]() {
+        ctx_.initialize_processors();
+    });
+    spdlog::info("Updating output database...");
+    output_db.Update();
+    spdlog::info("Output database updated, size: {}", output_db.size());
+    processors_initialized.get();
+
+    // The input database is still empty here, the processors only have to catch up on the output database:
+    ctx_.prefilter_databases();
+    ctx_.process_databases();
+
+    auto *perceptual_hash_processor = perceptual_enabled_ ? ctx_.get_perceptual_hash_processor() : nullptr;
+    auto *image_processor = ctx_.get_image_processor();
+
+    StderrSuppressor stderr_suppressor;
+
+    // Features arrive on the processing thread, but the databases are only touched here:
+    std::mutex features_mutex;
+    std::vector<std::pair<boost::filesystem::path, std::vector<float>>> features;
+    std::shared_ptr<ImageProcessor::Job> job;
+    if (image_processor) {
+        job = image_processor->Start([&features_mutex, &features](const boost::filesystem::path &path,
+                                                            std::span<const float> image_features) {
+            std::lock_guard<std::mutex> lock(features_mutex);
+            features.emplace_back(path, std::vector<float>(image_features.begin(), image_features.end()));
+        });
+    }
+
+    size_t discovered_count = 0;
+    size_t moved_count = 0;
+    size_t removed_count = 0;
+    auto count = [&](Outcome outcome) {
+        if (outcome == Outcome::MOVED && moved_count++ == 0) {
+            spdlog::info("First object moved after {:.2f}s", seconds_since_start());
+        } else if (outcome == Outcome::REMOVED) {
+            ++removed_count;
+        }
+        return outcome != Outcome::UNDECIDED;
+    };
+    auto settle_processed = [&]() {
+        std::vector<std::pair<boost::filesystem::path, std::vector<float>>> processed;
+        {
+            std::lock_guard<std::mutex> lock(features_mutex);
+            processed.swap(features);
+        }
+        for (const auto &[path, image_features]: processed) {
+            const auto &object = input_db.find_by_path(path);
+            input_db.set_features(object, image_features, image_processor->GetModelId());
+            count(resolve_by_features(object));
+        }
+    };
+
+    std::vector<FileEntry> entries;
+    while (true) {
+        entries.clear();
+        if (discovered.pop_batch_for(entries, kStreamBatchSize, kStreamBatchWait, kStreamBatchWait) == 0) {
+            // Nothing can be pushed once closed, so an empty closed queue stays empty:
+            if (discovered.closed() && discovered.size() == 0) {
+                break;
+            }
+            ScopedBatch input_batch(input_db);
+            ScopedBatch output_batch(output_db);
+            settle_processed();
+            continue;
+        }
+        ScopedBatch input_batch(input_db);
+        ScopedBatch output_batch(output_db);
+        auto objects = input_db.AddEntries(entries);
+        discovered_count += objects.size();
+
+        std::erase_if(objects, [&](const std::shared_ptr<Object> &object) {
+            return count(resolve_exact(object));
+        });
+        if (perceptual_hash_processor) {
+            perceptual_hash_processor->ProcessObjects(input_db, objects);
+            // Features settle objects all along, an image moved without them would let its near-duplicates in:
+            std::erase_if(objects, [&](const std::shared_ptr<Object> &object) {
+                return count(resolve_perceptually(object, false));
+            });
+        }
+        for (const auto &object: objects) {
+            // Objects with up-to-date stored features don't have to wait for the model:
+            if (!image_processor || !image_processor->NeedsFeatures(*object)) {
+                count(resolve_by_features(object));
+            } else if (!image_processor->Submit(*job, object->path_)) {
+                // Processing failed, Finish rethrows the error:
+                break;
+            }
+        }
+        settle_processed();
+        spdlog::info("Discovered {} objects, moved {}, removed {}\033[A", discovered_count, moved_count,
+                     removed_count);
+    }
+    if (scan_error) {
+        std::rethrow_exception(scan_error);
+    }
+    if (image_processor) {
+        image_processor->Finish(*job);
+        ScopedBatch input_batch(input_db);
+        ScopedBatch output_batch(output_db);
+        settle_processed();
+    }
+    spdlog::info("Discovered {} objects, moved {}, removed {}", discovered_count, moved_count, removed_count);
+
+    // Images that failed to load are left, settled the same way Run settles them:
+    if (input_db.size() > 0) {
+        MoveUniqueObjects();
+    }
+    ctx_.save_databases();
+    spdlog::info("Done streaming in {:.1f}s", seconds_since_start());
+}
+
+void Deduplicator::ResolveObjects(std::vector<std::shared_ptr<Object>> objects) {
+    Span span(metrics_, "resolve_objects");
+    auto &input_db = ctx_.get_input_database();
+    auto &output_db = ctx_.get_output_database();
+    size_t moved_count = 0;
+    size_t removed_count = 0;
+    auto count = [&](Outcome outcome) {
+        if (outcome == Outcome::MOVED) {
+            ++moved_count;
+        } else if (outcome == Outcome::REMOVED) {
+            ++removed_count;
+        }
+        return outcome != Outcome::UNDECIDED;
+    };
+
+    // Moved by their perceptual hash, in the output database without features:
+    std::vector<std::shared_ptr<Object>> moved;
+    {
+        ScopedBatch input_batch(input_db);
+        ScopedBatch output_batch(output_db);
+        std::erase_if(objects, [&](const std::shared_ptr<Object> &object) {
+            return count(resolve_exact(object));
+        });
+        if (auto *perceptual_hash_processor = perceptual_enabled_ ? ctx_.get_perceptual_hash_processor() : nullptr) {
+            perceptual_hash_processor->ProcessObjects(input_db, objects);
+            std::erase_if(objects, [&](const std::shared_ptr<Object> &object) {
+                const auto outcome = resolve_perceptually(object);
+                if (outcome == Outcome::MOVED) {
+                    moved.push_back(object);
+                }
+                return count(outcome);
+            });
+        }
+    }
+
+    if (auto *image_processor = ctx_.get_image_processor()) {
+        // Runs on the processing thread; the databases serialize set_features:
+        auto job = image_processor->Start([&input_db, &output_db, image_processor](const boost::filesystem::path &path,
+                                                                                   std::span<const float> features) {
+            auto &db = output_db.contains(path) ? output_db : input_db;
+            db.set_features(db.find_by_path(path), features, image_processor->GetModelId());
+        });
+        // The moved objects too: find_similar only sees objects with features, without them every later
+        // near-duplicate of theirs would be moved as well.
+        for (const auto &object: moved) {
+            if (image_processor->NeedsFeatures(*object) && !image_processor->Submit(*job, object->path_)) {
+                break;
+            }
+        }
+        for (const auto &object: objects) {
+            if (image_processor->NeedsFeatures(*object) && !image_processor->Submit(*job, object->path_)) {
+                break;
+            }
+        }
+        image_processor->Finish(*job);
+    }
+
+    ScopedBatch input_batch(input_db);
+    ScopedBatch output_batch(output_db);
+    for (const auto &object: objects) {
+        count(resolve_by_features(object));
+    }
+    spdlog::info("Moved {} and removed {} new objects", moved_count, removed_count);
+}
+
+size_t Deduplicator::RemoveExactDuplicates() {
+    Span span(metrics_, "remove_exact_duplicates");
+    spdlog::info("Removing exact duplicates...");
+    auto &input_db = ctx_.get_input_database();
+    ScopedBatch input_batch(input_db);
+    size_t exact_duplicate_count = 0;
+    for (const auto &object: std::vector(input_db.get_objects())) {
+        if (resolve_exact(object) == Outcome::REMOVED) {
+            ++exact_duplicate_count;
+        }
+    }
+    spdlog::info("Removed {} exact duplicates", exact_duplicate_count);
+    return exact_duplicate_count;
+}
+
+void Deduplicator::ResolvePerceptualDuplicates() {
+    Span span(metrics_, "resolve_perceptual_duplicates");
+    spdlog::info("Resolving perceptual duplicates...");
+    auto &input_db = ctx_.get_input_database();
+    ScopedBatch input_batch(input_db);
+    ScopedBatch output_batch(ctx_.get_output_database());
+    size_t perceptual_duplicate_count = 0;
+    size_t distinct_count = 0;
+    for (const auto &object: std::vector(input_db.get_objects())) {
+        switch (resolve_perceptually(object)) {
+            case Outcome::MOVED:
+                ++distinct_count;
+                break;
+            case Outcome::REMOVED:
+                ++perceptual_duplicate_count;
+                break;
+            case Outcome::UNDECIDED:
+                break;
+        }
+    }
+    spdlog::info("Removed {} perceptual duplicates, copied {} distinct objects, {} objects are ambiguous",
+                 perceptual_duplicate_count, distinct_count, input_db.size());
+}
+
+size_t Deduplicator::MoveUniqueObjects() {
+    Span span(metrics_, "move_unique_objects");
+    auto &input_db = ctx_.get_input_database();
+    ScopedBatch input_batch(input_db);
+    ScopedBatch output_batch(ctx_.get_output_database());
+    size_t copy_count = 0;
+    auto objects = input_db.get_objects();
+    for (size_t i = 0; i < objects.size(); ++i) {
+        if (resolve_by_features(objects[i]) == Outcome::MOVED) {
+            ++copy_count;
+        }
+        spdlog::info("Processed {}/{} objects\033[A", i + 1, objects.size());
+    }
+    spdlog::info("Processed {}/{} objects", objects.size(), objects.size());
+    return copy_count;
+}
+
+Deduplicator::Outcome Deduplicator::resolve_exact(const std::shared_ptr<Object> &object) {
+    Span span(metrics_, "resolve_exact", &resolve_exact_seconds_);
+    if (auto original = ctx_.get_output_database().find_identical(object)) {
+        spdlog::debug("{} is identical to {}", object->path_.generic_string(), original->path_.generic_string());
+        ctx_.get_input_database().remove_object(object);
+        removed_count_.add();
+        return Outcome::REMOVED;
+    }
+    return Outcome::UNDECIDED;
+}
+
+Deduplicator::Outcome Deduplicator::resolve_perceptually(const std::shared_ptr<Object> &object, bool move_distinct) {
+    if (object->type_ != Object::Type::IMAGE || (!move_distinct && perceptual_duplicate_distance_ < 0)) {
+        return Outcome::UNDECIDED;
+    }
+    const auto &hash = static_cast<const ImageObject &>(*object).perceptual_hash;
+    if (!hash || std::popcount(*hash) < kMinHashEntropyBits || std::popcount(~*hash) < kMinHashEntropyBits) {
+        return Outcome::UNDECIDED;
+    }
+    Span span(metrics_, "resolve_perceptual", &resolve_perceptual_seconds_);
+    auto &input_db = ctx_.get_input_database();
+    auto &output_db = ctx_.get_output_database();
+    const auto matches = output_db.find_perceptually_similar(object, perceptual_distinct_distance_);
+    if (matches.empty()) {
+        if (!move_distinct) {
+            return Outcome::UNDECIDED;
+        }
+        spdlog::debug("Copying {}", object->path_.generic_string());
+        move_object(input_db, output_db, object);
+        moved_count_.add();
+        return Outcome::MOVED;
+    }
+    // Off by default: similar hashes are no proof (burst shots hash alike), the features have the last word.
+    if (perceptual_duplicate_distance_ >= 0 && matches.front().distance <= perceptual_duplicate_distance_) {
+        spdlog::debug("{} is a perceptual duplicate of {}", object->path_.generic_string(),
+                      matches.front().object->path_.generic_string());
+        input_db.remove_object(object);
+        removed_count_.add();
+        return Outcome::REMOVED;
+    }
+    return Outcome::UNDECIDED;
+}
+
+Deduplicator::Outcome Deduplicator::resolve_by_features(const std::shared_ptr<Object> &object) {
+    Span span(metrics_, "resolve_by_features", &resolve_by_features_seconds_);
+    auto &input_db = ctx_.get_input_database();
+    auto &output_db = ctx_.get_output_database();
+    if (output_db.find_similar(object, similarity_threshold_).empty()) {
+        spdlog::debug("Copying {}", object->path_.generic_string());
+        move_object(input_db, output_db, object);
+        moved_count_.add();
+        return Outcome::MOVED;
+    }
+    input_db.remove_object(object);
+    removed_count_.add();
+    return Outcome::REMOVED;
+}
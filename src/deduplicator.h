@@ -0,0 +1,73 @@
+#pragma once
+
+#include <context.h>
+
+// Moves the objects of the input database that aren't in the output database yet into it, and removes the rest.
+//
+// Each object is settled by the cheapest check that can tell: content hashes for byte-identical copies, perceptual
+// hashes for obviously distinct images, and CNN features for everything that is left. Perceptual hashes only remove
+// duplicates if dedupe.perceptual_duplicate_distance is set (it is -1, off, by default).
+class Deduplicator {
+public:
+    explicit Deduplicator(Context &ctx);
+
+    // Runs all the stages on the objects currently in the input database, then saves both databases.
+    // The processors must be initialized.
+    void Run();
+
+    // Scans input_dir and dedupes it as a pipeline instead of stage by stage: the model loads while the trees are
+    // scanned, each batch of new files gets the cheap checks as soon as the walker finds it, the images those leave
+    // open stream into the image processor, and each of them is settled as soon as its features exist. Perceptual
+    // hashes only remove duplicates here, distinct images are left to the features too (see resolve_perceptually).
+    // Initializes the processors, updates the output database and saves both databases.
+    void RunStreaming();
+
+    // Settles just `objects` (new input objects, e.g. found by a DirectoryWatcher) with the same checks as Run, but
+    // without running the processors over the whole databases or saving them: only these objects are hashed and
+    // processed, which keeps the latency of a small batch to seconds on any library. The processors must be
+    // initialized; saving is left to the caller.
+    void ResolveObjects(std::vector<std::shared_ptr<Object>> objects);
+
+    // Removes input objects with a byte-identical object in the output database. Returns the number removed.
+    size_t RemoveExactDuplicates();
+
+    // Settles input objects by perceptual hash. Needs the prefilter processors to have run.
+    void ResolvePerceptualDuplicates();
+
+    // Moves input objects without a similar object in the output database there and removes the others.
+    // Needs the processors to have run. Returns the number of moved objects.
+    size_t MoveUniqueObjects();
+
+private:
+    enum class Outcome {
+        UNDECIDED,
+        MOVED,
+        REMOVED,
+    };
+
+    // The checks of the stages above for a single input object:
+    Outcome resolve_exact(const std::shared_ptr<Object> &object);
+
+    // Unless `move_distinct`, an object without a similar hash is left undecided instead of moved: moved objects
+    // have no features, and while other objects are settled by theirs, find_similar can't see them.
+    Outcome resolve_perceptually(const std::shared_ptr<Object> &object, bool move_distinct = true);
+
+    Outcome resolve_by_features(const std::shared_ptr<Object> &object);
+
+    Context &ctx_;
+
+    // Metrics, see Metrics:
+    Metrics &metrics_;
+    Histogram &resolve_exact_seconds_;
+    Histogram &resolve_perceptual_seconds_;
+    Histogram &resolve_by_features_seconds_;
+    Counter &moved_count_;
+    Counter &removed_count_;
+
+    // Settings:
+    bool perceptual_enabled_;
+    // Negative: similar perceptual hashes never remove an object by themselves.
+    int perceptual_duplicate_distance_;
+    int perceptual_distinct_distance_;
+    float similarity_threshold_;
+};
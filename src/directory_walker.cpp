@@ -0,0 +1,229 @@
+#include "directory_walker.h"
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <mutex>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+namespace {
+    constexpr size_t kDirentBufferSize = 256 * 1024;
+
+    struct LinuxDirent64 {
+        ino64_t d_ino;
+        off64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+
+    class Walker {
+    public:
+        Walker(size_t threads, const std::function<bool(std::string_view)> &filter,
+               const std::function<void(std::vector<FileEntry> &&)> *on_files)
+                : filter_(filter),
+                  on_files_(on_files),
+                  queues_(std::max<size_t>(threads, 1)),
+                  results_(queues_.size()),
+                  pending_(0),
+                  queued_(0) {
+
+        }
+
+        std::vector<FileEntry> Run(const boost::filesystem::path &root) {
+            push(0, root);
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < queues_.size(); ++i) {
+                threads.emplace_back(&Walker::Worker, this, i);
+            }
+            for (auto &thread: threads) {
+                thread.join();
+            }
+
+            size_t total = 0;
+            for (const auto &result: results_) {
+                total += result.size();
+            }
+            std::vector<FileEntry> entries;
+            entries.reserve(total);
+            for (auto &result: results_) {
+                std::move(result.begin(), result.end(), std::back_inserter(entries));
+            }
+            return entries;
+        }
+
+    private:
+        struct Queue {
+            std::mutex mutex;
+            std::deque<boost::filesystem::path> dirs;
+        };
+
+        void push(size_t thread, boost::filesystem::path dir) {
+            ++pending_;
+            {
+                std::lock_guard<std::mutex> lock(queues_[thread].mutex);
+                queues_[thread].dirs.push_back(std::move(dir));
+                ++queued_;
+            }
+            wake(false);
+        }
+
+        // Taking idle_mutex_ orders the change before an idle worker's check of it, so no wakeup is lost:
+        void wake(bool all) {
+            {
+                std::lock_guard<std::mutex> lock(idle_mutex_);
+            }
+            if (all) {
+                idle_.notify_all();
+            } else {
+                idle_.notify_one();
+            }
+        }
+
+        // Newest directory of our own queue (depth first, keeps the queues short), or the oldest one of another
+        // thread (close to the root, so most likely a big subtree):
+        bool pop(size_t thread, boost::filesystem::path &dir) {
+            {
+                std::lock_guard<std::mutex> lock(queues_[thread].mutex);
+                if (!queues_[thread].dirs.empty()) {
+                    dir = std::move(queues_[thread].dirs.back());
+                    queues_[thread].dirs.pop_back();
+                    --queued_;
+                    return true;
+                }
+            }
+            for (size_t i = 1; i < queues_.size(); ++i) {
+                auto &victim = queues_[(thread + i) % queues_.size()];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (!victim.dirs.empty()) {
+                    dir = std::move(victim.dirs.front());
+                    victim.dirs.pop_front();
+                    --queued_;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void Worker(size_t thread) {
+            std::vector<char> buffer(kDirentBufferSize);
+            boost::filesystem::path dir;
+            // pending_ counts directories that are queued or being read, the walk is done when it drops to 0:
+            while (pending_ > 0) {
+                if (!pop(thread, dir)) {
+                    // The others are reading directories that may have subdirectories; wait for those or the end,
+                    // instead of spinning through a walk dominated by one huge directory:
+                    std::unique_lock<std::mutex> lock(idle_mutex_);
+                    idle_.wait(lock, [this] { return queued_ > 0 || pending_ == 0; });
+                    continue;
+                }
+                ReadDirectory(thread, dir, buffer);
+                if (on_files_ && !results_[thread].empty()) {
+                    (*on_files_)(std::move(results_[thread]));
+                    results_[thread].clear();
+                }
+                if (--pending_ == 0) {
+                    wake(true);
+                }
+            }
+        }
+
+        void ReadDirectory(size_t thread, const boost::filesystem::path &dir, std::vector<char> &buffer) {
+            const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0) {
+                spdlog::warn("Failed to open directory {}: {}", dir.generic_string(), std::strerror(errno));
+                return;
+            }
+            while (true) {
+                const long length = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+                if (length < 0) {
+                    spdlog::warn("Failed to read directory {}: {}", dir.generic_string(), std::strerror(errno));
+                    break;
+                }
+                if (length == 0) {
+                    break;
+                }
+                for (long offset = 0; offset < length;) {
+                    const auto *entry = reinterpret_cast<const LinuxDirent64 *>(buffer.data() + offset);
+                    offset += entry->d_reclen;
+                    HandleEntry(thread, fd, dir, entry->d_name, entry->d_type);
+                }
+            }
+            close(fd);
+        }
+
+        void HandleEntry(size_t thread, int dir_fd, const boost::filesystem::path &dir, const char *name,
+                         unsigned char type) {
+            const std::string_view name_view(name);
+            if (name_view == "." || name_view == "..") {
+                return;
+            }
+            if (type == DT_DIR) {
+                push(thread, dir / name);
+                return;
+            }
+            // Some file systems (NFS, older XFS) don't fill in d_type, for those statx has to tell:
+            if (type != DT_REG && type != DT_LNK && type != DT_UNKNOWN) {
+                return;
+            }
+            if (type != DT_UNKNOWN && !filter_(name_view)) {
+                return;
+            }
+
+            struct statx file_stat{};
+            const int flags = type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW;
+            if (statx(dir_fd, name, flags, STATX_TYPE | STATX_SIZE | STATX_MTIME, &file_stat) != 0) {
+                // Removed since the directory was read, or a dangling symlink:
+                return;
+            }
+            if (S_ISDIR(file_stat.stx_mode)) {
+                // Only reachable with DT_UNKNOWN; symlinks to directories aren't followed:
+                if (type == DT_UNKNOWN) {
+                    push(thread, dir / name);
+                }
+                return;
+            }
+            if (!S_ISREG(file_stat.stx_mode) || (type == DT_UNKNOWN && !filter_(name_view))) {
+                return;
+            }
+            results_[thread].push_back({dir / name, file_stat.stx_size,
+                                        static_cast<std::time_t>(file_stat.stx_mtime.tv_sec)});
+        }
+
+        const std::function<bool(std::string_view)> &filter_;
+        // Null when the results are collected:
+        const std::function<void(std::vector<FileEntry> &&)> *on_files_;
+        std::vector<Queue> queues_;
+        std::vector<std::vector<FileEntry>> results_;
+        std::atomic<size_t> pending_;
+        // Directories in the queues, waiting for a worker:
+        std::atomic<size_t> queued_;
+        // Workers without a directory to read wait on idle_ for one to be queued or the walk to end:
+        std::mutex idle_mutex_;
+        std::condition_variable idle_;
+    };
+}
+
+std::vector<FileEntry> WalkDirectory(const boost::filesystem::path &root, size_t threads,
+                                     const std::function<bool(std::string_view)> &filter) {
+    Walker walker(threads, filter, nullptr);
+    return walker.Run(root);
+}
+
+void WalkDirectory(const boost::filesystem::path &root, size_t threads,
+                   const std::function<bool(std::string_view)> &filter,
+                   const std::function<void(std::vector<FileEntry> &&)> &on_files) {
+    Walker walker(threads, filter, &on_files);
+    walker.Run(root);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+struct FileEntry {
+    boost::filesystem::path path;
+    uintmax_t size;
+    std::time_t mtime;
+};
+
+// Lists the regular files under `root` (following symlinks to files, but not to directories), on `threads` threads.
+//
+// Directories are read with getdents64 in large batches and only files accepted by `filter` (called with the file
+// name) are stat'ed, with statx relative to the open directory. Each thread works through its own stack of
+// directories and steals from the others when it runs out, so one huge subtree doesn't serialize the walk.
+// Unreadable directories are logged and skipped. The order of the result is unspecified.
+std::vector<FileEntry> WalkDirectory(const boost::filesystem::path &root, size_t threads,
+                                     const std::function<bool(std::string_view)> &filter);
+
+// Streaming variant: hands the files of each directory to `on_files` as soon as the directory is read, instead of
+// collecting everything first. `on_files` is called from the walker threads, concurrently.
+void WalkDirectory(const boost::filesystem::path &root, size_t threads,
+                   const std::function<bool(std::string_view)> &filter,
+                   const std::function<void(std::vector<FileEntry> &&)> &on_files);
@@ -0,0 +1,170 @@
+#include "directory_watcher.h"
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+namespace {
+    constexpr uint32_t kWatchMask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_MODIFY | IN_DELETE |
+                                  IN_DELETE_SELF;
+}
+
+DirectoryWatcher::DirectoryWatcher(boost::filesystem::path root, std::chrono::milliseconds settle_time)
+        : root_(std::move(root)),
+          settle_time_(settle_time),
+          inotify_fd_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+          stop_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+          stopped_(false),
+          overflow_(false) {
+    if (inotify_fd_ < 0 || stop_fd_ < 0) {
+        throw std::runtime_error("Failed to initialize inotify: " + std::string(std::strerror(errno)));
+    }
+    add_watch(root_);
+    for (const auto &entry: boost::filesystem::recursive_directory_iterator(root_)) {
+        if (boost::filesystem::is_directory(entry)) {
+            add_watch(entry.path());
+        }
+    }
+    spdlog::info("Watching {} directories under {}", watch_dirs_.size(), root_.generic_string());
+}
+
+DirectoryWatcher::~DirectoryWatcher() {
+    if (inotify_fd_ >= 0) {
+        close(inotify_fd_);
+    }
+    if (stop_fd_ >= 0) {
+        close(stop_fd_);
+    }
+}
+
+void DirectoryWatcher::add_watch(const boost::filesystem::path &dir) {
+    int wd = inotify_add_watch(inotify_fd_, dir.c_str(), kWatchMask);
+    if (wd < 0) {
+        spdlog::warn("Failed to watch {}: {}", dir.generic_string(), std::strerror(errno));
+        return;
+    }
+    watch_dirs_[wd] = dir;
+}
+
+static_assert(std::atomic<bool>::is_always_lock_free, "Stop() sets stopped_ from signal handlers");
+
+void DirectoryWatcher::Stop() {
+    stopped_ = true;
+    uint64_t one = 1;
+    // Only async-signal-safe calls in here:
+    [[maybe_unused]] auto written = write(stop_fd_, &one, sizeof(one));
+}
+
+bool DirectoryWatcher::stopped() const {
+    return stopped_;
+}
+
+bool DirectoryWatcher::take_overflow() {
+    const bool overflow = overflow_;
+    overflow_ = false;
+    return overflow;
+}
+
+std::vector<boost::filesystem::path> DirectoryWatcher::WaitForFiles(std::chrono::milliseconds timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::vector<boost::filesystem::path> settled;
+    while (!stopped_) {
+        const auto now = std::chrono::steady_clock::now();
+        for (auto it = pending_files_.begin(); it != pending_files_.end();) {
+            if (it->second.complete && now - it->second.last_event >= settle_time_) {
+                settled.emplace_back(it->first);
+                it = pending_files_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (!settled.empty() || now >= deadline) {
+            break;
+        }
+
+        // Sleep until the next event, the next file could settle, or the deadline:
+        auto wake_up = deadline;
+        for (const auto &[path, file]: pending_files_) {
+            if (file.complete) {
+                wake_up = std::min(wake_up, file.last_event + settle_time_);
+            }
+        }
+        const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(wake_up - now).count() + 1;
+        std::array<pollfd, 2> fds = {pollfd{inotify_fd_, POLLIN, 0}, pollfd{stop_fd_, POLLIN, 0}};
+        if (poll(fds.data(), fds.size(), static_cast<int>(wait)) < 0 && errno != EINTR) {
+            throw std::runtime_error("Failed to wait for inotify events: " + std::string(std::strerror(errno)));
+        }
+        if (fds[0].revents & POLLIN) {
+            read_events();
+        }
+    }
+    return settled;
+}
+
+void DirectoryWatcher::read_events() {
+    alignas(inotify_event) char buffer[64 * 1024];
+    while (true) {
+        const ssize_t length = read(inotify_fd_, buffer, sizeof(buffer));
+        if (length <= 0) {
+            // EAGAIN: drained
+            return;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        for (ssize_t offset = 0; offset < length;) {
+            const auto *event = reinterpret_cast<const inotify_event *>(buffer + offset);
+            offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                spdlog::warn("Missed file events under {}", root_.generic_string());
+                overflow_ = true;
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                watch_dirs_.erase(event->wd);
+                continue;
+            }
+            auto dir = watch_dirs_.find(event->wd);
+            if (dir == watch_dirs_.end() || event->len == 0) {
+                continue;
+            }
+            const auto path = dir->second / event->name;
+
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    // Files created before the watch was added produce no events, so report what is there already:
+                    add_watch(path);
+                    boost::system::error_code error;
+                    for (boost::filesystem::recursive_directory_iterator it(path, error), end; !error && it != end;
+                         it.increment(error)) {
+                        if (boost::filesystem::is_directory(it->path())) {
+                            add_watch(it->path());
+                        } else if (boost::filesystem::is_regular_file(it->path())) {
+                            pending_files_[it->path().native()] = {now, true};
+                        }
+                    }
+                }
+                continue;
+            }
+
+            if (event->mask & (IN_MOVED_FROM | IN_DELETE)) {
+                // E.g. a temporary file renamed to its final name:
+                pending_files_.erase(path.native());
+                continue;
+            }
+            auto &file = pending_files_[path.native()];
+            file.last_event = now;
+            if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                file.complete = true;
+            } else if (event->mask & IN_MODIFY) {
+                file.complete = false;
+            }
+        }
+    }
+}
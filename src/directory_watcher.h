@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+// Reports files that appear in a directory tree, using inotify instead of rescanning it.
+//
+// A file is reported once it was closed after writing (or moved into the tree) and then left alone for `settle_time`,
+// so files that are still being copied in are never picked up half-written. New subdirectories are watched as
+// they appear, and the files already in them are reported as well.
+class DirectoryWatcher {
+public:
+    DirectoryWatcher(boost::filesystem::path root, std::chrono::milliseconds settle_time);
+
+    ~DirectoryWatcher();
+
+    DirectoryWatcher(const DirectoryWatcher &) = delete;
+
+    DirectoryWatcher &operator=(const DirectoryWatcher &) = delete;
+
+    // Waits up to `timeout` for events and returns the files that have settled. Returns early (possibly with no files)
+    // after Stop().
+    std::vector<boost::filesystem::path> WaitForFiles(std::chrono::milliseconds timeout);
+
+    // Safe to call from a signal handler.
+    void Stop();
+
+    [[nodiscard]] bool stopped() const;
+
+    // True (once) if the kernel dropped events, in which case the caller should rescan the whole tree.
+    bool take_overflow();
+
+private:
+    void add_watch(const boost::filesystem::path &dir);
+
+    void read_events();
+
+    boost::filesystem::path root_;
+    std::chrono::milliseconds settle_time_;
+
+    int inotify_fd_;
+    // Written to by Stop(), wakes up WaitForFiles:
+    int stop_fd_;
+    // Set by Stop(), possibly from a signal handler; lock-free, so that is safe:
+    std::atomic<bool> stopped_;
+    bool overflow_;
+
+    std::unordered_map<int, boost::filesystem::path> watch_dirs_;
+
+    struct PendingFile {
+        std::chrono::steady_clock::time_point last_event;
+        // Closed after writing or moved in, i.e. complete unless it's written to again:
+        bool complete;
+    };
+    std::unordered_map<std::string, PendingFile> pending_files_;
+};
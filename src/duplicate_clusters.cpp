@@ -0,0 +1,273 @@
+#include "duplicate_clusters.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <future>
+#include <numeric>
+#include <unordered_map>
+#include <utility>
+
+#include <spdlog/spdlog.h>
+
+#include <vector_kernels.h>
+
+namespace {
+    // Same blocking as BruteForceIndex::search_batch: a tile of rows stays in cache while every query block of a
+    // band is compared against it.
+    constexpr size_t kQueryBlock = 16;
+    constexpr size_t kRowTile = 256;
+    // Rows a task compares against everything after them; the triangle makes later bands cheaper, so there are many
+    // more bands than workers to balance them:
+    constexpr size_t kBandRows = 256;
+
+    class UnionFind {
+    public:
+        explicit UnionFind(size_t size)
+                : parents_(size) {
+            std::iota(parents_.begin(), parents_.end(), 0);
+        }
+
+        size_t find(size_t element) {
+            while (parents_[element] != element) {
+                // Path halving:
+                parents_[element] = parents_[parents_[element]];
+                element = parents_[element];
+            }
+            return element;
+        }
+
+        void join(size_t a, size_t b) {
+            a = find(a);
+            b = find(b);
+            if (a != b) {
+                parents_[std::max(a, b)] = std::min(a, b);
+            }
+        }
+
+    private:
+        std::vector<size_t> parents_;
+    };
+
+    // The one to keep of a cluster: the largest file is the least likely to be a resized or recompressed copy.
+    bool keep_before(const std::shared_ptr<Object> &a, const std::shared_ptr<Object> &b) {
+        if (a->size_ != b->size_) {
+            return a->size_ > b->size_;
+        }
+        if (a->mtime_ != b->mtime_) {
+            return a->mtime_ < b->mtime_;
+        }
+        return a->path_.native() < b->path_.native();
+    }
+
+    std::string escape_json(const std::string &text) {
+        std::string escaped;
+        escaped.reserve(text.size() + 2);
+        for (char c: text) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+                escaped += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char code[8];
+                std::snprintf(code, sizeof(code), "\\u%04x", c);
+                escaped += code;
+            } else {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    std::string escape_csv(const std::string &text) {
+        if (text.find_first_of(",\"\n\r") == std::string::npos) {
+            return text;
+        }
+        std::string escaped = "\"";
+        for (char c: text) {
+            if (c == '"') {
+                escaped += '"';
+            }
+            escaped += c;
+        }
+        return escaped + "\"";
+    }
+}
+
+std::vector<DuplicateCluster> FindDuplicateClusters(const ObjectDatabase &db, float threshold, ThreadPool &pool) {
+    const auto &matrix = db.get_feature_matrix();
+    const size_t rows = matrix.rows();
+    const size_t dim = matrix.dim();
+
+    // Matrix row -> object; released rows and rows of removed objects stay null and are skipped:
+    std::vector<std::shared_ptr<Object>> row_objects(rows);
+    size_t object_count = 0;
+    for (const auto &object: db.get_objects()) {
+        if (object->type_ != Object::Type::IMAGE) {
+            continue;
+        }
+        const auto &image_object = static_cast<const ImageObject &>(*object);
+        if (image_object.has_features() && image_object.feature_matrix == &matrix) {
+            row_objects[image_object.feature_row] = object;
+            ++object_count;
+        }
+    }
+    spdlog::info("Comparing all pairs of {} images...", object_count);
+
+    // Each task takes the next band and compares it with itself and every row after it:
+    const size_t band_count = (rows + kBandRows - 1) / kBandRows;
+    std::atomic<size_t> next_band(0);
+    std::atomic<size_t> done_bands(0);
+    auto find_pairs = [&]() {
+        std::vector<std::pair<size_t, size_t>> pairs;
+        std::vector<float> scores(kQueryBlock * kRowTile);
+        // The band's rows as queries: full precision, even if the matrix stores them compressed:
+        std::vector<float> queries(kBandRows * dim);
+        std::vector<float> queries_l1(kBandRows);
+        for (size_t band = next_band++; band < band_count; band = next_band++) {
+            const size_t band_begin = band * kBandRows;
+            const size_t band_end = std::min(band_begin + kBandRows, rows);
+            for (size_t row = band_begin; row < band_end; ++row) {
+                if (row_objects[row]) {
+                    matrix.load_query(row, queries.data() + (row - band_begin) * dim);
+                    queries_l1[row - band_begin] = l1_norm(queries.data() + (row - band_begin) * dim, dim);
+                }
+            }
+            for (size_t tile = band_begin; tile < rows; tile += kRowTile) {
+                const size_t tile_rows = std::min(kRowTile, rows - tile);
+                for (size_t block = band_begin; block < band_end; block += kQueryBlock) {
+                    const size_t block_rows = std::min(kQueryBlock, band_end - block);
+                    // Tiles entirely below the diagonal were compared from the other side:
+                    if (tile + tile_rows <= block + 1) {
+                        continue;
+                    }
+                    const float *block_queries = queries.data() + (block - band_begin) * dim;
+                    matrix.dot_block(block_queries, dim, block_rows, tile, tile_rows, scores.data());
+                    for (size_t q = 0; q < block_rows; ++q) {
+                        if (!row_objects[block + q]) {
+                            continue;
+                        }
+                        // Only pairs above the diagonal:
+                        const size_t first = block + q + 1 > tile ? block + q + 1 - tile : 0;
+                        for (size_t r = first; r < tile_rows; ++r) {
+                            if (row_objects[tile + r] &&
+                                matrix.reaches(block_queries + q * dim, queries_l1[block + q - band_begin], tile + r,
+                                               scores[q * tile_rows + r], threshold)) {
+                                pairs.emplace_back(block + q, tile + r);
+                            }
+                        }
+                    }
+                }
+            }
+            spdlog::info("Compared {}/{} bands\033[A", ++done_bands, band_count);
+        }
+        return pairs;
+    };
+
+    std::vector<std::future<void>> tasks;
+    std::vector<std::vector<std::pair<size_t, size_t>>> task_pairs(pool.size());
+    for (size_t t = 0; t < pool.size(); ++t) {
+        tasks.push_back(pool.Submit([&find_pairs, &task_pairs, t]() {
+            task_pairs[t] = find_pairs();
+        }));
+    }
+    // Every task has to be done before the locals go out of scope, even if an earlier one failed:
+    std::exception_ptr error;
+    for (auto &task: tasks) {
+        try {
+            task.get();
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    spdlog::info("Compared {}/{} bands", band_count, band_count);
+
+    UnionFind groups(rows);
+    size_t pair_count = 0;
+    for (const auto &pairs: task_pairs) {
+        for (const auto &[a, b]: pairs) {
+            groups.join(a, b);
+        }
+        pair_count += pairs.size();
+    }
+
+    // Root row -> cluster:
+    std::unordered_map<size_t, size_t> cluster_of_root;
+    std::vector<DuplicateCluster> clusters;
+    for (const auto &pairs: task_pairs) {
+        for (const auto &[a, b]: pairs) {
+            const size_t root = groups.find(a);
+            if (cluster_of_root.emplace(root, clusters.size()).second) {
+                clusters.emplace_back();
+            }
+        }
+    }
+    for (size_t row = 0; row < rows; ++row) {
+        if (!row_objects[row]) {
+            continue;
+        }
+        auto it = cluster_of_root.find(groups.find(row));
+        if (it != cluster_of_root.end()) {
+            clusters[it->second].objects.push_back(row_objects[row]);
+        }
+    }
+
+    for (auto &cluster: clusters) {
+        std::sort(cluster.objects.begin(), cluster.objects.end(), keep_before);
+        for (const auto &object: cluster.objects) {
+            cluster.similarities.push_back(similarity(*cluster.objects.front(), *object));
+        }
+    }
+    std::stable_sort(clusters.begin(), clusters.end(), [](const DuplicateCluster &a, const DuplicateCluster &b) {
+        if (a.objects.size() != b.objects.size()) {
+            return a.objects.size() > b.objects.size();
+        }
+        return a.objects.front()->path_.native() < b.objects.front()->path_.native();
+    });
+    spdlog::info("Found {} pairs of similar images in {} clusters", pair_count, clusters.size());
+    return clusters;
+}
+
+void WriteClusterReport(const std::vector<DuplicateCluster> &clusters, const boost::filesystem::path &report_path) {
+    std::ofstream file(report_path.string(), std::ios::trunc);
+    if (!file) {
+        throw std::runtime_error("Failed to open cluster report for writing: " + report_path.generic_string());
+    }
+    file.imbue(std::locale::classic());
+
+    if (report_path.extension() == ".csv") {
+        file << "cluster,keeper,path,size,similarity_to_keeper\n";
+        for (size_t c = 0; c < clusters.size(); ++c) {
+            const auto &cluster = clusters[c];
+            for (size_t i = 0; i < cluster.objects.size(); ++i) {
+                file << c << "," << (i == 0 ? 1 : 0) << "," << escape_csv(cluster.objects[i]->path_.string()) << ","
+                     << cluster.objects[i]->size_ << "," << cluster.similarities[i] << "\n";
+            }
+        }
+    } else {
+        file << "{\n  \"clusters\": [";
+        for (size_t c = 0; c < clusters.size(); ++c) {
+            const auto &cluster = clusters[c];
+            file << (c > 0 ? "," : "") << "\n    {\n      \"keeper\": \""
+                 << escape_json(cluster.objects.front()->path_.string()) << "\",\n      \"objects\": [";
+            for (size_t i = 0; i < cluster.objects.size(); ++i) {
+                file << (i > 0 ? "," : "") << "\n        {\"path\": \""
+                     << escape_json(cluster.objects[i]->path_.string()) << "\", \"size\": "
+                     << cluster.objects[i]->size_ << ", \"similarity_to_keeper\": " << cluster.similarities[i] << "}";
+            }
+            file << "\n      ]\n    }";
+        }
+        file << "\n  ]\n}\n";
+    }
+
+    file.flush();
+    if (!file) {
+        throw std::runtime_error("Failed to write cluster report: " + report_path.generic_string());
+    }
+}
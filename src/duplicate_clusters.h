@@ -0,0 +1,27 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <object_database.h>
+#include <thread_pool.h>
+
+struct DuplicateCluster {
+    // Largest file first, then oldest, then by path:
+    std::vector<std::shared_ptr<Object>> objects;
+    // Similarity of each object to the keeper, objects[0]:
+    std::vector<float> similarities;
+};
+
+// Groups the image objects of `db` whose features are at least `threshold` similar, directly or through other
+// objects of the group (single linkage), largest groups first. Objects without features are left out.
+//
+// Every pair is compared, but blockwise: the upper triangle of the similarity matrix is computed in tiles with
+// FeatureMatrix::dot_block, in bands of rows spread over the pool, and only the pairs above the threshold are kept,
+// so the N x N matrix never exists. The pairs are joined with union-find.
+std::vector<DuplicateCluster> FindDuplicateClusters(const ObjectDatabase &db, float threshold, ThreadPool &pool);
+
+// Writes the clusters as JSON, or as CSV (one row per object) if `report_path` ends in .csv.
+void WriteClusterReport(const std::vector<DuplicateCluster> &clusters, const boost::filesystem::path &report_path);
@@ -0,0 +1,330 @@
+#include "feature_matrix.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+#include <vector_kernels.h>
+
+namespace {
+    constexpr size_t kAlignment = 64;
+
+    // Error bounds of the compressed forms, for normalized vectors. A half float is off by at most 2^-11 of its
+    // value, or 2^-25 for the subnormal ones; an int8 value by half of its row's scale. Both kernels and the exact
+    // comparison round their sums differently, which the slack covers:
+    constexpr float kHalfRelativeError = 1.0f / 2048.0f;
+    constexpr float kHalfSubnormalError = 1.0f / 33554432.0f;
+    constexpr float kSummationSlack = 1e-5f;
+
+    size_t element_size(FeatureMatrix::Precision precision) {
+        switch (precision) {
+            case FeatureMatrix::Precision::FP16:
+                return sizeof(uint16_t);
+            case FeatureMatrix::Precision::INT8:
+                return sizeof(int8_t);
+            default:
+                return sizeof(float);
+        }
+    }
+
+    void normalize(std::span<const float> features, float *out) {
+        float magnitude = std::sqrt(dot_product(features.data(), features.data(), features.size()));
+        float scale = magnitude > 0.0f ? 1.0f / magnitude : 0.0f;
+        for (size_t i = 0; i < features.size(); ++i) {
+            out[i] = features[i] * scale;
+        }
+    }
+}
+
+FeatureMatrix::Precision FeatureMatrix::ParsePrecision(const std::string &name) {
+    if (name == "fp32") {
+        return Precision::FP32;
+    }
+    if (name == "fp16") {
+        return Precision::FP16;
+    }
+    if (name == "int8") {
+        return Precision::INT8;
+    }
+    throw std::runtime_error("Unknown feature precision: " + name);
+}
+
+const char *FeatureMatrix::PrecisionName(Precision precision) {
+    switch (precision) {
+        case Precision::FP16:
+            return "fp16";
+        case Precision::INT8:
+            return "int8";
+        default:
+            return "fp32";
+    }
+}
+
+FeatureMatrix::FeatureMatrix(Precision precision)
+        : precision_(precision),
+          dim_(0),
+          row_bytes_(0),
+          rows_(0),
+          released_rows_(0),
+          capacity_(0),
+          reserved_rows_(0) {
+
+}
+
+size_t FeatureMatrix::add_row(std::span<const float> features, bool persistent) {
+    if (dim_ == 0) {
+        if (features.empty()) {
+            throw std::invalid_argument("Feature vector is empty");
+        }
+        dim_ = features.size();
+        row_bytes_ = (dim_ * element_size(precision_) + kAlignment - 1) / kAlignment * kAlignment;
+    } else if (features.size() != dim_) {
+        throw std::invalid_argument("Vectors are of unequal length");
+    }
+
+    if (rows_ == capacity_) {
+        grow(std::max({size_t{1024}, capacity_ * 2, reserved_rows_}));
+    }
+
+    uint8_t *destination = data_.get() + rows_ * row_bytes_;
+    const size_t used_bytes = dim_ * element_size(precision_);
+    std::memset(destination + used_bytes, 0, row_bytes_ - used_bytes);
+    released_.push_back(false);
+    if (precision_ == Precision::FP32) {
+        normalize(features, reinterpret_cast<float *>(destination));
+        return rows_++;
+    }
+
+    std::vector<float> normalized(dim_);
+    normalize(features, normalized.data());
+    if (precision_ == Precision::FP16) {
+        auto *values = reinterpret_cast<uint16_t *>(destination);
+        for (size_t i = 0; i < dim_; ++i) {
+            values[i] = float_to_half(normalized[i]);
+        }
+    } else {
+        float max_magnitude = 0.0f;
+        for (float value: normalized) {
+            max_magnitude = std::max(max_magnitude, std::abs(value));
+        }
+        const float scale = max_magnitude / 127.0f;
+        const float inverse_scale = scale > 0.0f ? 1.0f / scale : 0.0f;
+        auto *values = reinterpret_cast<int8_t *>(destination);
+        for (size_t i = 0; i < dim_; ++i) {
+            values[i] = static_cast<int8_t>(std::clamp(std::lround(normalized[i] * inverse_scale), -127L, 127L));
+        }
+        scales_.push_back(scale);
+    }
+
+    if (persistent) {
+        persistent_rows_.push_back(features.data());
+    } else {
+        if (!spill_) {
+            spill_ = std::make_unique<FeatureSpill>(dim_);
+        }
+        spill_->Write(rows_, normalized);
+        persistent_rows_.push_back(nullptr);
+    }
+    return rows_++;
+}
+
+void FeatureMatrix::clear() {
+    dim_ = 0;
+    row_bytes_ = 0;
+    rows_ = 0;
+    released_rows_ = 0;
+    released_.clear();
+    capacity_ = 0;
+    data_.reset();
+    scales_.clear();
+    persistent_rows_.clear();
+    spill_.reset();
+}
+
+void FeatureMatrix::release_row(size_t row) {
+    if (row >= rows_) {
+        throw std::out_of_range("Feature row out of range");
+    }
+    if (!released_[row]) {
+        released_[row] = true;
+        ++released_rows_;
+    }
+}
+
+std::vector<size_t> FeatureMatrix::compact() {
+    std::vector<size_t> new_rows(rows_, kReleasedRow);
+    // Spilled features go to a new file, so the space of the released ones is given back:
+    std::unique_ptr<FeatureSpill> spill;
+    size_t kept = 0;
+    for (size_t row = 0; row < rows_; ++row) {
+        if (released_[row]) {
+            continue;
+        }
+        if (kept != row) {
+            std::memcpy(data_.get() + kept * row_bytes_, row_data(row), row_bytes_);
+            if (precision_ == Precision::INT8) {
+                scales_[kept] = scales_[row];
+            }
+        }
+        if (precision_ != Precision::FP32) {
+            if (persistent_rows_[row] == nullptr) {
+                if (!spill) {
+                    spill = std::make_unique<FeatureSpill>(dim_);
+                }
+                spill->Write(kept, spill_->Read(row));
+            }
+            persistent_rows_[kept] = persistent_rows_[row];
+        }
+        new_rows[row] = kept++;
+    }
+
+    rows_ = kept;
+    released_rows_ = 0;
+    released_.assign(kept, false);
+    if (precision_ == Precision::INT8) {
+        scales_.resize(kept);
+    }
+    if (precision_ != Precision::FP32) {
+        persistent_rows_.resize(kept);
+    }
+    spill_ = std::move(spill);
+    // Give back the memory too, unless more rows are expected:
+    const size_t capacity = std::max({size_t{1024}, rows_ * 2, reserved_rows_});
+    if (dim_ != 0 && capacity < capacity_) {
+        grow(capacity);
+    }
+    return new_rows;
+}
+
+void FeatureMatrix::reserve(size_t rows) {
+    // Before the first row the dimension is unknown, so only remember the request:
+    reserved_rows_ = std::max(reserved_rows_, rows);
+    if (rows > capacity_ && dim_ != 0) {
+        grow(rows);
+    }
+}
+
+float FeatureMatrix::dot(const float *query, size_t row) const {
+    switch (precision_) {
+        case Precision::FP16:
+            return dot_product_f16(query, reinterpret_cast<const uint16_t *>(row_data(row)), dim_);
+        case Precision::INT8:
+            return dot_product_i8(query, reinterpret_cast<const int8_t *>(row_data(row)), dim_) * scales_[row];
+        default:
+            return dot_product(query, reinterpret_cast<const float *>(row_data(row)), dim_);
+    }
+}
+
+void FeatureMatrix::dot_block(const float *queries, size_t query_stride, size_t query_count, size_t first_row,
+                              size_t row_count, float *out) const {
+    const size_t row_stride = row_bytes_ / element_size(precision_);
+    switch (precision_) {
+        case Precision::FP16:
+            dot_product_block_f16(queries, query_stride, query_count,
+                                  reinterpret_cast<const uint16_t *>(row_data(first_row)), row_stride, row_count,
+                                  dim_, out);
+            break;
+        case Precision::INT8:
+            dot_product_block_i8(queries, query_stride, query_count,
+                                 reinterpret_cast<const int8_t *>(row_data(first_row)), row_stride, row_count,
+                                 dim_, out);
+            for (size_t q = 0; q < query_count; ++q) {
+                for (size_t r = 0; r < row_count; ++r) {
+                    out[q * row_count + r] *= scales_[first_row + r];
+                }
+            }
+            break;
+        default:
+            dot_product_block(queries, query_stride, query_count,
+                              reinterpret_cast<const float *>(row_data(first_row)), row_stride, row_count,
+                              dim_, out);
+    }
+}
+
+float FeatureMatrix::error_bound(size_t row, float query_l1) const {
+    switch (precision_) {
+        case Precision::FP16:
+            return kHalfRelativeError + kHalfSubnormalError * query_l1 + kSummationSlack;
+        case Precision::INT8:
+            return 0.5f * scales_[row] * query_l1 + kSummationSlack;
+        default:
+            return 0.0f;
+    }
+}
+
+bool FeatureMatrix::reaches(const float *query, float query_l1, size_t row, float score, float threshold) const {
+    if (precision_ == Precision::FP32) {
+        return score >= threshold;
+    }
+    const float bound = error_bound(row, query_l1);
+    if (score >= threshold + bound) {
+        return true;
+    }
+    if (score < threshold - bound) {
+        return false;
+    }
+    // Rows restored from a FeatureStore are kept as stored, normalize on the fly:
+    const auto exact = exact_row(row);
+    const float magnitude = std::sqrt(dot_product(exact.data(), exact.data(), dim_));
+    return magnitude > 0.0f && dot_product(query, exact.data(), dim_) / magnitude >= threshold;
+}
+
+std::span<const float> FeatureMatrix::exact_row(size_t row) const {
+    if (precision_ == Precision::FP32) {
+        return {reinterpret_cast<const float *>(row_data(row)), dim_};
+    }
+    if (persistent_rows_[row] != nullptr) {
+        return {persistent_rows_[row], dim_};
+    }
+    return spill_->Read(row);
+}
+
+void FeatureMatrix::load_query(size_t row, float *out) const {
+    if (precision_ == Precision::FP32) {
+        std::memcpy(out, row_data(row), dim_ * sizeof(float));
+    } else {
+        normalize(exact_row(row), out);
+    }
+}
+
+void FeatureMatrix::decode_row(size_t row, float *out) const {
+    switch (precision_) {
+        case Precision::FP16: {
+            const auto *values = reinterpret_cast<const uint16_t *>(row_data(row));
+            for (size_t i = 0; i < dim_; ++i) {
+                out[i] = half_to_float(values[i]);
+            }
+            break;
+        }
+        case Precision::INT8: {
+            const auto *values = reinterpret_cast<const int8_t *>(row_data(row));
+            for (size_t i = 0; i < dim_; ++i) {
+                out[i] = static_cast<float>(values[i]) * scales_[row];
+            }
+            break;
+        }
+        default:
+            std::memcpy(out, row_data(row), dim_ * sizeof(float));
+    }
+}
+
+void FeatureMatrix::grow(size_t capacity) {
+    auto *data = static_cast<uint8_t *>(std::aligned_alloc(kAlignment, capacity * row_bytes_));
+    if (data == nullptr) {
+        throw std::bad_alloc();
+    }
+    if (rows_ != 0) {
+        std::memcpy(data, data_.get(), rows_ * row_bytes_);
+    }
+    data_.reset(data);
+    capacity_ = capacity;
+    released_.reserve(capacity);
+    if (precision_ != Precision::FP32) {
+        persistent_rows_.reserve(capacity);
+    }
+    if (precision_ == Precision::INT8) {
+        scales_.reserve(capacity);
+    }
+}
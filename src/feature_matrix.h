@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <feature_spill.h>
+
+// Row-major matrix holding the L2-normalized feature vectors of one database.
+//
+// Rows are padded to a multiple of 64 bytes and the buffer is 64-byte aligned, so every row starts on a cache
+// line. Indices stay stable until compact(), which lets the similarity index refer to rows instead of keeping its own
+// copies: released rows keep their data (and index) until then, compact() moves the others down over them.
+//
+// Rows can be stored compressed, as half floats (FP16, half the memory and bandwidth) or as int8 times a per-row
+// scale (INT8, a quarter). Compressed rows are compared in that form, and since the error of such a comparison is
+// bounded, only the ones that land close to a threshold are compared again on the full precision features (see
+// reaches()), so results are the same as with FP32. The full precision features stay out of memory: rows restored
+// from a FeatureStore keep pointing into its mapping, the others are spilled to a FeatureSpill.
+class FeatureMatrix {
+public:
+    enum class Precision {
+        FP32,
+        FP16,
+        INT8,
+    };
+
+    // "fp32", "fp16" or "int8":
+    static Precision ParsePrecision(const std::string &name);
+
+    static const char *PrecisionName(Precision precision);
+
+    explicit FeatureMatrix(Precision precision = Precision::FP32);
+
+    // Copies and normalizes `features` into a new row, returns its index. With `persistent`, `features` stays valid
+    // and unchanged for the lifetime of the matrix (a mapped FeatureStore record), so a compressed row doesn't
+    // need to spill a copy of it.
+    size_t add_row(std::span<const float> features, bool persistent = false);
+
+    void release_row(size_t row);
+
+    // What compact() maps released rows to:
+    static constexpr size_t kReleasedRow = static_cast<size_t>(-1);
+
+    // Drops the released rows and their spilled features, the others keep their order. Returns the new index of
+    // every old row (kReleasedRow for the released ones). Invalidates all row indices and exact_row() spans.
+    std::vector<size_t> compact();
+
+    void reserve(size_t rows);
+
+    // Drops every row, released or not, so rows of another length can be added. Indices start over at 0.
+    void clear();
+
+    // dot(query, row) on the stored form of the row. `query` has dim() floats.
+    [[nodiscard]] float dot(const float *query, size_t row) const;
+
+    // out[q * row_count + r] = dot(queries[q], first_row + r), see dot_product_block.
+    void dot_block(const float *queries, size_t query_stride, size_t query_count, size_t first_row, size_t row_count,
+                   float *out) const;
+
+    // Whether the similarity of the full precision features of `row` and a normalized `query` is at least
+    // `threshold`, given `score`, what dot or dot_block gave for them. `query_l1` is l1_norm(query). Scores too close
+    // to the threshold for the compression error to be ruled out are recomputed in full precision.
+    [[nodiscard]] bool reaches(const float *query, float query_l1, size_t row, float score, float threshold) const;
+
+    // The features of `row` as they were added: the row itself for FP32 (normalized, and only valid until the next
+    // row is added), otherwise the full precision features (valid for the lifetime of the matrix).
+    [[nodiscard]] std::span<const float> exact_row(size_t row) const;
+
+    // Writes the normalized full precision features of `row` to `out` (dim() floats), as a query for dot and
+    // dot_block of any matrix.
+    void load_query(size_t row, float *out) const;
+
+    // Writes the stored form of `row` to `out` (dim() floats), decompressed.
+    void decode_row(size_t row, float *out) const;
+
+    [[nodiscard]] Precision precision() const {
+        return precision_;
+    }
+
+    [[nodiscard]] size_t dim() const {
+        return dim_;
+    }
+
+    // Distance between consecutive rows, in bytes:
+    [[nodiscard]] size_t row_bytes() const {
+        return row_bytes_;
+    }
+
+    // Number of rows ever added, released ones included:
+    [[nodiscard]] size_t rows() const {
+        return rows_;
+    }
+
+    [[nodiscard]] size_t live_rows() const {
+        return rows_ - released_rows_;
+    }
+
+    [[nodiscard]] size_t released_rows() const {
+        return released_rows_;
+    }
+
+private:
+    struct FreeDeleter {
+        void operator()(uint8_t *data) const {
+            std::free(data);
+        }
+    };
+
+    [[nodiscard]] const uint8_t *row_data(size_t row) const {
+        return data_.get() + row * row_bytes_;
+    }
+
+    // Largest possible |dot(query, row) - exact dot| for a normalized query:
+    [[nodiscard]] float error_bound(size_t row, float query_l1) const;
+
+    void grow(size_t capacity);
+
+    const Precision precision_;
+    size_t dim_;
+    size_t row_bytes_;
+    size_t rows_;
+    size_t released_rows_;
+    std::vector<bool> released_;
+    size_t capacity_;
+    size_t reserved_rows_;
+    std::unique_ptr<uint8_t[], FreeDeleter> data_;
+    // INT8: what each row's int8 values are multiplied by:
+    std::vector<float> scales_;
+    // Compressed: the full precision features of each row, or nullptr if they are in spill_:
+    std::vector<const float *> persistent_rows_;
+    std::unique_ptr<FeatureSpill> spill_;
+};
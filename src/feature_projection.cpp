@@ -0,0 +1,206 @@
+#include "feature_projection.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <stdexcept>
+
+#include <utils.h>
+
+namespace {
+    // Sample rows compared against all the others at a time by CompareDecisions, bounds its memory to two
+    // kCompareBlock x sample size score matrices:
+    constexpr int64_t kCompareBlock = 1024;
+    // Pairs this close to the threshold are the ones a small change of similarity can flip:
+    constexpr double kNearThreshold = 0.05;
+    // Whitening divides by the standard deviation of each component; components with less variance than this
+    // fraction of the strongest one are noise and would only be amplified:
+    constexpr double kMinWhitenedVariance = 1e-6;
+
+    torch::Tensor normalize_rows(const torch::Tensor &features) {
+        return torch::nn::functional::normalize(features, torch::nn::functional::NormalizeFuncOptions().p(2).dim(1));
+    }
+}
+
+FeatureProjection::FeatureProjection(torch::Tensor mean, torch::Tensor components, std::vector<double> variances,
+                                     double total_variance, bool whiten)
+        : mean_(std::move(mean)),
+          components_(std::move(components)),
+          bias_(-mean_.unsqueeze(0).mm(components_)),
+          variances_(std::move(variances)),
+          total_variance_(total_variance),
+          whiten_(whiten) {
+
+}
+
+FeatureProjection FeatureProjection::Fit(const torch::Tensor &samples, size_t dim, bool whiten) {
+    if (samples.dim() != 2 || samples.size(0) < 2) {
+        throw std::invalid_argument("Fitting a feature projection needs at least two feature vectors");
+    }
+    if (dim == 0) {
+        throw std::invalid_argument("A feature projection needs at least one component");
+    }
+    torch::NoGradGuard no_grad;
+
+    // In double: single precision sums over thousands of samples lose the weak components.
+    const torch::Tensor normalized = normalize_rows(samples.to(torch::kFloat64));
+    const torch::Tensor mean = normalized.mean(0);
+    const torch::Tensor centered = normalized - mean;
+    const torch::Tensor covariance = centered.t().mm(centered) / static_cast<double>(samples.size(0) - 1);
+
+    // eigh sorts the eigenvalues ascending; the strongest components go first:
+    auto [eigenvalues, eigenvectors] = torch::linalg::eigh(covariance, "L");
+    eigenvalues = eigenvalues.flip({0}).clamp_min(0.0).contiguous();
+    const auto kept = std::min<int64_t>(static_cast<int64_t>(dim), samples.size(1));
+    torch::Tensor components = eigenvectors.flip({1}).narrow(1, 0, kept);
+
+    const double *values = eigenvalues.data_ptr<double>();
+    std::vector<double> variances(values, values + kept);
+    const double total_variance = eigenvalues.sum().item<double>();
+    if (whiten) {
+        const torch::Tensor floor = (eigenvalues.narrow(0, 0, 1) * kMinWhitenedVariance).clamp_min(1e-12);
+        components = components / torch::maximum(eigenvalues.narrow(0, 0, kept), floor).sqrt();
+    }
+    return {mean.to(torch::kFloat32), components.to(torch::kFloat32).contiguous(), std::move(variances),
+            total_variance, whiten};
+}
+
+FeatureProjection FeatureProjection::Load(const boost::filesystem::path &path) {
+    std::ifstream file(path.string(), std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Failed to open feature projection: " + path.generic_string());
+    }
+    Header header{};
+    file.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!file || std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) {
+        throw std::runtime_error("Not a feature projection: " + path.generic_string());
+    }
+    if (header.version != kVersion) {
+        throw std::runtime_error("Unsupported feature projection version " + std::to_string(header.version) + ": " +
+                                 path.generic_string());
+    }
+    if (header.input_dim == 0 || header.output_dim == 0 || header.output_dim > header.input_dim) {
+        throw std::runtime_error("Corrupt feature projection: " + path.generic_string());
+    }
+
+    const auto input_dim = static_cast<int64_t>(header.input_dim);
+    const auto output_dim = static_cast<int64_t>(header.output_dim);
+    std::vector<double> variances(header.output_dim);
+    torch::Tensor mean = torch::empty({input_dim}, torch::kFloat32);
+    torch::Tensor components = torch::empty({input_dim, output_dim}, torch::kFloat32);
+    file.read(reinterpret_cast<char *>(variances.data()),
+              static_cast<std::streamsize>(variances.size() * sizeof(double)));
+    file.read(reinterpret_cast<char *>(mean.data_ptr<float>()),
+              static_cast<std::streamsize>(input_dim * sizeof(float)));
+    file.read(reinterpret_cast<char *>(components.data_ptr<float>()),
+              static_cast<std::streamsize>(input_dim * output_dim * sizeof(float)));
+    if (!file) {
+        throw std::runtime_error("Truncated feature projection: " + path.generic_string());
+    }
+    return {std::move(mean), std::move(components), std::move(variances), header.total_variance,
+            header.whiten != 0};
+}
+
+void FeatureProjection::Save(const boost::filesystem::path &path) const {
+    Header header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.input_dim = static_cast<uint32_t>(input_dim());
+    header.output_dim = static_cast<uint32_t>(output_dim());
+    header.whiten = whiten_ ? 1 : 0;
+    header.total_variance = total_variance_;
+
+    const torch::Tensor mean = mean_.contiguous();
+    const torch::Tensor components = components_.contiguous();
+    auto temp_path = path;
+    temp_path += ".tmp";
+    {
+        std::ofstream file(temp_path.string(), std::ios::binary | std::ios::trunc);
+        if (!file) {
+            throw std::runtime_error("Failed to open feature projection for writing: " + temp_path.generic_string());
+        }
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(variances_.data()),
+                   static_cast<std::streamsize>(variances_.size() * sizeof(double)));
+        file.write(reinterpret_cast<const char *>(mean.data_ptr<float>()),
+                   static_cast<std::streamsize>(mean.numel() * sizeof(float)));
+        file.write(reinterpret_cast<const char *>(components.data_ptr<float>()),
+                   static_cast<std::streamsize>(components.numel() * sizeof(float)));
+        file.flush();
+        if (!file) {
+            throw std::runtime_error("Failed to write feature projection: " + temp_path.generic_string());
+        }
+    }
+    RenameDurably(temp_path, path);
+}
+
+FeatureProjection FeatureProjection::truncated(size_t dim) const {
+    const size_t kept = std::min(dim, output_dim());
+    if (kept == 0) {
+        throw std::invalid_argument("A feature projection needs at least one component");
+    }
+    return {mean_, components_.narrow(1, 0, static_cast<int64_t>(kept)).contiguous(),
+            std::vector<double>(variances_.begin(), variances_.begin() + static_cast<ptrdiff_t>(kept)),
+            total_variance_, whiten_};
+}
+
+torch::Tensor FeatureProjection::Apply(const torch::Tensor &features) const {
+    if (features.dim() != 2 || features.size(1) != mean_.size(0)) {
+        throw std::invalid_argument("Features don't match the projection: " +
+                                    std::to_string(features.dim() == 2 ? features.size(1) : 0) + " values, expected " +
+                                    std::to_string(mean_.size(0)));
+    }
+    torch::NoGradGuard no_grad;
+    return torch::addmm(bias_, normalize_rows(features.to(torch::kFloat32)), components_);
+}
+
+size_t FeatureProjection::input_dim() const {
+    return static_cast<size_t>(components_.size(0));
+}
+
+size_t FeatureProjection::output_dim() const {
+    return static_cast<size_t>(components_.size(1));
+}
+
+double FeatureProjection::explained_variance() const {
+    if (total_variance_ <= 0.0) {
+        return 1.0;
+    }
+    return std::accumulate(variances_.begin(), variances_.end(), 0.0) / total_variance_;
+}
+
+ProjectionAgreement CompareDecisions(const torch::Tensor &samples, const FeatureProjection &projection,
+                                     float threshold) {
+    torch::NoGradGuard no_grad;
+    // Both compared the way the database does, as cosine similarity:
+    const torch::Tensor full = normalize_rows(samples.to(torch::kFloat32));
+    const torch::Tensor projected = normalize_rows(projection.Apply(samples));
+    const int64_t count = samples.size(0);
+    const torch::Tensor columns = torch::arange(count).unsqueeze(0);
+
+    ProjectionAgreement agreement{0, 0, 0, 0.0};
+    for (int64_t begin = 0; begin < count; begin += kCompareBlock) {
+        const int64_t rows = std::min(kCompareBlock, count - begin);
+        const torch::Tensor full_scores = full.narrow(0, begin, rows).mm(full.t());
+        const torch::Tensor projected_scores = projected.narrow(0, begin, rows).mm(projected.t());
+        // Each pair once, above the diagonal:
+        const torch::Tensor upper = columns > torch::arange(begin, begin + rows).unsqueeze(1);
+
+        const torch::Tensor full_match = (full_scores >= threshold).logical_and(upper);
+        const torch::Tensor projected_match = (projected_scores >= threshold).logical_and(upper);
+        agreement.full_pairs += full_match.sum().item<int64_t>();
+        agreement.kept_pairs += full_match.logical_and(projected_match).sum().item<int64_t>();
+        agreement.added_pairs += projected_match.logical_and(full_match.logical_not()).sum().item<int64_t>();
+
+        const torch::Tensor near = ((full_scores - threshold).abs() <= kNearThreshold)
+                .logical_or((projected_scores - threshold).abs() <= kNearThreshold)
+                .logical_and(upper);
+        if (near.any().item<bool>()) {
+            const double change = (full_scores - projected_scores).abs().masked_select(near).max().item<double>();
+            agreement.max_change = std::max(agreement.max_change, change);
+        }
+    }
+    return agreement;
+}
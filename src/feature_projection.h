@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <torch/torch.h>
+#include <boost/filesystem.hpp>
+
+// A learned linear map from model features to much shorter vectors: PCA, optionally whitened, fitted on a sample
+// of L2-normalized features. Most dimensions of the model output hardly vary between photos, so a few hundred
+// principal components keep what tells near duplicates apart, at a fraction of the storage and comparison cost.
+//
+// Applied to a whole batch of model outputs with one matrix multiply: normalize, subtract the mean, project.
+//
+// File layout (little-endian):
+//   Header
+//   double variances[output_dim]
+//   float mean[input_dim]
+//   float components[input_dim][output_dim]
+class FeatureProjection {
+public:
+    static constexpr char kMagic[8] = {'I', 'W', 'F', 'P', 'R', 'O', 'J', 0};
+    static constexpr uint32_t kVersion = 1;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t input_dim;
+        uint32_t output_dim;
+        uint32_t whiten;
+        // Of the sample, along all components:
+        double total_variance;
+    };
+
+    // Fits on `samples` (one feature vector per row, at least two rows), keeping the `dim` strongest components
+    // (fewer if the features are shorter). Whitening scales each component to unit variance.
+    static FeatureProjection Fit(const torch::Tensor &samples, size_t dim, bool whiten);
+
+    static FeatureProjection Load(const boost::filesystem::path &path);
+
+    // Writes via a temporary file, fsync and rename, like FeatureStore::Save.
+    void Save(const boost::filesystem::path &path) const;
+
+    // The first `dim` components only, as if fitted with `dim`:
+    [[nodiscard]] FeatureProjection truncated(size_t dim) const;
+
+    // One row of features per row of `features` (float32, input_dim() columns), output_dim() floats each.
+    [[nodiscard]] torch::Tensor Apply(const torch::Tensor &features) const;
+
+    [[nodiscard]] size_t input_dim() const;
+
+    [[nodiscard]] size_t output_dim() const;
+
+    // Fraction of the sample's variance the kept components explain:
+    [[nodiscard]] double explained_variance() const;
+
+private:
+    FeatureProjection(torch::Tensor mean, torch::Tensor components, std::vector<double> variances,
+                      double total_variance, bool whiten);
+
+    // input_dim:
+    torch::Tensor mean_;
+    // input_dim x output_dim, whitening folded in:
+    torch::Tensor components_;
+    // -mean_ projected, 1 x output_dim, so Apply is a single addmm:
+    torch::Tensor bias_;
+    // Variance along each kept component, strongest first:
+    std::vector<double> variances_;
+    double total_variance_;
+    bool whiten_;
+};
+
+// How the dedupe decisions on a sample change when its features are projected.
+struct ProjectionAgreement {
+    // Pairs of the sample at least as similar as the threshold with the full features:
+    uint64_t full_pairs;
+    // ... and with the projected ones too:
+    uint64_t kept_pairs;
+    // Pairs at least as similar as the threshold only with the projected features:
+    uint64_t added_pairs;
+    // Largest change of similarity among the pairs within 0.05 of the threshold, with either features:
+    double max_change;
+};
+
+// Compares every pair of `samples` (one feature vector per row) before and after `projection`, blockwise.
+ProjectionAgreement CompareDecisions(const torch::Tensor &samples, const FeatureProjection &projection,
+                                     float threshold);
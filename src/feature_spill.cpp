@@ -0,0 +1,91 @@
+#include "feature_spill.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+namespace {
+    constexpr size_t kMinFileSize = size_t{64} << 20;
+}
+
+FeatureSpill::FeatureSpill(size_t dim)
+        : dim_(dim),
+          fd_(-1),
+          file_size_(0),
+          mapped_(nullptr),
+          mapped_size_(0) {
+    const auto dir = boost::filesystem::temp_directory_path();
+    fd_ = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd_ >= 0) {
+        return;
+    }
+    // No O_TMPFILE support (older kernels, some file systems), the name exists for a moment:
+    const auto path = dir / boost::filesystem::unique_path("image_warrior_spill_%%%%-%%%%-%%%%");
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd_ < 0) {
+        throw std::runtime_error("Failed to create feature spill file in " + dir.generic_string() + ": " +
+                                 std::strerror(errno));
+    }
+    unlink(path.c_str());
+}
+
+FeatureSpill::~FeatureSpill() {
+    for (const auto &[address, size]: mappings_) {
+        munmap(address, size);
+    }
+    close(fd_);
+}
+
+void FeatureSpill::Write(size_t index, std::span<const float> features) {
+    if (features.size() != dim_) {
+        throw std::invalid_argument("Vectors are of unequal length");
+    }
+    const size_t offset = index * dim_ * sizeof(float);
+    const size_t end = offset + features.size_bytes();
+    if (end > file_size_) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const size_t file_size = std::max({end, file_size_ * 2, kMinFileSize});
+        if (ftruncate(fd_, static_cast<off_t>(file_size)) != 0) {
+            throw std::runtime_error(std::string("Failed to extend feature spill file: ") + std::strerror(errno));
+        }
+        file_size_ = file_size;
+    }
+    const auto *data = reinterpret_cast<const char *>(features.data());
+    for (size_t written = 0; written < features.size_bytes();) {
+        const ssize_t result = pwrite(fd_, data + written, features.size_bytes() - written,
+                                      static_cast<off_t>(offset + written));
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Failed to write feature spill file: ") + std::strerror(errno));
+        }
+        written += static_cast<size_t>(result);
+    }
+}
+
+std::span<const float> FeatureSpill::Read(size_t index) const {
+    const size_t offset = index * dim_ * sizeof(float);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (offset + dim_ * sizeof(float) > mapped_size_) {
+        if (offset + dim_ * sizeof(float) > file_size_) {
+            throw std::out_of_range("Feature vector was never spilled");
+        }
+        void *address = mmap(nullptr, file_size_, PROT_READ, MAP_SHARED, fd_, 0);
+        if (address == MAP_FAILED) {
+            throw std::runtime_error(std::string("Failed to map feature spill file: ") + std::strerror(errno));
+        }
+        mappings_.emplace_back(address, file_size_);
+        mapped_ = static_cast<const uint8_t *>(address);
+        mapped_size_ = file_size_;
+    }
+    return {reinterpret_cast<const float *>(mapped_ + offset), dim_};
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Full precision feature vectors kept on disk instead of in memory, for FeatureMatrix rows stored compressed.
+//
+// Vector i lives at offset i * dim floats of an anonymous temporary file in the temp directory ($TMPDIR, see
+// boost::filesystem::temp_directory_path), never in a photo directory. It is created with O_TMPFILE where the file
+// system supports it, and unlinked right after creation elsewhere: nothing is left behind, whatever happens to the
+// process. Indices may have gaps, they are holes in a sparse file.
+// Vectors are read back through memory mappings, so rarely read ones cost page cache at most.
+class FeatureSpill {
+public:
+    explicit FeatureSpill(size_t dim);
+
+    ~FeatureSpill();
+
+    FeatureSpill(const FeatureSpill &) = delete;
+
+    FeatureSpill &operator=(const FeatureSpill &) = delete;
+
+    // Not to be called concurrently with itself, only with Read.
+    void Write(size_t index, std::span<const float> features);
+
+    // A vector that was written. Valid for the lifetime of the spill.
+    [[nodiscard]] std::span<const float> Read(size_t index) const;
+
+private:
+    const size_t dim_;
+    int fd_;
+    // The file is extended geometrically, so the mappings (which are never unmapped before destruction, spans into
+    // them are handed out) take at most twice the final size of address space:
+    mutable std::mutex mutex_;
+    size_t file_size_;
+    mutable const uint8_t *mapped_;
+    mutable size_t mapped_size_;
+    mutable std::vector<std::pair<void *, size_t>> mappings_;
+};
@@ -0,0 +1,231 @@
+#include "feature_store.h"
+
+#include <cstring>
+#include <fstream>
+#include <functional>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include <utils.h>
+
+namespace {
+    constexpr uint64_t kAlignment = 64;
+
+    uint64_t align_up(uint64_t value) {
+        return (value + kAlignment - 1) / kAlignment * kAlignment;
+    }
+
+    void write_padding(std::ofstream &file, uint64_t target_offset) {
+        static const char zeros[kAlignment] = {};
+        auto offset = static_cast<uint64_t>(file.tellp());
+        if (target_offset > offset) {
+            file.write(zeros, static_cast<std::streamsize>(target_offset - offset));
+        }
+    }
+}
+
+FeatureStore::FeatureStore(boost::filesystem::path file_path)
+        : file_path_(std::move(file_path)),
+          data_(nullptr),
+          data_size_(0),
+          header_(nullptr),
+          entries_(nullptr) {
+
+}
+
+FeatureStore::~FeatureStore() {
+    unmap();
+}
+
+void FeatureStore::unmap() {
+    if (data_ != nullptr) {
+        munmap(const_cast<uint8_t *>(data_), data_size_);
+    }
+    data_ = nullptr;
+    data_size_ = 0;
+    header_ = nullptr;
+    entries_ = nullptr;
+    index_.clear();
+}
+
+void FeatureStore::Load() {
+    unmap();
+
+    int fd = open(file_path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        spdlog::debug("No feature store at {}", file_path_.generic_string());
+        return;
+    }
+
+    struct stat file_stat{};
+    if (fstat(fd, &file_stat) != 0 || static_cast<size_t>(file_stat.st_size) < sizeof(Header)) {
+        close(fd);
+        spdlog::warn("Ignoring truncated feature store: {}", file_path_.generic_string());
+        return;
+    }
+
+    void *data = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        spdlog::warn("Failed to map feature store: {}", file_path_.generic_string());
+        return;
+    }
+
+    data_ = static_cast<const uint8_t *>(data);
+    data_size_ = file_stat.st_size;
+    header_ = reinterpret_cast<const Header *>(data_);
+
+    if (std::memcmp(header_->magic, kMagic, sizeof(kMagic)) != 0) {
+        spdlog::warn("Ignoring corrupted feature store: {}", file_path_.generic_string());
+        unmap();
+        return;
+    }
+    if (header_->version != kVersion) {
+        spdlog::info("Ignoring feature store with version {} (expected {}): {}",
+                     header_->version, kVersion, file_path_.generic_string());
+        unmap();
+        return;
+    }
+    const bool valid = header_->file_size == data_size_ &&
+                       header_->strings_offset <= data_size_ &&
+                       header_->features_offset <= data_size_ &&
+                       sizeof(Header) + header_->entry_count * sizeof(Entry) <= header_->strings_offset &&
+                       header_->features_offset + header_->feature_count * header_->dim * sizeof(float) <= data_size_;
+    if (!valid) {
+        spdlog::warn("Ignoring corrupted feature store: {}", file_path_.generic_string());
+        unmap();
+        return;
+    }
+
+    entries_ = reinterpret_cast<const Entry *>(data_ + sizeof(Header));
+    index_.reserve(header_->entry_count);
+    for (size_t i = 0; i < header_->entry_count; ++i) {
+        const Entry &entry = entries_[i];
+        if (header_->strings_offset + entry.path_offset + entry.path_length > header_->features_offset ||
+            (entry.feature_index != kNoFeatures && entry.feature_index >= header_->feature_count)) {
+            spdlog::warn("Ignoring corrupted feature store: {}", file_path_.generic_string());
+            unmap();
+            return;
+        }
+        index_.emplace(std::string_view(
+                reinterpret_cast<const char *>(data_ + header_->strings_offset + entry.path_offset),
+                entry.path_length), i);
+    }
+
+    // We are going to touch most of the entries, so let the kernel read ahead:
+    madvise(const_cast<uint8_t *>(data_), data_size_, MADV_WILLNEED);
+}
+
+void FeatureStore::Save(const std::vector<PendingRecord> &records) const {
+    uint32_t dim = 0;
+    for (const auto &record: records) {
+        if (!record.features.empty()) {
+            dim = static_cast<uint32_t>(record.features.size());
+            break;
+        }
+    }
+
+    Header header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.dim = dim;
+    header.entry_count = records.size();
+
+    std::vector<Entry> entries;
+    entries.reserve(records.size());
+    uint64_t strings_size = 0;
+    for (const auto &record: records) {
+        if (!record.features.empty() && record.features.size() != dim) {
+            throw std::invalid_argument("Feature vectors are of unequal length: " + record.relative_path);
+        }
+        Entry entry{};
+        entry.path_offset = strings_size;
+        entry.path_length = static_cast<uint32_t>(record.relative_path.size());
+        entry.size = record.size;
+        entry.mtime = record.mtime;
+        entry.model_id = record.model_id;
+        entry.partial_hash = record.partial_hash;
+        entry.content_hash = record.content_hash;
+        if (record.perceptual_hash) {
+            entry.flags |= kHasPerceptualHash;
+            entry.perceptual_hash = *record.perceptual_hash;
+        }
+        entry.feature_index = record.features.empty() ? kNoFeatures : header.feature_count++;
+        entries.push_back(entry);
+        strings_size += record.relative_path.size();
+    }
+
+    header.strings_offset = align_up(sizeof(Header) + entries.size() * sizeof(Entry));
+    header.features_offset = align_up(header.strings_offset + strings_size);
+    header.file_size = header.features_offset + header.feature_count * dim * sizeof(float);
+
+    auto temp_path = file_path_;
+    temp_path += ".tmp";
+    {
+        std::ofstream file(temp_path.string(), std::ios::binary | std::ios::trunc);
+        if (!file) {
+            throw std::runtime_error("Failed to open feature store for writing: " + temp_path.generic_string());
+        }
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(entries.data()),
+                   static_cast<std::streamsize>(entries.size() * sizeof(Entry)));
+        write_padding(file, header.strings_offset);
+        for (const auto &record: records) {
+            file.write(record.relative_path.data(), static_cast<std::streamsize>(record.relative_path.size()));
+        }
+        write_padding(file, header.features_offset);
+        for (const auto &record: records) {
+            file.write(reinterpret_cast<const char *>(record.features.data()),
+                       static_cast<std::streamsize>(record.features.size_bytes()));
+        }
+        file.flush();
+        if (!file) {
+            throw std::runtime_error("Failed to write feature store: " + temp_path.generic_string());
+        }
+    }
+    RenameDurably(temp_path, file_path_);
+}
+
+std::optional<FeatureStore::Record> FeatureStore::find(std::string_view relative_path) const {
+    auto it = index_.find(relative_path);
+    if (it == index_.end()) {
+        return std::nullopt;
+    }
+    const Entry &entry = entries_[it->second];
+    std::span<const float> features;
+    if (entry.feature_index != kNoFeatures) {
+        features = {reinterpret_cast<const float *>(data_ + header_->features_offset) +
+                    entry.feature_index * header_->dim, header_->dim};
+    }
+    std::optional<uint64_t> perceptual_hash;
+    if (entry.flags & kHasPerceptualHash) {
+        perceptual_hash = entry.perceptual_hash;
+    }
+    return Record{entry.size, entry.mtime, entry.model_id, entry.partial_hash, entry.content_hash, perceptual_hash,
+                  features};
+}
+
+size_t FeatureStore::size() const {
+    return index_.size();
+}
+
+const boost::filesystem::path &FeatureStore::get_path() const {
+    return file_path_;
+}
+
+uint64_t FeatureStore::ModelId(const boost::filesystem::path &model_path, uint64_t variant) {
+    uint64_t id = std::hash<std::string>{}(model_path.filename().string());
+    auto combine = [&id](uint64_t value) {
+        id ^= value + 0x9e3779b97f4a7c15ULL + (id << 6) + (id >> 2);
+    };
+    combine(boost::filesystem::file_size(model_path));
+    combine(static_cast<uint64_t>(boost::filesystem::last_write_time(model_path)));
+    combine(variant);
+    // 0 means "no features":
+    return id == 0 ? 1 : id;
+}
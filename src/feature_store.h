@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+// On-disk cache of per-object data (content hashes, perceptual hashes, features), stored next to the objects of a database.
+//
+// File layout (all integers little-endian, sections 64-byte aligned):
+//   Header
+//   Entry[entry_count]
+//   path strings (relative to the database directory, not null-terminated)
+//   float features[feature_count][dim]
+//
+// The file is memory-mapped read-only on load, so lookups don't copy anything until the features are used.
+class FeatureStore {
+public:
+    static constexpr char kMagic[8] = {'I', 'W', 'F', 'S', 'T', 'O', 'R', 'E'};
+    static constexpr uint32_t kVersion = 3;
+    static constexpr uint64_t kNoFeatures = UINT64_MAX;
+    // Entry::flags:
+    static constexpr uint32_t kHasPerceptualHash = 1;
+    static constexpr const char *kFileName = ".image_warrior_features";
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t dim;
+        uint64_t entry_count;
+        uint64_t feature_count;
+        uint64_t strings_offset;
+        uint64_t features_offset;
+        uint64_t file_size;
+    };
+
+    struct Entry {
+        uint64_t path_offset;
+        uint32_t path_length;
+        uint32_t flags;
+        uint64_t size;
+        int64_t mtime;
+        uint64_t model_id;
+        uint64_t partial_hash;
+        uint64_t content_hash;
+        uint64_t perceptual_hash;
+        // Row in the features section, or kNoFeatures:
+        uint64_t feature_index;
+    };
+
+    // Hashes are 0 (or nullopt) and features empty when they were never computed:
+    struct Record {
+        uint64_t size;
+        int64_t mtime;
+        uint64_t model_id;
+        uint64_t partial_hash;
+        uint64_t content_hash;
+        std::optional<uint64_t> perceptual_hash;
+        std::span<const float> features;
+    };
+
+    struct PendingRecord {
+        std::string relative_path;
+        uint64_t size;
+        int64_t mtime;
+        uint64_t model_id;
+        uint64_t partial_hash;
+        uint64_t content_hash;
+        std::optional<uint64_t> perceptual_hash;
+        std::span<const float> features;
+    };
+
+    explicit FeatureStore(boost::filesystem::path file_path);
+
+    ~FeatureStore();
+
+    FeatureStore(const FeatureStore &) = delete;
+
+    FeatureStore &operator=(const FeatureStore &) = delete;
+
+    // Maps the store file, if there is one. A missing, truncated or outdated file leaves the store empty.
+    void Load();
+
+    // Writes a new store file (via a temporary file, fsync and rename, so a crash never leaves a torn store).
+    void Save(const std::vector<PendingRecord> &records) const;
+
+    [[nodiscard]] std::optional<Record> find(std::string_view relative_path) const;
+
+    [[nodiscard]] size_t size() const;
+
+    [[nodiscard]] const boost::filesystem::path &get_path() const;
+
+    // Identifies the model that produced a feature vector; changes whenever the model file is replaced.
+    // `variant` distinguishes different ways of running the same model (e.g. a preprocessing change).
+    static uint64_t ModelId(const boost::filesystem::path &model_path, uint64_t variant = 0);
+
+private:
+    void unmap();
+
+    boost::filesystem::path file_path_;
+
+    const uint8_t *data_;
+    size_t data_size_;
+
+    const Header *header_;
+    const Entry *entries_;
+    std::unordered_map<std::string_view, size_t> index_;
+};
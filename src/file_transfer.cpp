@@ -0,0 +1,252 @@
+#include "file_transfer.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+namespace {
+    // Largest chunk copy_file_range and sendfile are asked for at once:
+    constexpr size_t kCopyChunkSize = size_t(1) << 30;
+
+    std::runtime_error system_error(const std::string &what, const boost::filesystem::path &path) {
+        return std::runtime_error(what + " " + path.generic_string() + ": " + std::strerror(errno));
+    }
+
+    class FileDescriptor {
+    public:
+        explicit FileDescriptor(int fd) : fd_(fd) {}
+
+        ~FileDescriptor() {
+            if (fd_ >= 0) {
+                close(fd_);
+            }
+        }
+
+        FileDescriptor(const FileDescriptor &) = delete;
+
+        FileDescriptor &operator=(const FileDescriptor &) = delete;
+
+        [[nodiscard]] int get() const {
+            return fd_;
+        }
+
+    private:
+        int fd_;
+    };
+}
+
+FileTransfer::FileTransfer(size_t threads, size_t queue_capacity, size_t sync_batch_size)
+        : sync_batch_size_(std::max<size_t>(sync_batch_size, 1)),
+          queue_(queue_capacity),
+          pending_count_(0),
+          renamed_count_(0),
+          cloned_count_(0),
+          copied_count_(0),
+          failed_count_(0),
+          copied_bytes_(0) {
+    for (size_t i = 0; i < std::max<size_t>(threads, 1); ++i) {
+        threads_.emplace_back(&FileTransfer::Worker, this);
+    }
+}
+
+FileTransfer::~FileTransfer() {
+    queue_.close();
+    for (auto &thread: threads_) {
+        thread.join();
+    }
+    Sync();
+}
+
+void FileTransfer::Move(const boost::filesystem::path &source, const boost::filesystem::path &destination) {
+    Queue({source, destination, true});
+}
+
+void FileTransfer::Copy(const boost::filesystem::path &source, const boost::filesystem::path &destination) {
+    Queue({source, destination, false});
+}
+
+void FileTransfer::Queue(Transfer transfer) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_destinations_.insert(transfer.destination.native());
+        ++pending_count_;
+    }
+    queue_.push(std::move(transfer));
+}
+
+void FileTransfer::WaitFor(const boost::filesystem::path &destination) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    transfer_done_.wait(lock, [this, &destination] {
+        return !pending_destinations_.contains(destination.native());
+    });
+}
+
+size_t FileTransfer::Wait() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        transfer_done_.wait(lock, [this] { return pending_count_ == 0; });
+    }
+    const auto sync_start = std::chrono::steady_clock::now();
+    Sync();
+    const double sync_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - sync_start).count();
+
+    const size_t renamed_count = renamed_count_.exchange(0);
+    const size_t cloned_count = cloned_count_.exchange(0);
+    const size_t copied_count = copied_count_.exchange(0);
+    const uint64_t copied_bytes = copied_bytes_.exchange(0);
+    const size_t failed_count = failed_count_.exchange(0);
+    if (renamed_count + cloned_count + copied_count + failed_count > 0) {
+        spdlog::info("File transfers: {} renamed, {} cloned, {} copied ({:.1f} MB), {} failed, final sync {:.2f}s",
+                     renamed_count, cloned_count, copied_count, static_cast<double>(copied_bytes) / (1 << 20),
+                     failed_count, sync_time);
+    }
+    return failed_count;
+}
+
+void FileTransfer::Worker() {
+    while (auto transfer = queue_.pop()) {
+        try {
+            Run(*transfer);
+        } catch (const std::exception &e) {
+            spdlog::error("Failed to {} {} to {}: {}", transfer->move ? "move" : "copy",
+                          transfer->source.generic_string(), transfer->destination.generic_string(), e.what());
+            ++failed_count_;
+        }
+
+        bool sync;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_destinations_.erase(transfer->destination.native());
+            --pending_count_;
+            sync = unsynced_.size() >= sync_batch_size_;
+        }
+        transfer_done_.notify_all();
+        if (sync) {
+            Sync();
+        }
+    }
+}
+
+void FileTransfer::Run(const Transfer &transfer) {
+    if (transfer.move) {
+        if (renameat2(AT_FDCWD, transfer.source.c_str(), AT_FDCWD, transfer.destination.c_str(),
+                      RENAME_NOREPLACE) == 0) {
+            ++renamed_count_;
+            return;
+        }
+        // EINVAL: the file system doesn't support RENAME_NOREPLACE, copying is the safe way then:
+        if (errno != EXDEV && errno != EINVAL) {
+            throw system_error("Failed to rename", transfer.source);
+        }
+    }
+    CopyFile(transfer.source, transfer.destination);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    unsynced_.push_back(transfer);
+}
+
+void FileTransfer::CopyFile(const boost::filesystem::path &source, const boost::filesystem::path &destination) {
+    FileDescriptor in(open(source.c_str(), O_RDONLY | O_CLOEXEC));
+    if (in.get() < 0) {
+        throw system_error("Failed to open", source);
+    }
+    struct stat source_stat{};
+    if (fstat(in.get(), &source_stat) != 0) {
+        throw system_error("Failed to stat", source);
+    }
+    FileDescriptor out(open(destination.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                            source_stat.st_mode & 07777));
+    if (out.get() < 0) {
+        throw system_error("Failed to create", destination);
+    }
+
+    try {
+        if (ioctl(out.get(), FICLONE, in.get()) == 0) {
+            ++cloned_count_;
+        } else {
+            auto remaining = static_cast<size_t>(source_stat.st_size);
+            bool use_sendfile = false;
+            while (remaining > 0) {
+                ssize_t copied;
+                if (!use_sendfile) {
+                    copied = copy_file_range(in.get(), nullptr, out.get(), nullptr,
+                                             std::min(remaining, kCopyChunkSize), 0);
+                    // Not supported between these file systems:
+                    if (copied < 0 &&
+                        (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+                        use_sendfile = true;
+                        continue;
+                    }
+                } else {
+                    copied = sendfile(out.get(), in.get(), nullptr, std::min(remaining, kCopyChunkSize));
+                }
+                if (copied < 0) {
+                    throw system_error("Failed to copy to", destination);
+                }
+                if (copied == 0) {
+                    // The source shrank while copying:
+                    break;
+                }
+                remaining -= static_cast<size_t>(copied);
+            }
+            ++copied_count_;
+            copied_bytes_ += static_cast<uint64_t>(source_stat.st_size) - remaining;
+        }
+
+        // Keeps the mtime, which is what stored records are matched on:
+        const struct timespec times[2] = {source_stat.st_atim, source_stat.st_mtim};
+        if (futimens(out.get(), times) != 0) {
+            throw system_error("Failed to set the timestamps of", destination);
+        }
+    } catch (...) {
+        unlink(destination.c_str());
+        throw;
+    }
+}
+
+void FileTransfer::Sync() {
+    std::vector<Transfer> transfers;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        transfers.swap(unsynced_);
+    }
+    if (transfers.empty()) {
+        return;
+    }
+
+    // One syncfs per destination file system flushes the whole batch (usually everything goes to one directory):
+    std::unordered_set<std::string> synced_dirs;
+    bool synced = true;
+    for (const auto &transfer: transfers) {
+        const auto dir = transfer.destination.parent_path();
+        if (!synced_dirs.insert(dir.native()).second) {
+            continue;
+        }
+        FileDescriptor dir_fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (dir_fd.get() < 0 || syncfs(dir_fd.get()) != 0) {
+            spdlog::error("Failed to sync {}: {}", dir.generic_string(), std::strerror(errno));
+            synced = false;
+        }
+    }
+    if (!synced) {
+        // The copies may not be durable, keep the sources:
+        return;
+    }
+
+    for (const auto &transfer: transfers) {
+        if (transfer.move && unlink(transfer.source.c_str()) != 0 && errno != ENOENT) {
+            spdlog::warn("Failed to remove {} after copying it: {}", transfer.source.generic_string(),
+                         std::strerror(errno));
+        }
+    }
+}
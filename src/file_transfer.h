@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <bounded_queue.h>
+
+// Moves and copies files on a pool of worker threads, so the caller only pays for queueing them.
+//
+// A move is a rename when source and destination are on the same file system. Otherwise, and for copies, the data
+// is cloned (FICLONE, instant on btrfs/XFS) or copied in the kernel (copy_file_range, falling back to sendfile),
+// keeping the mode and timestamps. Copies are made durable in batches with one syncfs per batch instead of an fsync
+// per file; the source of a move is only unlinked once its copy is durable. Destinations are never overwritten.
+//
+// Failed transfers are logged and counted, their source is left in place.
+class FileTransfer {
+public:
+    // At most queue_capacity transfers wait for a worker, Move and Copy block beyond that.
+    FileTransfer(size_t threads, size_t queue_capacity, size_t sync_batch_size);
+
+    // Finishes the queued transfers.
+    ~FileTransfer();
+
+    FileTransfer(const FileTransfer &) = delete;
+
+    FileTransfer &operator=(const FileTransfer &) = delete;
+
+    void Move(const boost::filesystem::path &source, const boost::filesystem::path &destination);
+
+    void Copy(const boost::filesystem::path &source, const boost::filesystem::path &destination);
+
+    // Blocks until a queued transfer to `destination` is done, so the file can be read.
+    void WaitFor(const boost::filesystem::path &destination);
+
+    // Blocks until every queued transfer is done and durable. Returns the number of transfers that failed since the
+    // last call.
+    size_t Wait();
+
+private:
+    struct Transfer {
+        boost::filesystem::path source;
+        boost::filesystem::path destination;
+        bool move;
+    };
+
+    void Queue(Transfer transfer);
+
+    void Worker();
+
+    void Run(const Transfer &transfer);
+
+    void CopyFile(const boost::filesystem::path &source, const boost::filesystem::path &destination);
+
+    // syncfs on the destination file systems of the unsynced copies, then unlinks the sources of the moves among them:
+    void Sync();
+
+    const size_t sync_batch_size_;
+
+    BoundedQueue<Transfer> queue_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable transfer_done_;
+    std::unordered_set<std::string> pending_destinations_;
+    size_t pending_count_;
+    // Copies that aren't durable yet:
+    std::vector<Transfer> unsynced_;
+
+    // Statistics since the last Wait:
+    std::atomic<size_t> renamed_count_;
+    std::atomic<size_t> cloned_count_;
+    std::atomic<size_t> copied_count_;
+    std::atomic<size_t> failed_count_;
+    std::atomic<uint64_t> copied_bytes_;
+};
@@ -0,0 +1,112 @@
+#include "hamming_index.h"
+
+#include <algorithm>
+#include <bit>
+
+namespace {
+    constexpr int kChunkBits = 64 / HammingIndex::kChunks;
+    constexpr size_t kBuckets = size_t(1) << kChunkBits;
+
+    uint32_t chunk_of(uint64_t hash, int chunk) {
+        return static_cast<uint32_t>((hash >> (chunk * kChunkBits)) & (kBuckets - 1));
+    }
+
+    // Calls f(value) for every chunk value within `radius` bit flips of `value`, flipping bits from `first_bit` on:
+    template<typename F>
+    void for_each_neighbour(uint32_t value, int radius, int first_bit, F &f) {
+        f(value);
+        if (radius == 0) {
+            return;
+        }
+        for (int bit = first_bit; bit < kChunkBits; ++bit) {
+            for_each_neighbour(value ^ (uint32_t(1) << bit), radius - 1, bit + 1, f);
+        }
+    }
+}
+
+int hamming_distance(uint64_t a, uint64_t b) {
+    return std::popcount(a ^ b);
+}
+
+HammingIndex::HammingIndex() = default;
+
+void HammingIndex::add(const std::shared_ptr<Object> &object, uint64_t hash) {
+    remove(*object);
+    if (tables_[0].empty()) {
+        for (auto &table: tables_) {
+            table.resize(kBuckets);
+        }
+    }
+    uint32_t id;
+    if (free_ids_.empty()) {
+        id = static_cast<uint32_t>(entries_.size());
+        entries_.push_back({hash, object});
+    } else {
+        id = free_ids_.back();
+        free_ids_.pop_back();
+        entries_[id] = {hash, object};
+    }
+    ids_.emplace(object.get(), id);
+    for (int chunk = 0; chunk < kChunks; ++chunk) {
+        tables_[chunk][chunk_of(hash, chunk)].push_back(id);
+    }
+}
+
+void HammingIndex::remove(const Object &object) {
+    auto it = ids_.find(&object);
+    if (it == ids_.end()) {
+        return;
+    }
+    const uint32_t id = it->second;
+    ids_.erase(it);
+    auto &entry = entries_[id];
+    for (int chunk = 0; chunk < kChunks; ++chunk) {
+        // Swap-remove, the order within a bucket doesn't matter:
+        auto &bucket = tables_[chunk][chunk_of(entry.hash, chunk)];
+        *std::find(bucket.begin(), bucket.end(), id) = bucket.back();
+        bucket.pop_back();
+    }
+    entry.object.reset();
+    free_ids_.push_back(id);
+}
+
+bool HammingIndex::contains(const Object &object) const {
+    return ids_.contains(&object);
+}
+
+std::vector<HammingIndex::Match> HammingIndex::search(uint64_t hash, int max_distance) const {
+    std::vector<Match> result;
+    if (ids_.empty() || max_distance < 0) {
+        return result;
+    }
+
+    std::vector<uint32_t> candidates;
+    const int chunk_radius = std::min(max_distance / kChunks, kChunkBits);
+    for (int chunk = 0; chunk < kChunks; ++chunk) {
+        const auto &table = tables_[chunk];
+        auto collect = [&table, &candidates](uint32_t value) {
+            const auto &bucket = table[value];
+            candidates.insert(candidates.end(), bucket.begin(), bucket.end());
+        };
+        for_each_neighbour(chunk_of(hash, chunk), chunk_radius, 0, collect);
+    }
+    // The same entry is usually found through several chunks:
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    for (uint32_t id: candidates) {
+        const auto &entry = entries_[id];
+        const int distance = hamming_distance(entry.hash, hash);
+        if (distance <= max_distance) {
+            result.push_back({entry.object, distance});
+        }
+    }
+    std::stable_sort(result.begin(), result.end(), [](const Match &a, const Match &b) {
+        return a.distance < b.distance;
+    });
+    return result;
+}
+
+size_t HammingIndex::size() const {
+    return ids_.size();
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class Object;
+
+// Finds the 64-bit hashes within a small Hamming distance of a query hash (multi-index hashing).
+//
+// Hashes are split into kChunks 16-bit chunks with one table per chunk. Two hashes at distance d differ in at most
+// d / kChunks bits on at least one of their chunks, so a query only has to probe the buckets within that distance
+// of each of its chunks instead of comparing against every hash.
+class HammingIndex {
+public:
+    static constexpr int kChunks = 4;
+
+    struct Match {
+        std::shared_ptr<Object> object;
+        int distance;
+    };
+
+    HammingIndex();
+
+    // Re-adding an object replaces its hash.
+    void add(const std::shared_ptr<Object> &object, uint64_t hash);
+
+    void remove(const Object &object);
+
+    [[nodiscard]] bool contains(const Object &object) const;
+
+    // All indexed objects whose hash is within max_distance of `hash`, closest first.
+    [[nodiscard]] std::vector<Match> search(uint64_t hash, int max_distance) const;
+
+    [[nodiscard]] size_t size() const;
+
+private:
+    struct Entry {
+        uint64_t hash;
+        // Null while the id is free:
+        std::shared_ptr<Object> object;
+    };
+
+    std::vector<Entry> entries_;
+    // Ids of removed entries, reused by add. Removed ids are taken out of their buckets, so churn (watch mode moves
+    // and removes objects all day) doesn't grow the buckets:
+    std::vector<uint32_t> free_ids_;
+    std::unordered_map<const Object *, uint32_t> ids_;
+    // tables_[chunk][chunk value] -> entry ids, allocated on the first add:
+    std::array<std::vector<std::vector<uint32_t>>, kChunks> tables_;
+};
+
+int hamming_distance(uint64_t a, uint64_t b);
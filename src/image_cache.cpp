@@ -0,0 +1,92 @@
+#include "image_cache.h"
+
+#include <spdlog/spdlog.h>
+
+#include <image_decode.h>
+
+ImageCache::ImageCache(size_t byte_budget, int short_side)
+        : byte_budget_(byte_budget),
+          short_side_(short_side),
+          used_bytes_(0),
+          hit_count_(0),
+          miss_count_(0) {
+
+}
+
+cv::Mat ImageCache::Get(const boost::filesystem::path &path) {
+    const std::string &key = path.native();
+    std::promise<cv::Mat> promise;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (auto it = index_.find(key); it != index_.end()) {
+            ++hit_count_;
+            entries_.splice(entries_.begin(), entries_, it->second);
+            return it->second->image;
+        }
+        if (auto it = pending_.find(key); it != pending_.end()) {
+            ++hit_count_;
+            auto future = it->second;
+            lock.unlock();
+            return future.get();
+        }
+        ++miss_count_;
+        pending_.emplace(key, promise.get_future().share());
+    }
+
+    cv::Mat image;
+    try {
+        image = DecodeImage(path, cv::IMREAD_COLOR, short_side_);
+        if (image.empty()) {
+            throw std::runtime_error("Image is empty!");
+        }
+        const int short_side = std::min(image.cols, image.rows);
+        if (short_side > short_side_) {
+            cv::Mat downscaled;
+            const double scale = static_cast<double>(short_side_) / short_side;
+            cv::resize(image, downscaled, cv::Size(std::max(1, static_cast<int>(image.cols * scale + 0.5)),
+                                                   std::max(1, static_cast<int>(image.rows * scale + 0.5))),
+                       0, 0, cv::INTER_AREA);
+            image = downscaled;
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        promise.set_exception(std::current_exception());
+        pending_.erase(key);
+        throw;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    insert(key, image);
+    promise.set_value(image);
+    pending_.erase(key);
+    return image;
+}
+
+void ImageCache::insert(const std::string &key, const cv::Mat &image) {
+    const size_t bytes = image.total() * image.elemSize();
+    if (bytes > byte_budget_) {
+        return;
+    }
+    while (used_bytes_ + bytes > byte_budget_) {
+        used_bytes_ -= entries_.back().bytes;
+        index_.erase(entries_.back().key);
+        entries_.pop_back();
+    }
+    entries_.push_front({key, image, bytes});
+    index_.emplace(key, entries_.begin());
+    used_bytes_ += bytes;
+}
+
+int ImageCache::get_short_side() const {
+    return short_side_;
+}
+
+void ImageCache::LogStatistics() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const size_t request_count = hit_count_ + miss_count_;
+    spdlog::info("Image cache: {} hits, {} misses ({:.1f}% hit rate), {} images in {:.1f}/{:.1f} MB",
+                 hit_count_, miss_count_,
+                 request_count > 0 ? 100.0 * static_cast<double>(hit_count_) / static_cast<double>(request_count) : 0.0,
+                 entries_.size(), static_cast<double>(used_bytes_) / (1 << 20),
+                 static_cast<double>(byte_budget_) / (1 << 20));
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <future>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <opencv2/opencv.hpp>
+#include <boost/filesystem.hpp>
+
+// Decoded images shared by the processors, so a file that several of them need is read and decoded once.
+//
+// Images are decoded in color (BGR) at the lowest resolution that covers `short_side` (see DecodeImage) and
+// downscaled to exactly that short side, which bounds their size. The least recently used ones are evicted to stay
+// within the byte budget. A file requested by several threads at once is decoded by the first of them, the others
+// wait for its result.
+class ImageCache {
+public:
+    ImageCache(size_t byte_budget, int short_side);
+
+    ImageCache(const ImageCache &) = delete;
+
+    ImageCache &operator=(const ImageCache &) = delete;
+
+    // The image is shared with the cache and other processors and must not be modified.
+    // Throws std::runtime_error if the file can't be decoded.
+    cv::Mat Get(const boost::filesystem::path &path);
+
+    [[nodiscard]] int get_short_side() const;
+
+    // Logs hits, misses and memory use.
+    void LogStatistics() const;
+
+private:
+    struct Entry {
+        std::string key;
+        cv::Mat image;
+        size_t bytes;
+    };
+
+    // Requires mutex_:
+    void insert(const std::string &key, const cv::Mat &image);
+
+    const size_t byte_budget_;
+    const int short_side_;
+
+    mutable std::mutex mutex_;
+    // Most recently used first:
+    std::list<Entry> entries_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+    // Decodes in progress, so concurrent requests for the same file share one:
+    std::unordered_map<std::string, std::shared_future<cv::Mat>> pending_;
+    size_t used_bytes_;
+    size_t hit_count_;
+    size_t miss_count_;
+};
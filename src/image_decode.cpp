@@ -0,0 +1,89 @@
+#include "image_decode.h"
+
+#include <fstream>
+
+namespace {
+    uint16_t read_be16(std::istream &stream) {
+        unsigned char bytes[2] = {};
+        stream.read(reinterpret_cast<char *>(bytes), 2);
+        return static_cast<uint16_t>(bytes[0] << 8 | bytes[1]);
+    }
+
+    // Start-of-frame markers, i.e. everything in 0xC0..0xCF except DHT, JPG and DAC:
+    bool is_sof_marker(uint8_t marker) {
+        return marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+    }
+
+    int reduced_flag(int mode, int factor) {
+        const bool gray = mode == cv::IMREAD_GRAYSCALE;
+        switch (factor) {
+            case 2:
+                return gray ? cv::IMREAD_REDUCED_GRAYSCALE_2 : cv::IMREAD_REDUCED_COLOR_2;
+            case 4:
+                return gray ? cv::IMREAD_REDUCED_GRAYSCALE_4 : cv::IMREAD_REDUCED_COLOR_4;
+            case 8:
+                return gray ? cv::IMREAD_REDUCED_GRAYSCALE_8 : cv::IMREAD_REDUCED_COLOR_8;
+            default:
+                return mode;
+        }
+    }
+}
+
+std::optional<cv::Size> ReadJpegSize(const boost::filesystem::path &file_path) {
+    std::ifstream file(file_path.string(), std::ios::binary);
+    if (!file || read_be16(file) != 0xFFD8) {
+        return std::nullopt;
+    }
+    // Walk the marker segments up to the first frame header:
+    while (file) {
+        int byte = file.get();
+        if (byte != 0xFF) {
+            return std::nullopt;
+        }
+        while (byte == 0xFF) {
+            // Markers may be preceded by any number of 0xFF fill bytes:
+            byte = file.get();
+        }
+        if (byte == EOF) {
+            return std::nullopt;
+        }
+        const auto marker = static_cast<uint8_t>(byte);
+        if (marker == 0xD9 || marker == 0xDA) {
+            // End of image or start of scan before any frame header:
+            return std::nullopt;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            // Markers without a payload:
+            continue;
+        }
+        const uint16_t length = read_be16(file);
+        if (length < 2) {
+            return std::nullopt;
+        }
+        if (is_sof_marker(marker)) {
+            file.get(); // sample precision
+            const uint16_t height = read_be16(file);
+            const uint16_t width = read_be16(file);
+            if (!file || width == 0 || height == 0) {
+                return std::nullopt;
+            }
+            return cv::Size(width, height);
+        }
+        file.seekg(length - 2, std::ios::cur);
+    }
+    return std::nullopt;
+}
+
+cv::Mat DecodeImage(const boost::filesystem::path &file_path, int mode, size_t min_short_side) {
+    int factor = 1;
+    if (auto size = ReadJpegSize(file_path)) {
+        const auto short_side = static_cast<size_t>(std::min(size->width, size->height));
+        for (int candidate: {8, 4, 2}) {
+            if (short_side / candidate >= min_short_side) {
+                factor = candidate;
+                break;
+            }
+        }
+    }
+    return cv::imread(file_path.string(), reduced_flag(mode, factor));
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+
+#include <opencv2/opencv.hpp>
+#include <boost/filesystem.hpp>
+
+// Width and height from the SOF marker of a JPEG file, without decoding it. nullopt for anything that isn't a JPEG.
+std::optional<cv::Size> ReadJpegSize(const boost::filesystem::path &file_path);
+
+// Decodes an image (cv::IMREAD_COLOR or cv::IMREAD_GRAYSCALE) at the lowest resolution that still leaves at least
+// min_short_side pixels on its short side.
+//
+// JPEGs are downscaled by 2, 4 or 8 in the DCT domain, which skips most of the decode work; other formats are
+// decoded at full resolution. Returns an empty Mat if the image can't be decoded.
+cv::Mat DecodeImage(const boost::filesystem::path &file_path, int mode, size_t min_short_side);
@@ -0,0 +1,269 @@
+#include "image_kernels.h"
+
+#include <array>
+
+#include <immintrin.h>
+
+namespace {
+    // Pixels converted per vector iteration, 48 bytes of BGR input:
+    constexpr size_t kPixelBlock = 16;
+
+    using ConvertFunction = void (*)(const uint8_t *bgr, size_t pixel_count, const float scale[3],
+                                     const float bias[3], float *out, size_t plane_stride);
+
+    using ConvertInterleavedFunction = void (*)(const uint8_t *bgr, size_t pixel_count, const float scale[3],
+                                                const float bias[3], float *out);
+
+    struct Kernels {
+        ConvertFunction convert;
+
+        ConvertInterleavedFunction convert_interleaved;
+
+        const char *isa;
+    };
+
+    // pshufb masks that gather byte (3 * i + channel) of a 48-byte block from its 16-byte chunk `chunk` into byte i,
+    // zeroing the bytes that live in the other chunks. OR-ing the three results deinterleaves one channel.
+    using ShuffleMasks = std::array<std::array<std::array<int8_t, 16>, 3>, 3>;
+
+    constexpr ShuffleMasks make_shuffle_masks() {
+        ShuffleMasks masks{};
+        for (size_t channel = 0; channel < 3; ++channel) {
+            for (size_t chunk = 0; chunk < 3; ++chunk) {
+                for (size_t i = 0; i < 16; ++i) {
+                    const size_t byte = 3 * i + channel;
+                    masks[channel][chunk][i] = byte / 16 == chunk ? static_cast<int8_t>(byte % 16) : int8_t(-128);
+                }
+            }
+        }
+        return masks;
+    }
+
+    alignas(16) constexpr ShuffleMasks kShuffleMasks = make_shuffle_masks();
+
+    // pshufb masks that gather the bytes of chunk `out_chunk` of a 48-byte block with every pixel's B and R swapped,
+    // from source chunk `chunk` (indexed [out_chunk][chunk]).
+    constexpr ShuffleMasks make_swap_masks() {
+        ShuffleMasks masks{};
+        for (size_t out_chunk = 0; out_chunk < 3; ++out_chunk) {
+            for (size_t chunk = 0; chunk < 3; ++chunk) {
+                for (size_t i = 0; i < 16; ++i) {
+                    const size_t out_byte = 16 * out_chunk + i;
+                    const size_t byte = out_byte / 3 * 3 + 2 - out_byte % 3;
+                    masks[out_chunk][chunk][i] = byte / 16 == chunk ? static_cast<int8_t>(byte % 16) : int8_t(-128);
+                }
+            }
+        }
+        return masks;
+    }
+
+    alignas(16) constexpr ShuffleMasks kSwapMasks = make_swap_masks();
+
+    // scale/bias of every float of a 48-float (16-pixel) interleaved block:
+    struct LanePattern {
+        alignas(64) float scale[48];
+        alignas(64) float bias[48];
+    };
+
+    LanePattern make_lane_pattern(const float scale[3], const float bias[3]) {
+        LanePattern pattern{};
+        for (size_t i = 0; i < 48; ++i) {
+            pattern.scale[i] = scale[i % 3];
+            pattern.bias[i] = bias[i % 3];
+        }
+        return pattern;
+    }
+
+    // ----------------------------------------------------------------------------------------------------------------
+    // Scalar:
+    // ----------------------------------------------------------------------------------------------------------------
+
+    void convert_scalar(const uint8_t *bgr, size_t pixel_count, const float scale[3], const float bias[3],
+                        float *out, size_t plane_stride) {
+        float *r = out;
+        float *g = out + plane_stride;
+        float *b = out + 2 * plane_stride;
+        for (size_t i = 0; i < pixel_count; ++i) {
+            b[i] = static_cast<float>(bgr[3 * i]) * scale[2] + bias[2];
+            g[i] = static_cast<float>(bgr[3 * i + 1]) * scale[1] + bias[1];
+            r[i] = static_cast<float>(bgr[3 * i + 2]) * scale[0] + bias[0];
+        }
+    }
+
+    void convert_interleaved_scalar(const uint8_t *bgr, size_t pixel_count, const float scale[3], const float bias[3],
+                                    float *out) {
+        for (size_t i = 0; i < pixel_count; ++i) {
+            for (size_t c = 0; c < 3; ++c) {
+                out[3 * i + c] = static_cast<float>(bgr[3 * i + 2 - c]) * scale[c] + bias[c];
+            }
+        }
+    }
+
+    // ----------------------------------------------------------------------------------------------------------------
+    // AVX2 + FMA:
+    // ----------------------------------------------------------------------------------------------------------------
+
+    // Byte `channel` of 16 consecutive BGR pixels:
+    __attribute__((target("avx2,fma")))
+    __m128i deinterleave_channel(__m128i chunk0, __m128i chunk1, __m128i chunk2, size_t channel) {
+        const auto &masks = kShuffleMasks[channel];
+        __m128i result = _mm_shuffle_epi8(chunk0, _mm_load_si128(reinterpret_cast<const __m128i *>(masks[0].data())));
+        result = _mm_or_si128(result, _mm_shuffle_epi8(
+                chunk1, _mm_load_si128(reinterpret_cast<const __m128i *>(masks[1].data()))));
+        return _mm_or_si128(result, _mm_shuffle_epi8(
+                chunk2, _mm_load_si128(reinterpret_cast<const __m128i *>(masks[2].data()))));
+    }
+
+    __attribute__((target("avx2,fma")))
+    void convert_avx2(const uint8_t *bgr, size_t pixel_count, const float scale[3], const float bias[3],
+                      float *out, size_t plane_stride) {
+        size_t i = 0;
+        for (; i + kPixelBlock <= pixel_count; i += kPixelBlock) {
+            const auto *block = reinterpret_cast<const __m128i *>(bgr + 3 * i);
+            const __m128i chunk0 = _mm_loadu_si128(block);
+            const __m128i chunk1 = _mm_loadu_si128(block + 1);
+            const __m128i chunk2 = _mm_loadu_si128(block + 2);
+            for (size_t channel = 0; channel < 3; ++channel) {
+                // BGR in, RGB planes out:
+                const size_t plane = 2 - channel;
+                const __m128i bytes = deinterleave_channel(chunk0, chunk1, chunk2, channel);
+                const __m256 low = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+                const __m256 high = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8)));
+                const __m256 plane_scale = _mm256_set1_ps(scale[plane]);
+                const __m256 plane_bias = _mm256_set1_ps(bias[plane]);
+                float *dst = out + plane * plane_stride + i;
+                _mm256_storeu_ps(dst, _mm256_fmadd_ps(low, plane_scale, plane_bias));
+                _mm256_storeu_ps(dst + 8, _mm256_fmadd_ps(high, plane_scale, plane_bias));
+            }
+        }
+        convert_scalar(bgr + 3 * i, pixel_count - i, scale, bias, out + i, plane_stride);
+    }
+
+    // 16 bytes of RGB pixels, output chunk `out_chunk` of a 48-byte BGR block:
+    __attribute__((target("avx2,fma")))
+    __m128i swap_chunk(__m128i chunk0, __m128i chunk1, __m128i chunk2, size_t out_chunk) {
+        const auto &masks = kSwapMasks[out_chunk];
+        __m128i result = _mm_shuffle_epi8(chunk0, _mm_load_si128(reinterpret_cast<const __m128i *>(masks[0].data())));
+        result = _mm_or_si128(result, _mm_shuffle_epi8(
+                chunk1, _mm_load_si128(reinterpret_cast<const __m128i *>(masks[1].data()))));
+        return _mm_or_si128(result, _mm_shuffle_epi8(
+                chunk2, _mm_load_si128(reinterpret_cast<const __m128i *>(masks[2].data()))));
+    }
+
+    __attribute__((target("avx2,fma")))
+    void convert_interleaved_avx2(const uint8_t *bgr, size_t pixel_count, const float scale[3], const float bias[3],
+                                  float *out) {
+        const LanePattern pattern = make_lane_pattern(scale, bias);
+        size_t i = 0;
+        for (; i + kPixelBlock <= pixel_count; i += kPixelBlock) {
+            const auto *block = reinterpret_cast<const __m128i *>(bgr + 3 * i);
+            const __m128i chunk0 = _mm_loadu_si128(block);
+            const __m128i chunk1 = _mm_loadu_si128(block + 1);
+            const __m128i chunk2 = _mm_loadu_si128(block + 2);
+            float *dst = out + 3 * i;
+            for (size_t out_chunk = 0; out_chunk < 3; ++out_chunk) {
+                const __m128i bytes = swap_chunk(chunk0, chunk1, chunk2, out_chunk);
+                const size_t lane = 16 * out_chunk;
+                const __m256 low = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+                const __m256 high = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8)));
+                _mm256_storeu_ps(dst + lane, _mm256_fmadd_ps(low, _mm256_load_ps(pattern.scale + lane),
+                                                             _mm256_load_ps(pattern.bias + lane)));
+                _mm256_storeu_ps(dst + lane + 8, _mm256_fmadd_ps(high, _mm256_load_ps(pattern.scale + lane + 8),
+                                                                 _mm256_load_ps(pattern.bias + lane + 8)));
+            }
+        }
+        convert_interleaved_scalar(bgr + 3 * i, pixel_count - i, scale, bias, out + 3 * i);
+    }
+
+    // ----------------------------------------------------------------------------------------------------------------
+    // AVX-512:
+    // ----------------------------------------------------------------------------------------------------------------
+
+    __attribute__((target("avx512f,avx2,fma")))
+    void convert_avx512(const uint8_t *bgr, size_t pixel_count, const float scale[3], const float bias[3],
+                        float *out, size_t plane_stride) {
+        size_t i = 0;
+        for (; i + kPixelBlock <= pixel_count; i += kPixelBlock) {
+            const auto *block = reinterpret_cast<const __m128i *>(bgr + 3 * i);
+            const __m128i chunk0 = _mm_loadu_si128(block);
+            const __m128i chunk1 = _mm_loadu_si128(block + 1);
+            const __m128i chunk2 = _mm_loadu_si128(block + 2);
+            for (size_t channel = 0; channel < 3; ++channel) {
+                const size_t plane = 2 - channel;
+                const __m128i bytes = deinterleave_channel(chunk0, chunk1, chunk2, channel);
+                // The maskz forms are the same instructions, without GCC's bogus "maybe uninitialized" warnings:
+                const __m512 values = _mm512_maskz_cvtepi32_ps(0xFFFF, _mm512_maskz_cvtepu8_epi32(0xFFFF, bytes));
+                _mm512_storeu_ps(out + plane * plane_stride + i,
+                                 _mm512_fmadd_ps(values, _mm512_set1_ps(scale[plane]), _mm512_set1_ps(bias[plane])));
+            }
+        }
+        convert_scalar(bgr + 3 * i, pixel_count - i, scale, bias, out + i, plane_stride);
+    }
+
+    __attribute__((target("avx512f,avx2,fma")))
+    void convert_interleaved_avx512(const uint8_t *bgr, size_t pixel_count, const float scale[3],
+                                    const float bias[3], float *out) {
+        const LanePattern pattern = make_lane_pattern(scale, bias);
+        size_t i = 0;
+        for (; i + kPixelBlock <= pixel_count; i += kPixelBlock) {
+            const auto *block = reinterpret_cast<const __m128i *>(bgr + 3 * i);
+            const __m128i chunk0 = _mm_loadu_si128(block);
+            const __m128i chunk1 = _mm_loadu_si128(block + 1);
+            const __m128i chunk2 = _mm_loadu_si128(block + 2);
+            for (size_t out_chunk = 0; out_chunk < 3; ++out_chunk) {
+                const __m128i bytes = swap_chunk(chunk0, chunk1, chunk2, out_chunk);
+                const size_t lane = 16 * out_chunk;
+                const __m512 values = _mm512_maskz_cvtepi32_ps(0xFFFF, _mm512_maskz_cvtepu8_epi32(0xFFFF, bytes));
+                _mm512_storeu_ps(out + 3 * i + lane, _mm512_fmadd_ps(values, _mm512_load_ps(pattern.scale + lane),
+                                                                     _mm512_load_ps(pattern.bias + lane)));
+            }
+        }
+        convert_interleaved_scalar(bgr + 3 * i, pixel_count - i, scale, bias, out + 3 * i);
+    }
+
+    Kernels select_kernels() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return {convert_avx512, convert_interleaved_avx512, "AVX-512"};
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            return {convert_avx2, convert_interleaved_avx2, "AVX2"};
+        }
+        return {convert_scalar, convert_interleaved_scalar, "scalar"};
+    }
+
+    const Kernels &kernels() {
+        static const Kernels selected = select_kernels();
+        return selected;
+    }
+}
+
+namespace {
+    // (value / 255 - mean) / std == value * scale + bias:
+    void scale_and_bias(const float mean[3], const float std[3], float scale[3], float bias[3]) {
+        for (size_t c = 0; c < 3; ++c) {
+            scale[c] = 1.0f / (255.0f * std[c]);
+            bias[c] = -mean[c] / std[c];
+        }
+    }
+}
+
+void bgr_to_normalized_rgb_planar(const uint8_t *bgr, size_t pixel_count, const float mean[3], const float std[3],
+                                  float *out, size_t plane_stride) {
+    float scale[3];
+    float bias[3];
+    scale_and_bias(mean, std, scale, bias);
+    kernels().convert(bgr, pixel_count, scale, bias, out, plane_stride);
+}
+
+void bgr_to_normalized_rgb_interleaved(const uint8_t *bgr, size_t pixel_count, const float mean[3],
+                                       const float std[3], float *out) {
+    float scale[3];
+    float bias[3];
+    scale_and_bias(mean, std, scale, bias);
+    kernels().convert_interleaved(bgr, pixel_count, scale, bias, out);
+}
+
+const char *image_kernels_isa() {
+    return kernels().isa;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Image preprocessing kernels. Like the vector kernels, the implementation (AVX-512, AVX2+FMA or scalar) is picked
+// once at runtime from what the CPU supports.
+
+// Converts interleaved 8-bit BGR pixels (OpenCV's order) to planar RGB floats in a single pass, normalized as
+// (value / 255 - mean[c]) / std[c] with mean and std in RGB order. Plane c starts at out + c * plane_stride.
+void bgr_to_normalized_rgb_planar(const uint8_t *bgr, size_t pixel_count, const float mean[3], const float std[3],
+                                  float *out, size_t plane_stride);
+
+// Same conversion to interleaved RGB floats (out[3 * i + c]), i.e. the NHWC layout of a channels-last tensor.
+void bgr_to_normalized_rgb_interleaved(const uint8_t *bgr, size_t pixel_count, const float mean[3],
+                                       const float std[3], float *out);
+
+// Name of the instruction set the kernels were dispatched to, for logging.
+[[nodiscard]] const char *image_kernels_isa();
@@ -0,0 +1,313 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+#include <spdlog/spdlog.h>
+
+namespace {
+    std::atomic<uint64_t> next_metrics_id(1);
+
+    struct CurrentThreadTrace {
+        uint64_t metrics_id = 0;
+        void *trace = nullptr;
+    };
+
+    thread_local CurrentThreadTrace current_thread_trace;
+
+    // Prometheus and JSON both want plain numbers, never "inf" or a locale's decimal comma:
+    std::string format_number(double value) {
+        if (std::isinf(value)) {
+            return value > 0 ? "+Inf" : "-Inf";
+        }
+        std::ostringstream out;
+        out.imbue(std::locale::classic());
+        out.precision(9);
+        out << value;
+        return out.str();
+    }
+
+    std::string escape_json(const std::string &text) {
+        std::string escaped;
+        escaped.reserve(text.size());
+        for (char c: text) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+            }
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    // Writes next to `path` and renames, so readers never see a partial file:
+    template<typename F>
+    void write_atomically(const boost::filesystem::path &path, F write) {
+        auto temp_path = path;
+        temp_path += ".tmp";
+        {
+            std::ofstream file(temp_path.string(), std::ios::trunc);
+            if (!file) {
+                spdlog::warn("Failed to open {} for writing", temp_path.generic_string());
+                return;
+            }
+            write(file);
+            if (!file) {
+                spdlog::warn("Failed to write {}", temp_path.generic_string());
+                return;
+            }
+        }
+        boost::system::error_code error;
+        boost::filesystem::rename(temp_path, path, error);
+        if (error) {
+            spdlog::warn("Failed to replace {}: {}", path.generic_string(), error.message());
+        }
+    }
+}
+
+Histogram::Histogram(std::vector<double> bounds)
+        : bounds_(std::move(bounds)),
+          counts_(std::make_unique<std::atomic<uint64_t>[]>(bounds_.size() + 1)),
+          count_(0),
+          sum_(0.0) {
+
+}
+
+void Histogram::observe(double value) {
+    // A handful of bounds, a linear scan is as fast as anything:
+    size_t bucket = 0;
+    while (bucket < bounds_.size() && value > bounds_[bucket]) {
+        ++bucket;
+    }
+    counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+}
+
+const std::vector<double> &Histogram::get_bounds() const {
+    return bounds_;
+}
+
+std::vector<uint64_t> Histogram::get_counts() const {
+    std::vector<uint64_t> counts(bounds_.size() + 1);
+    for (size_t i = 0; i < counts.size(); ++i) {
+        counts[i] = counts_[i].load(std::memory_order_relaxed);
+    }
+    return counts;
+}
+
+uint64_t Histogram::get_count() const {
+    return count_.load(std::memory_order_relaxed);
+}
+
+double Histogram::get_sum() const {
+    return sum_.load(std::memory_order_relaxed);
+}
+
+Metrics::Metrics(const boost::property_tree::ptree &config)
+        : id_(next_metrics_id++),
+          start_time_(std::chrono::steady_clock::now()),
+          enabled_(config.get<bool>("metrics.enabled")),
+          path_(config.get<std::string>("metrics.path")),
+          json_(config.get<std::string>("metrics.format") == "json"),
+          interval_(config.get<size_t>("metrics.interval_ms")),
+          tracing_(config.get<bool>("trace.enabled")),
+          trace_path_(config.get<std::string>("trace.path")),
+          max_trace_events_(config.get<size_t>("trace.max_events")),
+          trace_event_count_(0),
+          stopping_(false) {
+    const auto format = config.get<std::string>("metrics.format");
+    if (format != "prometheus" && format != "json") {
+        throw std::runtime_error("Unknown metrics format: " + format);
+    }
+    if (enabled_ && interval_.count() > 0) {
+        dump_thread_ = std::thread(&Metrics::DumpThread, this);
+    }
+}
+
+Metrics::~Metrics() {
+    if (dump_thread_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(dump_mutex_);
+            stopping_ = true;
+        }
+        stop_requested_.notify_all();
+        dump_thread_.join();
+    }
+    Dump();
+    if (tracing_) {
+        WriteTrace();
+    }
+}
+
+Counter &Metrics::get_counter(const std::string &name, const std::string &help) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &entry = counters_[name];
+    if (!entry.metric) {
+        entry = {help, std::make_unique<Counter>()};
+    }
+    return *entry.metric;
+}
+
+Gauge &Metrics::get_gauge(const std::string &name, const std::string &help) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &entry = gauges_[name];
+    if (!entry.metric) {
+        entry = {help, std::make_unique<Gauge>()};
+    }
+    return *entry.metric;
+}
+
+Histogram &Metrics::get_histogram(const std::string &name, const std::string &help, std::vector<double> bounds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &entry = histograms_[name];
+    if (!entry.metric) {
+        entry = {help, std::make_unique<Histogram>(std::move(bounds))};
+    }
+    return *entry.metric;
+}
+
+std::vector<double> Metrics::ExponentialBounds(double start, double factor, size_t count) {
+    std::vector<double> bounds;
+    bounds.reserve(count);
+    for (double bound = start; bounds.size() < count; bound *= factor) {
+        bounds.push_back(bound);
+    }
+    return bounds;
+}
+
+std::vector<double> Metrics::LatencyBounds() {
+    return ExponentialBounds(1e-5, 2.0, 23);
+}
+
+bool Metrics::tracing() const {
+    return tracing_;
+}
+
+void Metrics::record_span(const char *name, std::chrono::steady_clock::time_point start,
+                          std::chrono::steady_clock::time_point end) {
+    if (trace_event_count_.fetch_add(1, std::memory_order_relaxed) >= max_trace_events_) {
+        return;
+    }
+    auto &trace = thread_trace();
+    std::lock_guard<std::mutex> lock(trace.mutex);
+    trace.events.push_back({name,
+                            std::chrono::duration_cast<std::chrono::microseconds>(start - start_time_).count(),
+                            std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()});
+}
+
+Metrics::ThreadTrace &Metrics::thread_trace() {
+    if (current_thread_trace.metrics_id != id_) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        thread_traces_.push_back(std::make_unique<ThreadTrace>());
+        thread_traces_.back()->tid = static_cast<uint32_t>(thread_traces_.size());
+        current_thread_trace = {id_, thread_traces_.back().get()};
+    }
+    return *static_cast<ThreadTrace *>(current_thread_trace.trace);
+}
+
+void Metrics::DumpThread() {
+    std::unique_lock<std::mutex> lock(dump_mutex_);
+    while (!stop_requested_.wait_for(lock, interval_, [this] { return stopping_; })) {
+        lock.unlock();
+        Dump();
+        lock.lock();
+    }
+}
+
+void Metrics::Dump() const {
+    if (!enabled_) {
+        return;
+    }
+    write_atomically(path_, [this](std::ostream &out) {
+        if (json_) {
+            write_json(out);
+        } else {
+            write_prometheus(out);
+        }
+    });
+}
+
+void Metrics::write_prometheus(std::ostream &out) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &[name, entry]: counters_) {
+        out << "# HELP " << name << " " << entry.help << "\n# TYPE " << name << " counter\n";
+        out << name << " " << entry.metric->value() << "\n";
+    }
+    for (const auto &[name, entry]: gauges_) {
+        out << "# HELP " << name << " " << entry.help << "\n# TYPE " << name << " gauge\n";
+        out << name << " " << entry.metric->value() << "\n";
+    }
+    for (const auto &[name, entry]: histograms_) {
+        out << "# HELP " << name << " " << entry.help << "\n# TYPE " << name << " histogram\n";
+        const auto &bounds = entry.metric->get_bounds();
+        const auto counts = entry.metric->get_counts();
+        // Prometheus buckets are cumulative:
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            cumulative += counts[i];
+            const std::string bound = i < bounds.size() ? format_number(bounds[i]) : "+Inf";
+            out << name << "_bucket{le=\"" << bound << "\"} " << cumulative << "\n";
+        }
+        out << name << "_sum " << format_number(entry.metric->get_sum()) << "\n";
+        // Counted from the buckets, so _count always matches the +Inf bucket:
+        out << name << "_count " << cumulative << "\n";
+    }
+}
+
+void Metrics::write_json(std::ostream &out) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto write_values = [&out](const auto &entries) {
+        const char *separator = "";
+        for (const auto &[name, entry]: entries) {
+            out << separator << "\n    \"" << escape_json(name) << "\": " << entry.metric->value();
+            separator = ",";
+        }
+    };
+    out << "{\n  \"counters\": {";
+    write_values(counters_);
+    out << "\n  },\n  \"gauges\": {";
+    write_values(gauges_);
+    out << "\n  },\n  \"histograms\": {";
+    const char *separator = "";
+    for (const auto &[name, entry]: histograms_) {
+        const auto &bounds = entry.metric->get_bounds();
+        const auto counts = entry.metric->get_counts();
+        uint64_t count = 0;
+        out << separator << "\n    \"" << escape_json(name) << "\": {\"buckets\": [";
+        for (size_t i = 0; i < counts.size(); ++i) {
+            count += counts[i];
+            out << (i > 0 ? ", " : "") << "{\"le\": "
+                << (i < bounds.size() ? format_number(bounds[i]) : "null") << ", \"count\": " << counts[i] << "}";
+        }
+        out << "], \"sum\": " << format_number(entry.metric->get_sum()) << ", \"count\": " << count << "}";
+        separator = ",";
+    }
+    out << "\n  }\n}\n";
+}
+
+void Metrics::WriteTrace() const {
+    size_t event_count = 0;
+    write_atomically(trace_path_, [this, &event_count](std::ostream &out) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+        const char *separator = "\n";
+        for (const auto &trace: thread_traces_) {
+            std::lock_guard<std::mutex> trace_lock(trace->mutex);
+            for (const auto &event: trace->events) {
+                out << separator << "{\"name\": \"" << escape_json(event.name) << "\", \"ph\": \"X\", \"pid\": 1, "
+                    << "\"tid\": " << trace->tid << ", \"ts\": " << event.start_us << ", \"dur\": "
+                    << event.duration_us << "}";
+                separator = ",\n";
+            }
+            event_count += trace->events.size();
+        }
+        out << "\n]}\n";
+    });
+    const size_t recorded = trace_event_count_.load();
+    if (recorded > max_trace_events_) {
+        spdlog::warn("Trace is missing {} events over trace.max_events", recorded - max_trace_events_);
+    }
+    spdlog::info("Wrote {} trace events to {}", event_count, trace_path_.generic_string());
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+class Counter {
+public:
+    void add(uint64_t count = 1) {
+        value_.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] uint64_t value() const {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+class Gauge {
+public:
+    void set(int64_t value) {
+        value_.store(value, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] int64_t value() const {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<int64_t> value_{0};
+};
+
+// Counts of observed values per bucket, Prometheus style: bucket i holds the values <= bounds[i] (and > bounds[i - 1]),
+// the last one the values above every bound.
+class Histogram {
+public:
+    explicit Histogram(std::vector<double> bounds);
+
+    void observe(double value);
+
+    [[nodiscard]] const std::vector<double> &get_bounds() const;
+
+    // Per bucket, not cumulative; get_bounds().size() + 1 of them:
+    [[nodiscard]] std::vector<uint64_t> get_counts() const;
+
+    [[nodiscard]] uint64_t get_count() const;
+
+    [[nodiscard]] double get_sum() const;
+
+private:
+    const std::vector<double> bounds_;
+    std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+    std::atomic<uint64_t> count_;
+    std::atomic<double> sum_;
+};
+
+// Counters, gauges and histograms of the pipeline stages, and an optional Chrome trace (chrome://tracing or
+// ui.perfetto.dev) of what each thread spent its time on.
+//
+// Metrics are registered by name, usually once in a constructor, and updated without locks from any thread. With
+// "metrics.enabled" they are written to "metrics.path" every "metrics.interval_ms" and on destruction, in the
+// Prometheus text format (for node_exporter's textfile collector) or as JSON ("metrics.format"). With
+// "trace.enabled" every Span is recorded, up to "trace.max_events", and the timeline is written to "trace.path" on
+// destruction.
+class Metrics {
+public:
+    explicit Metrics(const boost::property_tree::ptree &config);
+
+    // Writes the metrics and the trace one last time.
+    ~Metrics();
+
+    Metrics(const Metrics &) = delete;
+
+    Metrics &operator=(const Metrics &) = delete;
+
+    // The metric called `name`, registered on the first call. Names are used as they are in the output, so they
+    // should follow the Prometheus conventions (image_warrior_..._total, ..._seconds).
+    Counter &get_counter(const std::string &name, const std::string &help);
+
+    Gauge &get_gauge(const std::string &name, const std::string &help);
+
+    // `bounds` only matter on the first call.
+    Histogram &get_histogram(const std::string &name, const std::string &help, std::vector<double> bounds);
+
+    // count bounds from `start` on, each `factor` times the previous one:
+    static std::vector<double> ExponentialBounds(double start, double factor, size_t count);
+
+    // 10 µs to about 42 s, for durations in seconds:
+    static std::vector<double> LatencyBounds();
+
+    [[nodiscard]] bool tracing() const;
+
+    // Adds a complete event to the trace, on the calling thread's track. `name` must outlive the Metrics.
+    void record_span(const char *name, std::chrono::steady_clock::time_point start,
+                     std::chrono::steady_clock::time_point end);
+
+    // Writes the metrics to "metrics.path" now, if enabled.
+    void Dump() const;
+
+private:
+    template<typename T>
+    struct Entry {
+        std::string help;
+        std::unique_ptr<T> metric;
+    };
+
+    struct TraceEvent {
+        const char *name;
+        int64_t start_us;
+        int64_t duration_us;
+    };
+
+    // The events of one thread; its mutex is only contended while the trace is written:
+    struct ThreadTrace {
+        uint32_t tid;
+        std::mutex mutex;
+        std::vector<TraceEvent> events;
+    };
+
+    ThreadTrace &thread_trace();
+
+    void DumpThread();
+
+    void write_prometheus(std::ostream &out) const;
+
+    void write_json(std::ostream &out) const;
+
+    void WriteTrace() const;
+
+    // Tells the thread local trace buffers of different instances apart:
+    const uint64_t id_;
+    const std::chrono::steady_clock::time_point start_time_;
+
+    const bool enabled_;
+    const boost::filesystem::path path_;
+    const bool json_;
+    const std::chrono::milliseconds interval_;
+
+    const bool tracing_;
+    const boost::filesystem::path trace_path_;
+    const size_t max_trace_events_;
+    std::atomic<size_t> trace_event_count_;
+
+    mutable std::mutex mutex_;
+    std::map<std::string, Entry<Counter>> counters_;
+    std::map<std::string, Entry<Gauge>> gauges_;
+    std::map<std::string, Entry<Histogram>> histograms_;
+    std::vector<std::unique_ptr<ThreadTrace>> thread_traces_;
+
+    std::mutex dump_mutex_;
+    std::condition_variable stop_requested_;
+    bool stopping_;
+    std::thread dump_thread_;
+};
+
+// Times a scope: observes its duration in seconds in `histogram` (if any) and records it in the trace (if tracing).
+class Span {
+public:
+    Span(Metrics &metrics, const char *name, Histogram *histogram = nullptr)
+            : metrics_(metrics),
+              name_(name),
+              histogram_(histogram),
+              start_(std::chrono::steady_clock::now()),
+              stopped_(false) {
+
+    }
+
+    ~Span() {
+        stop();
+    }
+
+    Span(const Span &) = delete;
+
+    Span &operator=(const Span &) = delete;
+
+    // Ends the span before the end of the scope. Returns its duration in seconds.
+    double stop() {
+        if (stopped_) {
+            return 0.0;
+        }
+        stopped_ = true;
+        const auto end = std::chrono::steady_clock::now();
+        const double seconds = std::chrono::duration<double>(end - start_).count();
+        if (histogram_) {
+            histogram_->observe(seconds);
+        }
+        if (metrics_.tracing()) {
+            metrics_.record_span(name_, start_, end);
+        }
+        return seconds;
+    }
+
+private:
+    Metrics &metrics_;
+    const char *name_;
+    Histogram *histogram_;
+    const std::chrono::steady_clock::time_point start_;
+    bool stopped_;
+};
@@ -1,21 +1,24 @@
 #include "object_database.h"
 
 #include <context.h>
+#include <content_hash.h>
+#include <vector_kernels.h>
+#include <array>
+#include <cctype>
 #include <numeric>
-#include <filesystem>
 
 Object::Object(Object::Type type, boost::filesystem::path path)
         : type_(type),
-          path_(std::move(path)) {
+          path_(std::move(path)),
+          size_(0),
+          mtime_(0),
+          partial_hash_(0),
+          content_hash_(0) {
 
 }
 
-bool Object::IsImageFile(const boost::filesystem::path &file_path) {
-    boost::filesystem::path extension = file_path.extension();
-    std::string ext_str = extension.string();
-    std::transform(ext_str.begin(), ext_str.end(), ext_str.begin(), ::tolower);
-
-    const std::vector<std::string> image_extensions = {
+namespace {
+    constexpr std::array<std::string_view, 32> kImageExtensions = {
             ".jpg", ".jpeg", ".png", ".gif", ".bmp", ".tiff", ".tif",
             ".ico", ".jfif", ".webp", ".svg", ".svgz", ".eps", ".pcx",
             ".raw", ".cr2", ".nef", ".orf", ".sr2", ".heif", ".pdf",
@@ -23,7 +26,36 @@ bool Object::IsImageFile(const boost::filesystem::path &file_path) {
             ".j2c", ".wdp", ".hdp", ".exr"
     };
 
-    return std::find(image_extensions.begin(), image_extensions.end(), ext_str) != image_extensions.end();
+    constexpr size_t kMaxExtensionLength = std::max_element(
+            kImageExtensions.begin(), kImageExtensions.end(), [](std::string_view a, std::string_view b) {
+                return a.size() < b.size();
+            })->size();
+
+    // Files hashed per worker pool task at least: hashing a file is mostly waiting for the disk, so even a small
+    // batch (a streaming batch, a watch event) is worth spreading over the workers:
+    constexpr size_t kHashChunkSize = 4;
+
+    // Released feature rows are compacted away once they outnumber the live ones, and there are at least this many:
+    constexpr size_t kMinReleasedFeatureRows = 1024;
+}
+
+bool Object::IsImageFile(const boost::filesystem::path &file_path) {
+    return IsImageFileName(file_path.filename().native());
+}
+
+bool Object::IsImageFileName(std::string_view file_name) {
+    // Same extension rules as boost::filesystem::path::extension() (v3, so ".jpg" is a JPEG too), without allocating:
+    const size_t dot = file_name.rfind('.');
+    if (dot == std::string_view::npos || file_name.size() - dot > kMaxExtensionLength) {
+        return false;
+    }
+    char extension[kMaxExtensionLength];
+    const size_t length = file_name.size() - dot;
+    for (size_t i = 0; i < length; ++i) {
+        extension[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(file_name[dot + i])));
+    }
+    return std::find(kImageExtensions.begin(), kImageExtensions.end(), std::string_view(extension, length)) !=
+           kImageExtensions.end();
 }
 
 std::shared_ptr<Object> Object::Create(const boost::filesystem::path &path) {
@@ -34,32 +66,49 @@ std::shared_ptr<Object> Object::Create(const boost::filesystem::path &path) {
 }
 
 ImageObject::ImageObject(boost::filesystem::path path)
-        : Object(Type::IMAGE, std::move(path)) {
+        : Object(Type::IMAGE, std::move(path)),
+          feature_matrix(nullptr),
+          feature_row(0),
+          model_id(0) {
 
 }
 
+bool ImageObject::has_features() const {
+    return feature_matrix != nullptr;
+}
+
+std::span<const float> ImageObject::features() const {
+    if (!feature_matrix) {
+        return {};
+    }
+    return feature_matrix->exact_row(feature_row);
+}
+
 float similarity(const Object &a, const Object &b) {
     if (a.type_ != b.type_) {
         return 0.0f;
     } else {
         switch (a.type_) {
             case Object::Type::IMAGE: {
-                const std::vector<float> &image_a_features = dynamic_cast<const ImageObject &>(a).features;
-                const std::vector<float> &image_b_features = dynamic_cast<const ImageObject &>(b).features;
-                if (image_a_features.size() != image_b_features.size()) {
+                // Types are equal, so the static casts are safe.
+                const auto &image_a = static_cast<const ImageObject &>(a);
+                const auto &image_b = static_cast<const ImageObject &>(b);
+                if (!image_a.has_features() || !image_b.has_features()) {
+                    return 0.0f;
+                }
+                const size_t dim = image_a.feature_matrix->dim();
+                if (dim != image_b.feature_matrix->dim()) {
                     throw std::invalid_argument("Vectors are of unequal length");
                 }
-
-                float dot_product = std::inner_product(image_a_features.begin(), image_a_features.end(),
-                                                       image_b_features.begin(), 0.0f);
-                float image_a_features_magnitude = std::sqrt(
-                        std::inner_product(image_a_features.begin(), image_a_features.end(), image_a_features.begin(),
-                                           0.0f));
-                float image_b_features_magnitude = std::sqrt(
-                        std::inner_product(image_b_features.begin(), image_b_features.end(), image_b_features.begin(),
-                                           0.0f));
-
-                return dot_product / (image_a_features_magnitude * image_b_features_magnitude);
+                if (image_a.feature_matrix->precision() == FeatureMatrix::Precision::FP32 &&
+                    image_b.feature_matrix->precision() == FeatureMatrix::Precision::FP32) {
+                    // Stored normalized:
+                    return dot_product(image_a.features().data(), image_b.features().data(), dim);
+                }
+                std::vector<float> features(2 * dim);
+                image_a.feature_matrix->load_query(image_a.feature_row, features.data());
+                image_b.feature_matrix->load_query(image_b.feature_row, features.data() + dim);
+                return dot_product(features.data(), features.data() + dim, dim);
             }
             default:
                 return 0.0f;
@@ -69,48 +118,340 @@ float similarity(const Object &a, const Object &b) {
 
 ObjectDatabase::ObjectDatabase(Context &ctx, boost::filesystem::path dir)
         : ctx_(ctx),
-          dir_(std::move(dir)) {
+          dir_(std::move(dir)),
+          scan_threads_(ctx_.get_config_tree().get<size_t>("scan.threads")),
+          store_(dir_ / FeatureStore::kFileName),
+          features_(FeatureMatrix::ParsePrecision(ctx_.get_config_tree().get<std::string>("features.precision"))),
+          index_(SimilarityIndex::Create(ctx_.get_config_tree(), features_)),
+          index_synced_(false),
+          batch_depth_(0),
+          file_names_listed_(false) {
     if (!boost::filesystem::exists(dir_)) {
         throw std::runtime_error("Directory does not exist: " + dir_.generic_string());
     }
     if (!boost::filesystem::is_directory(dir_)) {
         throw std::runtime_error("Path is not a directory: " + dir_.generic_string());
     }
-    // TODO: actually load database here
+    store_.Load();
+    features_.reserve(store_.size());
+    spdlog::debug("Loaded {} stored features from {}", store_.size(), store_.get_path().generic_string());
+    spdlog::debug("Using {} vector kernels on {} features", vector_kernels_isa(),
+                  FeatureMatrix::PrecisionName(features_.precision()));
 }
 
-void ObjectDatabase::Update() {
-    for (const auto &entry: boost::filesystem::recursive_directory_iterator(dir_)) {
-        if (boost::filesystem::is_regular_file(entry)) {
-            if (!contains(entry.path())) {
-                if (auto object = Object::Create(entry.path())) {
-                    objects_.push_back(std::move(object));
-                } else {
-                    spdlog::debug("Unrecognized file: {}", entry.path().generic_string());
-                }
-            }
+size_t ObjectDatabase::Update() {
+    auto &metrics = ctx_.get_metrics();
+    Span span(metrics, "database_update", &metrics.get_histogram(
+            "image_warrior_database_update_seconds", "Scanning a database directory for new files",
+            Metrics::LatencyBounds()));
+    auto entries = WalkDirectory(dir_, scan_threads_, [](std::string_view name) {
+        return Object::IsImageFileName(name);
+    });
+    const size_t added = AddEntries(entries).size();
+    metrics.get_counter("image_warrior_files_scanned_total", "Image files found by database scans").add(entries.size());
+    spdlog::debug("Found {} image files in {}, {} new", entries.size(), dir_.generic_string(), added);
+    return added;
+}
+
+size_t ObjectDatabase::AddFiles(const std::vector<boost::filesystem::path> &paths) {
+    std::vector<FileEntry> entries;
+    entries.reserve(paths.size());
+    for (const auto &path: paths) {
+        if (contains(path)) {
+            continue;
+        }
+        boost::system::error_code error;
+        if (!boost::filesystem::is_regular_file(path, error)) {
+            // Gone (or replaced by a directory) since it was listed:
+            continue;
+        }
+        const auto size = boost::filesystem::file_size(path, error);
+        const auto mtime = boost::filesystem::last_write_time(path, error);
+        if (!error) {
+            entries.push_back({path, size, mtime});
         }
     }
-    sort_objects();
+    return AddEntries(entries).size();
 }
 
-const std::shared_ptr<Object> &ObjectDatabase::find_by_path(const boost::filesystem::path &path) const {
+void ObjectDatabase::Scan(const std::function<void(std::vector<FileEntry> &&)> &on_files) const {
+    WalkDirectory(dir_, scan_threads_, [](std::string_view name) {
+        return Object::IsImageFileName(name);
+    }, on_files);
+}
+
+std::vector<std::shared_ptr<Object>> ObjectDatabase::AddEntries(const std::vector<FileEntry> &entries) {
+    std::vector<std::shared_ptr<Object>> new_objects;
+    new_objects.reserve(entries.size());
+    for (const auto &entry: entries) {
+        if (entry.path.filename() == FeatureStore::kFileName || contains(entry.path)) {
+            continue;
+        }
+        if (auto object = Object::Create(entry.path)) {
+            object->size_ = entry.size;
+            object->mtime_ = entry.mtime;
+            load_stored_record(object);
+            path_index_.emplace(object->path_.native(), object);
+            new_objects.push_back(object);
+        } else {
+            spdlog::debug("Unrecognized file: {}", entry.path.generic_string());
+        }
+    }
+    compute_partial_hashes(new_objects);
+    for (const auto &object: new_objects) {
+        if (object->partial_hash_ != 0) {
+            hash_index_.emplace(object->partial_hash_, object);
+        }
+    }
+    if (!new_objects.empty()) {
+        insert_objects(new_objects);
+        index_synced_ = false;
+    }
+    return new_objects;
+}
+
+void ObjectDatabase::compute_partial_hashes(const std::vector<std::shared_ptr<Object>> &objects) {
+    std::vector<std::shared_ptr<Object>> missing;
+    for (const auto &object: objects) {
+        if (object->partial_hash_ == 0) {
+            missing.push_back(object);
+        }
+    }
+    if (missing.empty()) {
+        return;
+    }
+    spdlog::debug("Hashing {} objects of {}...", missing.size(), dir_.generic_string());
+    ctx_.get_worker_pool().ParallelFor(missing.size(), [&missing](size_t i) {
+        auto &object = *missing[i];
+        try {
+            object.partial_hash_ = PartialFileHash(object.path_, object.size_);
+        } catch (const std::runtime_error &e) {
+            // The object just won't take part in exact duplicate detection:
+            spdlog::warn("Failed to hash {}: {}", object.path_.generic_string(), e.what());
+        }
+    }, 0, kHashChunkSize);
+}
+
+void ObjectDatabase::Save() const {
+    std::vector<FeatureStore::PendingRecord> records;
+    records.reserve(objects_.size());
     for (const auto &object: objects_) {
-        if (object->path_ == path) {
-            return object;
+        FeatureStore::PendingRecord record{relative_path(object->path_), object->size_,
+                                           static_cast<int64_t>(object->mtime_), 0,
+                                           object->partial_hash_, object->content_hash_, std::nullopt, {}};
+        if (object->type_ == Object::Type::IMAGE) {
+            const auto &image_object = static_cast<const ImageObject &>(*object);
+            record.perceptual_hash = image_object.perceptual_hash;
+            if (image_object.has_features()) {
+                record.model_id = image_object.model_id;
+                record.features = image_object.features();
+            }
+        }
+        if (record.partial_hash != 0 || record.perceptual_hash || !record.features.empty()) {
+            records.push_back(std::move(record));
         }
     }
-    throw std::runtime_error("Object not found: " + path.generic_string());
+    store_.Save(records);
+    spdlog::debug("Saved {} records to {}", records.size(), store_.get_path().generic_string());
 }
 
-bool ObjectDatabase::contains(const boost::filesystem::path &path) const {
-    return std::ranges::any_of(objects_, [&path](const auto &object) {
-        return object->path_ == path;
+std::string ObjectDatabase::relative_path(const boost::filesystem::path &path) const {
+    return path.lexically_relative(dir_).generic_string();
+}
+
+void ObjectDatabase::load_stored_record(const std::shared_ptr<Object> &object) {
+    auto record = store_.find(relative_path(object->path_));
+    if (!record || record->size != object->size_ || record->mtime != object->mtime_) {
+        return;
+    }
+    object->partial_hash_ = record->partial_hash;
+    object->content_hash_ = record->content_hash;
+    if (object->type_ == Object::Type::IMAGE) {
+        if (record->perceptual_hash) {
+            set_perceptual_hash(object, *record->perceptual_hash);
+        }
+        if (!record->features.empty()) {
+            // store_ stays mapped as long as features_ exists, compressed rows can refer to the record:
+            store_features(object, record->features, record->model_id, true);
+        }
+    }
+}
+
+void ObjectDatabase::set_features(const std::shared_ptr<Object> &object, std::span<const float> features,
+                                  uint64_t model_id) {
+    store_features(object, features, model_id, false);
+}
+
+void ObjectDatabase::store_features(const std::shared_ptr<Object> &object, std::span<const float> features,
+                                    uint64_t model_id, bool persistent) {
+    if (object->type_ != Object::Type::IMAGE) {
+        throw std::invalid_argument("Object is not an image: " + object->path_.generic_string());
+    }
+    std::lock_guard<std::mutex> lock(results_mutex_);
+    auto &image_object = static_cast<ImageObject &>(*object);
+
+    // Features of another length come from another model or feature projection, the stored ones are outdated:
+    if (features_.dim() != 0 && features.size() != features_.dim()) {
+        spdlog::warn("Features of {} changed from {} to {} values, dropping the old ones", dir_.generic_string(),
+                     features_.dim(), features.size());
+        drop_features();
+    }
+
+    // The index refers to rows, so re-index the object under its new row:
+    const bool indexed = index_->contains(*object);
+    if (indexed) {
+        index_->remove(object);
+    }
+    if (image_object.feature_matrix == &features_) {
+        features_.release_row(image_object.feature_row);
+    }
+    image_object.feature_row = features_.add_row(features, persistent);
+    image_object.feature_matrix = &features_;
+    image_object.model_id = model_id;
+    if (indexed) {
+        index_->add(object);
+    }
+}
+
+void ObjectDatabase::drop_features() {
+    for (const auto &[path, object]: path_index_) {
+        if (object->type_ != Object::Type::IMAGE) {
+            continue;
+        }
+        auto &image_object = static_cast<ImageObject &>(*object);
+        if (image_object.feature_matrix == &features_) {
+            image_object.feature_matrix = nullptr;
+            image_object.feature_row = 0;
+            image_object.model_id = 0;
+        }
+    }
+    features_.clear();
+    // The index refers to rows of the old features, and the IVF centroids have their length:
+    index_ = SimilarityIndex::Create(ctx_.get_config_tree(), features_);
+    index_synced_ = false;
+}
+
+void ObjectDatabase::compact_features() {
+    std::lock_guard<std::mutex> lock(results_mutex_);
+    if (features_.released_rows() < kMinReleasedFeatureRows || features_.released_rows() <= features_.live_rows()) {
+        return;
+    }
+    spdlog::debug("Compacting {} released feature rows of {}", features_.released_rows(), dir_.generic_string());
+    const auto new_rows = features_.compact();
+    for (const auto &[path, object]: path_index_) {
+        if (object->type_ != Object::Type::IMAGE) {
+            continue;
+        }
+        auto &image_object = static_cast<ImageObject &>(*object);
+        if (image_object.feature_matrix == &features_) {
+            image_object.feature_row = new_rows[image_object.feature_row];
+        }
+    }
+    // The index refers to the old rows:
+    index_ = SimilarityIndex::Create(ctx_.get_config_tree(), features_);
+    index_synced_ = false;
+}
+
+void ObjectDatabase::adopt_features(const std::shared_ptr<Object> &object) {
+    if (object->type_ != Object::Type::IMAGE) {
+        return;
+    }
+    const auto &image_object = static_cast<const ImageObject &>(*object);
+    if (image_object.has_features() && image_object.feature_matrix != &features_) {
+        set_features(object, image_object.features(), image_object.model_id);
+    }
+}
+
+const FeatureMatrix &ObjectDatabase::get_feature_matrix() const {
+    return features_;
+}
+
+void ObjectDatabase::set_perceptual_hash(const std::shared_ptr<Object> &object, uint64_t hash) {
+    if (object->type_ != Object::Type::IMAGE) {
+        throw std::invalid_argument("Object is not an image: " + object->path_.generic_string());
+    }
+    std::lock_guard<std::mutex> lock(results_mutex_);
+    static_cast<ImageObject &>(*object).perceptual_hash = hash;
+    perceptual_index_.add(object, hash);
+}
+
+std::vector<HammingIndex::Match> ObjectDatabase::find_perceptually_similar(const std::shared_ptr<Object> &object,
+                                                                           int max_distance) const {
+    if (object->type_ != Object::Type::IMAGE) {
+        return {};
+    }
+    const auto &hash = static_cast<const ImageObject &>(*object).perceptual_hash;
+    if (!hash) {
+        return {};
+    }
+    auto matches = perceptual_index_.search(*hash, max_distance);
+    std::erase_if(matches, [&object](const HammingIndex::Match &match) {
+        return match.object == object;
     });
+    return matches;
+}
+
+const std::shared_ptr<Object> &ObjectDatabase::find_by_path(const boost::filesystem::path &path) const {
+    auto it = path_index_.find(path.native());
+    if (it == path_index_.end()) {
+        throw std::runtime_error("Object not found: " + path.generic_string());
+    }
+    return it->second;
+}
+
+bool ObjectDatabase::contains(const boost::filesystem::path &path) const {
+    return path_index_.contains(path.native());
 }
 
 size_t ObjectDatabase::size() const {
-    return objects_.size();
+    // Unlike objects_, always up to date:
+    return path_index_.size();
+}
+
+const boost::filesystem::path &ObjectDatabase::get_dir() const {
+    return dir_;
+}
+
+std::shared_ptr<Object> ObjectDatabase::find_identical(const std::shared_ptr<Object> &object) const {
+    if (object->partial_hash_ == 0) {
+        return nullptr;
+    }
+    auto ensure_content_hash = [this](Object &candidate) {
+        if (candidate.content_hash_ == 0) {
+            try {
+                // The file may still be on its way here:
+                ctx_.get_file_transfer().WaitFor(candidate.path_);
+                candidate.content_hash_ = FullFileHash(candidate.path_);
+            } catch (const std::runtime_error &e) {
+                spdlog::warn("Failed to hash {}: {}", candidate.path_.generic_string(), e.what());
+            }
+        }
+        return candidate.content_hash_;
+    };
+    auto [begin, end] = hash_index_.equal_range(object->partial_hash_);
+    for (auto it = begin; it != end; ++it) {
+        const auto &candidate = it->second;
+        if (candidate == object || candidate->size_ != object->size_) {
+            continue;
+        }
+        const uint64_t content_hash = ensure_content_hash(*object);
+        if (content_hash == 0 || ensure_content_hash(*candidate) != content_hash) {
+            continue;
+        }
+        // The caller deletes the object on a match, a hash collision must not be enough for that:
+        try {
+            ctx_.get_file_transfer().WaitFor(candidate->path_);
+            if (FilesEqual(object->path_, candidate->path_)) {
+                return candidate;
+            }
+            spdlog::warn("{} and {} have the same hash but different content", object->path_.generic_string(),
+                         candidate->path_.generic_string());
+        } catch (const std::runtime_error &e) {
+            spdlog::warn("Failed to compare {} with {}: {}", object->path_.generic_string(),
+                         candidate->path_.generic_string(), e.what());
+        }
+    }
+    return nullptr;
 }
 
 const std::vector<std::shared_ptr<Object>> &ObjectDatabase::get_objects() const {
@@ -120,49 +461,200 @@ const std::vector<std::shared_ptr<Object>> &ObjectDatabase::get_objects() const
 std::vector<std::shared_ptr<Object>> ObjectDatabase::find_similar(
         const std::shared_ptr<Object> &object,
         float threshold) const {
-    std::vector<std::shared_ptr<Object>> similar_objects;
-    for (const auto &other_object: objects_) {
-        if (object != other_object) {
-            float similarity_value = similarity(*object, *other_object);
-            if (similarity_value >= threshold) {
-                similar_objects.push_back(other_object);
+    sync_index();
+    return index_->search(*object, threshold);
+}
+
+std::vector<std::vector<std::shared_ptr<Object>>> ObjectDatabase::find_similar_batch(
+        const std::vector<std::shared_ptr<Object>> &objects,
+        float threshold) const {
+    sync_index();
+    return index_->search_batch(objects, threshold);
+}
+
+void ObjectDatabase::invalidate_index() {
+    index_synced_ = false;
+}
+
+void ObjectDatabase::sync_index() const {
+    if (index_synced_) {
+        return;
+    }
+    spdlog::debug("Indexing features of {}...", dir_.generic_string());
+    if (staged_additions_.empty() && staged_removals_.empty()) {
+        index_->add_all(objects_);
+    } else {
+        // objects_ doesn't have the staged changes yet, and the rows of the staged removals may be released already:
+        std::vector<std::shared_ptr<Object>> objects;
+        objects.reserve(objects_.size() + staged_additions_.size());
+        for (const auto &object: objects_) {
+            if (!staged_removals_.contains(object)) {
+                objects.push_back(object);
             }
         }
+        objects.insert(objects.end(), staged_additions_.begin(), staged_additions_.end());
+        index_->add_all(objects);
     }
-    return similar_objects;
+    index_synced_ = true;
+    spdlog::debug("Indexed {} objects of {}", index_->size(), dir_.generic_string());
 }
 
 void ObjectDatabase::add_object(const std::shared_ptr<Object> &object) {
-    objects_.push_back(object);
-    sort_objects();
+    adopt_features(object);
+    if (object->type_ == Object::Type::IMAGE) {
+        const auto &hash = static_cast<const ImageObject &>(*object).perceptual_hash;
+        if (hash) {
+            perceptual_index_.add(object, *hash);
+        }
+    }
+    path_index_.emplace(object->path_.native(), object);
+    if (object->partial_hash_ != 0) {
+        hash_index_.emplace(object->partial_hash_, object);
+    }
+    if (index_synced_) {
+        index_->add(object);
+    }
+    insert_objects({object});
 }
 
-void ObjectDatabase::sort_objects() {
-    std::sort(objects_.begin(), objects_.end(), [](const auto &a, const auto &b) {
-        return a->path_.generic_string() < b->path_.generic_string();
-    });
+void ObjectDatabase::BeginBatch() {
+    ++batch_depth_;
+}
+
+void ObjectDatabase::CommitBatch() {
+    if (batch_depth_ == 0) {
+        throw std::logic_error("CommitBatch without BeginBatch");
+    }
+    if (--batch_depth_ == 0) {
+        apply_staged_changes();
+    }
+}
+
+void ObjectDatabase::insert_objects(const std::vector<std::shared_ptr<Object>> &objects) {
+    for (const auto &object: objects) {
+        // Removed and re-added within the batch, it is still in objects_:
+        if (!staged_removals_.erase(object)) {
+            staged_additions_.push_back(object);
+        }
+    }
+    if (batch_depth_ == 0) {
+        apply_staged_changes();
+    }
+}
+
+void ObjectDatabase::erase_object(const std::shared_ptr<Object> &object) {
+    auto staged = std::find(staged_additions_.begin(), staged_additions_.end(), object);
+    if (staged != staged_additions_.end()) {
+        // Added and removed within the batch, objects_ never had it:
+        staged_additions_.erase(staged);
+    } else {
+        staged_removals_.insert(object);
+    }
+    if (batch_depth_ == 0) {
+        apply_staged_changes();
+    }
+}
+
+void ObjectDatabase::apply_staged_changes() {
+    // Paths are compared as they are stored; on POSIX that is the generic format already, without a copy:
+    auto by_path = [](const std::shared_ptr<Object> &a, const std::shared_ptr<Object> &b) {
+        return a->path_.native() < b->path_.native();
+    };
+    if (!staged_removals_.empty()) {
+        std::erase_if(objects_, [this](const std::shared_ptr<Object> &object) {
+            return staged_removals_.contains(object);
+        });
+        staged_removals_.clear();
+    }
+    if (!staged_additions_.empty()) {
+        std::sort(staged_additions_.begin(), staged_additions_.end(), by_path);
+        const auto old_size = static_cast<std::ptrdiff_t>(objects_.size());
+        objects_.insert(objects_.end(), staged_additions_.begin(), staged_additions_.end());
+        std::inplace_merge(objects_.begin(), objects_.begin() + old_size, objects_.end(), by_path);
+        staged_additions_.clear();
+    }
 }
 
 void ObjectDatabase::remove_object(const std::shared_ptr<Object> &object) {
+    ctx_.get_file_transfer().WaitFor(object->path_);
     boost::filesystem::remove(object->path_);
-    objects_.erase(std::remove(objects_.begin(), objects_.end(), object), objects_.end());
+    if (file_names_listed_ && object->path_.parent_path() == dir_) {
+        file_names_.erase(object->path_.filename().native());
+    }
+    forget_object(object);
+    if (object->type_ == Object::Type::IMAGE) {
+        // The released row goes away with the next compaction:
+        auto &image_object = static_cast<ImageObject &>(*object);
+        if (image_object.feature_matrix == &features_) {
+            image_object.feature_matrix = nullptr;
+            image_object.feature_row = 0;
+        }
+    }
+    compact_features();
+}
+
+void ObjectDatabase::forget_object(const std::shared_ptr<Object> &object) {
+    index_->remove(object);
+    perceptual_index_.remove(*object);
+    if (object->type_ == Object::Type::IMAGE) {
+        const auto &image_object = static_cast<const ImageObject &>(*object);
+        if (image_object.feature_matrix == &features_) {
+            // The object keeps pointing at the released row, so it can still be moved to another database:
+            features_.release_row(image_object.feature_row);
+        }
+    }
+    path_index_.erase(object->path_.native());
+    auto [begin, end] = hash_index_.equal_range(object->partial_hash_);
+    for (auto it = begin; it != end; ++it) {
+        if (it->second == object) {
+            hash_index_.erase(it);
+            break;
+        }
+    }
+    erase_object(object);
+}
+
+boost::filesystem::path ObjectDatabase::reserve_path(const boost::filesystem::path &file_name) {
+    if (!file_names_listed_) {
+        for (const auto &entry: boost::filesystem::directory_iterator(dir_)) {
+            file_names_.insert(entry.path().filename().native());
+        }
+        file_names_listed_ = true;
+    }
+    if (file_names_.insert(file_name.native()).second) {
+        return dir_ / file_name;
+    }
+    spdlog::warn("File already exists: {}", (dir_ / file_name).generic_string());
+    for (size_t i = 1;; ++i) {
+        auto candidate = file_name.stem().native() + " (" + std::to_string(i) + ")" + file_name.extension().native();
+        if (file_names_.insert(candidate).second) {
+            return dir_ / candidate;
+        }
+    }
 }
 
 void copy_object(ObjectDatabase &from, ObjectDatabase &to, const std::shared_ptr<Object> &object) {
     if (from.contains(object->path_)) {
-        to.add_object(object);
-        from.remove_object(object);
-        auto new_path = to.dir_ / object->path_.filename();
-        if (boost::filesystem::exists(new_path)) {
-            spdlog::warn("File already exists: {}", new_path.generic_string());
-            size_t i = 1;
-            do {
-                new_path = to.dir_ / (object->path_.stem().generic_string() + " (" + std::to_string(i) + ")" +
-                                      object->path_.extension().generic_string());
-                i++;
-            } while (boost::filesystem::exists(new_path));
-        }
-        std::filesystem::copy(object->path_.generic_string(), new_path.generic_string());
+        auto new_path = to.reserve_path(object->path_.filename());
+        to.ctx_.get_file_transfer().Copy(object->path_, new_path);
+
+        // The copy is a separate object, the original stays in `from` under its own path. The transfer keeps the
+        // mtime, so the copy's stored record matches it on the next run:
+        auto copy = Object::Create(new_path);
+        copy->size_ = object->size_;
+        copy->mtime_ = object->mtime_;
+        copy->partial_hash_ = object->partial_hash_;
+        copy->content_hash_ = object->content_hash_;
+        to.add_object(copy);
+        if (object->type_ == Object::Type::IMAGE) {
+            const auto &image_object = static_cast<const ImageObject &>(*object);
+            if (image_object.has_features()) {
+                to.set_features(copy, image_object.features(), image_object.model_id);
+            }
+            if (image_object.perceptual_hash) {
+                to.set_perceptual_hash(copy, *image_object.perceptual_hash);
+            }
+        }
     } else {
         throw std::runtime_error("Object not found in database: " + object->path_.generic_string());
     }
@@ -170,21 +662,15 @@ void copy_object(ObjectDatabase &from, ObjectDatabase &to, const std::shared_ptr
 
 void move_object(ObjectDatabase &from, ObjectDatabase &to, const std::shared_ptr<Object> &object) {
     if (from.contains(object->path_)) {
-        auto new_path = to.dir_ / object->path_.filename();
-        if (boost::filesystem::exists(new_path)) {
-            spdlog::warn("File already exists: {}", new_path.generic_string());
-            size_t i = 1;
-            do {
-                new_path = to.dir_ / (object->path_.stem().generic_string() + " (" + std::to_string(i) + ")" +
-                                      object->path_.extension().generic_string());
-                i++;
-            } while (boost::filesystem::exists(new_path));
-        }
-        std::filesystem::rename(object->path_.generic_string(), new_path.generic_string());
-        from.remove_object(object);
+        auto new_path = to.reserve_path(object->path_.filename());
+        to.ctx_.get_file_transfer().Move(object->path_, new_path);
+        // The file isn't gone yet, but it will be:
+        from.forget_object(object);
 
         object->path_ = new_path;
         to.add_object(object);
+        // Only now that `to` has its own copy of the features:
+        from.compact_features();
     } else {
         throw std::runtime_error("Object not found in database: " + object->path_.generic_string());
     }
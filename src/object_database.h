@@ -1,11 +1,21 @@
 #pragma once
 
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <boost/filesystem.hpp>
 #include <utility>
 
+#include <directory_walker.h>
+#include <feature_matrix.h>
+#include <feature_store.h>
+#include <hamming_index.h>
+#include <similarity_index.h>
+
 class Context;
 
 class Object {
@@ -17,6 +27,11 @@ public:
 
     Type type_;
     boost::filesystem::path path_;
+    uintmax_t size_;
+    std::time_t mtime_;
+    // Content hashes (see content_hash.h), 0 until computed:
+    uint64_t partial_hash_;
+    uint64_t content_hash_;
 
     Object(Type type, boost::filesystem::path path);
 
@@ -28,6 +43,9 @@ public:
 
     static bool IsImageFile(const boost::filesystem::path &file_path);
 
+    // IsImageFile for a bare file name, cheap enough to call for every directory entry:
+    static bool IsImageFileName(std::string_view file_name);
+
     static std::shared_ptr<Object> Create(const boost::filesystem::path &path);
 };
 
@@ -35,7 +53,18 @@ class ImageObject : public Object {
 public:
     explicit ImageObject(boost::filesystem::path path);
 
-    std::vector<float> features;
+    [[nodiscard]] bool has_features() const;
+
+    // Full precision features, see FeatureMatrix::exact_row: normalized (or as stored in a FeatureStore, which
+    // is normalized up to rounding). Only valid until the next row is added to the owning database's matrix.
+    [[nodiscard]] std::span<const float> features() const;
+
+    const FeatureMatrix *feature_matrix;
+    size_t feature_row;
+    // FeatureStore::ModelId of the model that produced the features:
+    uint64_t model_id;
+    // 64-bit dHash, see PerceptualHashProcessor:
+    std::optional<uint64_t> perceptual_hash;
 };
 
 float similarity(const Object &a, const Object &b);
@@ -44,7 +73,25 @@ class ObjectDatabase {
 public:
     ObjectDatabase(Context &ctx, boost::filesystem::path dir);
 
-    void Update();
+    // Adds the files under the database directory that aren't objects yet. The directory tree is walked on
+    // scan.threads threads (see WalkDirectory). Returns the number of objects added.
+    size_t Update();
+
+    // Adds the given files (under the database directory) as objects, skipping the ones that are objects already or
+    // don't exist anymore. Returns the number of objects added.
+    size_t AddFiles(const std::vector<boost::filesystem::path> &paths);
+
+    // Adds already stat'ed files (see Scan) in one batch: one sort, one index invalidation. Skips the ones that are
+    // objects already and returns the new objects.
+    std::vector<std::shared_ptr<Object>> AddEntries(const std::vector<FileEntry> &entries);
+
+    // Lists the image files under the database directory without adding them, handing them to `on_files` a
+    // directory at a time as the walk finds them. `on_files` is called concurrently from the walker threads.
+    void Scan(const std::function<void(std::vector<FileEntry> &&)> &on_files) const;
+
+    // Persists the hashes and features of all objects, so the next run doesn't have to recompute them. Commit open
+    // batches first.
+    void Save() const;
 
     [[nodiscard]] const std::shared_ptr<Object> &find_by_path(const boost::filesystem::path &path) const;
 
@@ -52,26 +99,141 @@ public:
 
     [[nodiscard]] size_t size() const;
 
+    [[nodiscard]] const boost::filesystem::path &get_dir() const;
+
+    // An object of this database with exactly the same content as `object` (which may belong to another database),
+    // or nullptr. Full content hashes are only computed for objects whose partial hashes collide, and the files are
+    // only compared byte for byte when the full hashes match too.
+    [[nodiscard]] std::shared_ptr<Object> find_identical(const std::shared_ptr<Object> &object) const;
+
+    // Sorted by path. Doesn't include the changes staged in an open batch yet.
     [[nodiscard]] const std::vector<std::shared_ptr<Object>> &get_objects() const;
 
     [[nodiscard]] std::vector<std::shared_ptr<Object>>
     find_similar(const std::shared_ptr<Object> &object, float threshold) const;
 
+    // Same as calling find_similar for each object, but compares whole blocks of objects at once.
+    [[nodiscard]] std::vector<std::vector<std::shared_ptr<Object>>>
+    find_similar_batch(const std::vector<std::shared_ptr<Object>> &objects, float threshold) const;
+
+    // Stores (a normalized copy of) `features` as the features of an image object of this database.
+    // set_features and set_perceptual_hash may be called concurrently, by processors running side by side.
+    void set_features(const std::shared_ptr<Object> &object, std::span<const float> features, uint64_t model_id);
+
+    [[nodiscard]] const FeatureMatrix &get_feature_matrix() const;
+
+    void set_perceptual_hash(const std::shared_ptr<Object> &object, uint64_t hash);
+
+    // Image objects of this database whose perceptual hash is within max_distance bits of the one of `object`
+    // (which may belong to another database), closest first. Empty if `object` has no perceptual hash.
+    [[nodiscard]] std::vector<HammingIndex::Match>
+    find_perceptually_similar(const std::shared_ptr<Object> &object, int max_distance) const;
+
+    // Must be called after a processor computed features of objects that are already in the database.
+    // The similarity index picks them up lazily on the next find_similar, so databases that are never
+    // queried never pay for indexing.
+    void invalidate_index();
+
+    // Batches keep objects_ sorted cheaply across many add_object and remove_object calls (and the moves and copies
+    // made of them): in between BeginBatch and CommitBatch, objects are looked up, indexed and compared as usual, but
+    // only the sorted object list is updated at the end, by one merge. Batches nest, the outermost commit applies.
+    void BeginBatch();
+
+    void CommitBatch();
+
     void add_object(const std::shared_ptr<Object> &object);
 
+    // Deletes the object's file and removes the object.
     void remove_object(const std::shared_ptr<Object> &object);
 
+    // move_object and copy_object only queue the file transfer (see Context::get_file_transfer), the databases are
+    // updated right away. Name collisions in the destination get a " (i)" suffix.
     friend void copy_object(ObjectDatabase &from, ObjectDatabase &to, const std::shared_ptr<Object> &object);
 
     friend void move_object(ObjectDatabase &from, ObjectDatabase &to, const std::shared_ptr<Object> &object);
 
 private:
 
-    void sort_objects();
+    // Adds to or removes from objects_, or stages that when a batch is open:
+    void insert_objects(const std::vector<std::shared_ptr<Object>> &objects);
+
+    void erase_object(const std::shared_ptr<Object> &object);
+
+    // Applies the staged changes to objects_: one pass for the removals, one merge for the additions.
+    void apply_staged_changes();
+
+    // Removes the object from the database without touching its file:
+    void forget_object(const std::shared_ptr<Object> &object);
+
+    // A path in dir_ for a file called `file_name` that no other file has or will have, and reserves it:
+    boost::filesystem::path reserve_path(const boost::filesystem::path &file_name);
+
+    void sync_index() const;
+
+    [[nodiscard]] std::string relative_path(const boost::filesystem::path &path) const;
+
+    // Restores the hashes and features of an unchanged object from store_:
+    void load_stored_record(const std::shared_ptr<Object> &object);
+
+    // Computes the partial hashes that are missing, in parallel (the work is mostly waiting for the disk):
+    void compute_partial_hashes(const std::vector<std::shared_ptr<Object>> &objects);
+
+    // set_features, `persistent` as in FeatureMatrix::add_row:
+    void store_features(const std::shared_ptr<Object> &object, std::span<const float> features, uint64_t model_id,
+                        bool persistent);
+
+    // Forgets the features of every object and starts features_ and the similarity index over:
+    void drop_features();
+
+    // Drops the released rows of features_ once they outnumber the live ones, and re-indexes. Removed objects must not
+    // refer to features_ any more, and moved ones must have been added to their new database:
+    void compact_features();
+
+    // Copies the features of an object coming from another database into features_:
+    void adopt_features(const std::shared_ptr<Object> &object);
 
     Context &ctx_;
     boost::filesystem::path dir_;
+    size_t scan_threads_;
+
+    // Declared before features_, whose compressed rows may point into its mapping:
+    FeatureStore store_;
+    FeatureMatrix features_;
+    mutable std::unique_ptr<SimilarityIndex> index_;
+    mutable bool index_synced_;
 
     std::vector<std::shared_ptr<Object>> objects_;
+    // Changes to objects_ made during an open batch, applied by the outermost CommitBatch:
+    size_t batch_depth_;
+    std::vector<std::shared_ptr<Object>> staged_additions_;
+    std::unordered_set<std::shared_ptr<Object>> staged_removals_;
+    // path_.native() -> object, kept in sync with objects_ by AddFiles, add_object and remove_object:
+    std::unordered_map<std::string, std::shared_ptr<Object>> path_index_;
+    // partial_hash_ -> objects, for objects whose partial hash is known:
+    std::unordered_multimap<uint64_t, std::shared_ptr<Object>> hash_index_;
+    HammingIndex perceptual_index_;
+    // Names of the files directly in dir_, including the reserved ones; listed on the first reserve_path:
+    std::unordered_set<std::string> file_names_;
+    bool file_names_listed_;
+    // Serializes set_features and set_perceptual_hash:
+    std::mutex results_mutex_;
 };
 
+// Keeps a batch of a database open for its lifetime, see ObjectDatabase::BeginBatch.
+class ScopedBatch {
+public:
+    explicit ScopedBatch(ObjectDatabase &db) : db_(db) {
+        db_.BeginBatch();
+    }
+
+    ~ScopedBatch() {
+        db_.CommitBatch();
+    }
+
+    ScopedBatch(const ScopedBatch &) = delete;
+
+    ScopedBatch &operator=(const ScopedBatch &) = delete;
+
+private:
+    ObjectDatabase &db_;
+};
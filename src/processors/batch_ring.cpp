@@ -0,0 +1,139 @@
+#include "batch_ring.h"
+
+BatchRing::BatchRing(size_t slot_count, size_t batch_size, const std::vector<int64_t> &image_shape, bool pinned)
+        : batch_size_(std::max<size_t>(batch_size, 1)),
+          slots_(std::max<size_t>(slot_count, 1)),
+          closed_(false) {
+    std::vector<int64_t> shape = {static_cast<int64_t>(batch_size_)};
+    shape.insert(shape.end(), image_shape.begin(), image_shape.end());
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        slots_[i].tensor = torch::empty(shape, torch::TensorOptions().dtype(torch::kFloat32).pinned_memory(pinned));
+        slots_[i].paths.resize(batch_size_);
+        slots_[i].tags.resize(batch_size_);
+        free_slots_.push_back(i);
+    }
+}
+
+std::optional<BatchRing::Position> BatchRing::acquire() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    slot_freed_.wait(lock, [this] { return closed_ || filling_slot_ || !free_slots_.empty(); });
+    if (closed_) {
+        return std::nullopt;
+    }
+    if (!filling_slot_) {
+        filling_slot_ = free_slots_.front();
+        free_slots_.pop_front();
+    }
+    const size_t slot = *filling_slot_;
+    const size_t index = slots_[slot].acquired++;
+    if (slots_[slot].acquired == batch_size_) {
+        seal(slot);
+    }
+    return Position{slot, index};
+}
+
+torch::Tensor BatchRing::image(const Position &position) const {
+    return slots_[position.slot].tensor[static_cast<int64_t>(position.index)];
+}
+
+void BatchRing::commit(const Position &position, const boost::filesystem::path &path, size_t tag) {
+    bool ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto &slot = slots_[position.slot];
+        slot.paths[position.index] = path;
+        slot.tags[position.index] = tag;
+        ++slot.committed;
+        ready = slot.sealed && slot.committed == slot.acquired;
+        if (ready) {
+            ready_slots_.push_back(position.slot);
+        }
+    }
+    if (ready) {
+        slot_ready_.notify_one();
+    }
+}
+
+void BatchRing::seal(size_t slot) {
+    slots_[slot].sealed = true;
+    if (filling_slot_ == slot) {
+        filling_slot_.reset();
+    }
+    if (slots_[slot].committed == slots_[slot].acquired) {
+        ready_slots_.push_back(slot);
+    }
+    // Loaders waiting for a position can take the next free slot now:
+    slot_freed_.notify_all();
+}
+
+std::optional<BatchRing::Batch> BatchRing::pop_batch(std::chrono::steady_clock::duration max_wait) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        if (!ready_slots_.empty()) {
+            const size_t slot = ready_slots_.front();
+            ready_slots_.pop_front();
+            const auto count = static_cast<int64_t>(slots_[slot].committed);
+            return Batch{slot, slots_[slot].tensor.narrow(0, 0, count),
+                         std::span<const boost::filesystem::path>(slots_[slot].paths.data(), slots_[slot].committed),
+                         std::span<const size_t>(slots_[slot].tags.data(), slots_[slot].committed)};
+        }
+        const bool partial = filling_slot_ && slots_[*filling_slot_].acquired > 0;
+        if (closed_) {
+            if (!partial) {
+                return std::nullopt;
+            }
+            seal(*filling_slot_);
+            continue;
+        }
+        if (!slot_ready_.wait_for(lock, max_wait, [this] { return closed_ || !ready_slots_.empty(); }) &&
+            filling_slot_ && slots_[*filling_slot_].acquired > 0) {
+            // Deadline passed, run what we have (it becomes ready once its last images are committed):
+            seal(*filling_slot_);
+        }
+    }
+}
+
+void BatchRing::release(size_t slot) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        slots_[slot].acquired = 0;
+        slots_[slot].committed = 0;
+        slots_[slot].sealed = false;
+        free_slots_.push_back(slot);
+    }
+    slot_freed_.notify_all();
+}
+
+void BatchRing::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+    }
+    slot_freed_.notify_all();
+    slot_ready_.notify_all();
+}
+
+void BatchRing::cancel() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        ready_slots_.clear();
+        filling_slot_.reset();
+    }
+    slot_freed_.notify_all();
+    slot_ready_.notify_all();
+}
+
+void BatchRing::reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_slots_.clear();
+    ready_slots_.clear();
+    filling_slot_.reset();
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        slots_[i].acquired = 0;
+        slots_[i].committed = 0;
+        slots_[i].sealed = false;
+        free_slots_.push_back(i);
+    }
+    closed_ = false;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <torch/torch.h>
+#include <boost/filesystem.hpp>
+
+// Fixed set of preallocated batch tensors that loaders fill in place and the model consumes in place.
+//
+// Every slot is a [batch_size, image_shape...] float tensor, allocated once (in pinned memory when the batches are
+// copied to a device, so the copy can run asynchronously). Loaders acquire() a position in the slot that is being
+// filled, write their image into image(position) and commit() it; the consumer gets whole slots from pop_batch() and
+// hands them back with release(). Nothing is allocated per batch, and memory use is bounded by the slot count.
+class BatchRing {
+public:
+    struct Position {
+        size_t slot;
+        size_t index;
+    };
+
+    struct Batch {
+        size_t slot;
+        // The filled images of the slot, a view without a copy:
+        torch::Tensor images;
+        std::span<const boost::filesystem::path> paths;
+        // The tag each image was committed with:
+        std::span<const size_t> tags;
+    };
+
+    BatchRing(size_t slot_count, size_t batch_size, const std::vector<int64_t> &image_shape, bool pinned);
+
+    BatchRing(const BatchRing &) = delete;
+
+    BatchRing &operator=(const BatchRing &) = delete;
+
+    // Reserves a position for the next image, blocks while every slot is in use. nullopt once closed.
+    std::optional<Position> acquire();
+
+    // View of the image at `position`, writable until it is committed:
+    [[nodiscard]] torch::Tensor image(const Position &position) const;
+
+    // `tag` is handed back with the image in the batch, for the consumer to tell whom it belongs to.
+    void commit(const Position &position, const boost::filesystem::path &path, size_t tag = 0);
+
+    // Waits for a full slot; if none is full after max_wait, takes the slot being filled as a partial batch.
+    // nullopt once the ring is closed and drained.
+    std::optional<Batch> pop_batch(std::chrono::steady_clock::duration max_wait);
+
+    // Hands a slot from pop_batch back to the loaders. Its tensor must not be in use anymore.
+    void release(size_t slot);
+
+    // No more images will be acquired; pop_batch still returns the ones already committed.
+    void close();
+
+    // Like close(), but also drops the committed images.
+    void cancel();
+
+    // Makes every slot free again and reopens a closed ring. Nothing may use the ring while it is reset.
+    void reset();
+
+private:
+    struct Slot {
+        torch::Tensor tensor;
+        std::vector<boost::filesystem::path> paths;
+        std::vector<size_t> tags;
+        size_t acquired = 0;
+        size_t committed = 0;
+        // No more positions are handed out; the slot is ready once every acquired position is committed:
+        bool sealed = false;
+    };
+
+    // Requires mutex_:
+    void seal(size_t slot);
+
+    const size_t batch_size_;
+
+    std::vector<Slot> slots_;
+
+    std::mutex mutex_;
+    std::condition_variable slot_freed_;
+    std::condition_variable slot_ready_;
+    std::deque<size_t> free_slots_;
+    std::deque<size_t> ready_slots_;
+    std::optional<size_t> filling_slot_;
+    bool closed_;
+};
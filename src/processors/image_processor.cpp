@@ -1,170 +1,495 @@
 #include "image_processor.h"
 
 #include <context.h>
+#include <image_decode.h>
+#include <image_kernels.h>
 #include <object_database.h>
 
+namespace {
+    constexpr int kInputSize = ImageProcessor::kInputSize;
+
+    // Bumped whenever the preprocessing changes, so features computed the old way are recomputed.
+    // 1: channels swapped to the RGB order the ImageNet constants are given in.
+    constexpr uint64_t kPreprocessingVersion = 1;
+    // Model id variant bit of features computed in bfloat16:
+    constexpr uint64_t kBf16Variant = uint64_t(1) << 32;
+    // ... and of images decoded at reduced resolution (DCT-domain downscaling shows the model other pixels than a full
+    // decode and resize):
+    constexpr uint64_t kReducedDecodeVariant = uint64_t(1) << 33;
+    // ... and of images from the image cache, which are downscaled with INTER_AREA before the resize to the model input
+    // (whatever reduced_decode says, they are always decoded at reduced resolution):
+    constexpr uint64_t kImageCacheVariant = uint64_t(1) << 34;
+
+    // The quantized model (see tools/quantize_model.py) if image_processor.int8 is enabled, the fp32 one otherwise:
+    std::string model_path(const boost::property_tree::ptree &config) {
+        if (config.get<bool>("image_processor.int8.enabled")) {
+            return config.get<std::string>("image_processor.int8.model_path");
+        }
+        return config.get<std::string>("image_processor.model_path");
+    }
+
+    // Quantized ops only have CPU kernels:
+    torch::Device select_device(const boost::property_tree::ptree &config) {
+        if (config.get<bool>("image_processor.int8.enabled") || !torch::cuda::is_available()) {
+            return torch::kCPU;
+        }
+        return torch::kCUDA;
+    }
+
+    bool cpu_supports_bf16() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx512bf16") || __builtin_cpu_supports("amx-bf16");
+    }
+
+    // ImageNet statistics, RGB order:
+    constexpr float kMean[3] = {0.485f, 0.456f, 0.406f};
+    constexpr float kStd[3] = {0.229f, 0.224f, 0.225f};
+
+    // Writes an 8-bit BGR kInputSize x kInputSize image as normalized RGB floats, CHW or HWC (channels-last):
+    void write_normalized(const cv::Mat &image, float *out, bool channels_last) {
+        const size_t plane = static_cast<size_t>(kInputSize) * kInputSize;
+        if (channels_last) {
+            for (int y = 0; y < kInputSize; ++y) {
+                bgr_to_normalized_rgb_interleaved(image.ptr<uint8_t>(y), kInputSize, kMean, kStd,
+                                                  out + static_cast<size_t>(y) * kInputSize * 3);
+            }
+            return;
+        }
+        if (image.isContinuous()) {
+            bgr_to_normalized_rgb_planar(image.ptr<uint8_t>(), plane, kMean, kStd, out, plane);
+            return;
+        }
+        for (int y = 0; y < kInputSize; ++y) {
+            bgr_to_normalized_rgb_planar(image.ptr<uint8_t>(y), kInputSize, kMean, kStd,
+                                         out + static_cast<size_t>(y) * kInputSize, plane);
+        }
+    }
+}
+
 ImageProcessor::ImageProcessor(Context &ctx)
         : Processor("Image Processor"),
           ctx_(ctx),
-          device_(torch::cuda::is_available() ? torch::kCUDA : torch::kCPU),
+          device_(select_device(ctx_.get_config_tree())),
           model_(std::make_shared<torch::jit::script::Module>(
-                  torch::jit::load(ctx_.get_config_tree().get<std::string>("image_processor.model_path"), device_))),
+                  torch::jit::load(model_path(ctx_.get_config_tree()), device_))),
+          model_id_(0),
           threads_(ctx_.get_config_tree().get<size_t>("image_processor.threads")),
           batch_size_limit_(ctx_.get_config_tree().get<size_t>("image_processor.batch_size_limit")),
-          continue_processing_(true),
+          batch_deadline_(ctx_.get_config_tree().get<size_t>("image_processor.batch_deadline_ms")),
+          batch_slots_(ctx_.get_config_tree().get<size_t>("image_processor.batch_slots")),
+          reduced_decode_(ctx_.get_config_tree().get<bool>("image_processor.reduced_decode")),
+          channels_last_(false),
+          bf16_(false),
+          drift_check_images_(0),
           processed_images_count_(0),
-          paths_to_process_index_(0) {
+          decoded_images_count_(0),
+          decode_time_us_(0),
+          inference_time_us_(0),
+          metrics_(ctx_.get_metrics()),
+          load_seconds_(metrics_.get_histogram(
+                  "image_warrior_image_load_seconds", "Reading and decoding an image, or getting it from the cache",
+                  Metrics::LatencyBounds())),
+          resize_seconds_(metrics_.get_histogram(
+                  "image_warrior_image_resize_seconds", "Resizing an image to the model input",
+                  Metrics::LatencyBounds())),
+          normalize_seconds_(metrics_.get_histogram(
+                  "image_warrior_image_normalize_seconds", "Normalizing an image into its batch",
+                  Metrics::LatencyBounds())),
+          acquire_wait_seconds_(metrics_.get_histogram(
+                  "image_warrior_batch_acquire_wait_seconds", "Loaders waiting for room in the batch ring",
+                  Metrics::LatencyBounds())),
+          batch_wait_seconds_(metrics_.get_histogram(
+                  "image_warrior_batch_wait_seconds", "The model waiting for the next batch",
+                  Metrics::LatencyBounds())),
+          forward_seconds_(metrics_.get_histogram(
+                  "image_warrior_forward_seconds", "Model forward pass of a batch, including the copies",
+                  Metrics::LatencyBounds())),
+          project_seconds_(metrics_.get_histogram(
+                  "image_warrior_projection_seconds", "Feature projection of a batch", Metrics::LatencyBounds())),
+          batch_size_(metrics_.get_histogram(
+                  "image_warrior_batch_size", "Images per batch the model ran on",
+                  Metrics::ExponentialBounds(1, 2, 10))),
+          request_queue_depth_(metrics_.get_gauge(
+                  "image_warrior_image_request_queue_depth", "Submitted images waiting for a loader")),
+          load_failures_(metrics_.get_counter(
+                  "image_warrior_image_load_failures_total", "Images that couldn't be loaded")),
+          drift_checked_count_(0),
+          drift_cosine_sum_(0.0),
+          drift_cosine_min_(1.0),
+          submitted_images_count_(0),
+          // A few images per loader are enough to keep them busy, the batch ring holds the rest:
+          requests_(threads_ * 4),
+          next_job_id_(0) {
     model_->eval();
+    if (device_.is_cpu() && ctx_.get_config_tree().get<bool>("image_processor.cpu_inference.enabled")) {
+        ConfigureCpuInference();
+    }
+    // A quantized model is a different file, so its features get a model id of their own:
+    model_id_ = FeatureStore::ModelId(model_path(ctx_.get_config_tree()), ModelVariant());
+    if (ctx_.get_config_tree().get<bool>("projection.enabled")) {
+        LoadProjection();
+    }
+    spdlog::debug("Using {} image kernels", image_kernels_isa());
+    const auto image_shape = channels_last_ ? std::vector<int64_t>{kInputSize, kInputSize, 3}
+                                            : std::vector<int64_t>{3, kInputSize, kInputSize};
+    batch_ring_ = std::make_unique<BatchRing>(batch_slots_, batch_size_limit_, image_shape, device_.is_cuda());
+
+    for (size_t i = 0; i < threads_; ++i) {
+        loading_threads_.emplace_back(&ImageProcessor::ImageLoaderThread, this);
+    }
+    processing_thread_ = std::thread([this]() {
+        try {
+            ImageProcessingThread();
+        } catch (...) {
+            {
+                std::lock_guard<std::mutex> lock(jobs_mutex_);
+                processing_error_ = std::current_exception();
+            }
+            // Unblocks Submit and the loaders, they stop at their next push, pop or acquire:
+            requests_.cancel();
+            batch_ring_->cancel();
+            job_progress_.notify_all();
+        }
+    });
 }
 
-void ImageProcessor::Process(const ObjectDatabase &db) {
-    reset();
-    StderrSuppressor stderr_suppressor;
+ImageProcessor::~ImageProcessor() {
+    requests_.cancel();
+    batch_ring_->cancel();
+    for (auto &thread: loading_threads_) {
+        thread.join();
+    }
+    processing_thread_.join();
+}
+
+boost::filesystem::path ImageProcessor::ProjectionPath(const boost::property_tree::ptree &config) {
+    return model_path(config) + ".projection";
+}
+
+void ImageProcessor::LoadProjection() {
+    const auto projection_path = ProjectionPath(ctx_.get_config_tree());
+    if (!boost::filesystem::exists(projection_path)) {
+        spdlog::warn("No feature projection at {}, storing the full features (fit one with --fit-projection)",
+                     projection_path.generic_string());
+        return;
+    }
+    projection_ = std::make_unique<FeatureProjection>(FeatureProjection::Load(projection_path));
+    // Projected features are only comparable with ones of the same projection:
+    model_id_ = FeatureStore::ModelId(projection_path, model_id_);
+    spdlog::info("Projecting features from {} to {} values ({:.1f}% of the variance)", projection_->input_dim(),
+                 projection_->output_dim(), projection_->explained_variance() * 100.0);
+}
+
+uint64_t ImageProcessor::ModelVariant() const {
+    uint64_t variant = kPreprocessingVersion;
+    // bf16 features are close to, but not the same as fp32 ones; don't mix them:
+    if (bf16_) {
+        variant |= kBf16Variant;
+    }
+    if (ctx_.get_image_cache()) {
+        variant |= kImageCacheVariant;
+    } else if (reduced_decode_) {
+        variant |= kReducedDecodeVariant;
+    }
+    return variant;
+}
+
+void ImageProcessor::ConfigureCpuInference() {
+    const auto &config = ctx_.get_config_tree();
+
+    // The loaders have their own threads, so the model must not assume it has the whole machine:
+    torch::set_num_threads(config.get<int>("image_processor.cpu_inference.intra_op_threads"));
+    torch::set_num_interop_threads(config.get<int>("image_processor.cpu_inference.inter_op_threads"));
+
+    channels_last_ = config.get<bool>("image_processor.cpu_inference.channels_last");
+    // INT8 models are quantized already, converting them to bf16 would undo that:
+    if (config.get<bool>("image_processor.cpu_inference.bf16") && !config.get<bool>("image_processor.int8.enabled")) {
+        bf16_ = cpu_supports_bf16();
+        if (!bf16_) {
+            spdlog::warn("The CPU has no bfloat16 support, running the model in fp32");
+        }
+    }
+    drift_check_images_ = config.get<size_t>("image_processor.cpu_inference.drift_check_images");
+    if (drift_check_images_ > 0) {
+        reference_model_ = std::make_shared<torch::jit::script::Module>(model_->clone());
+    }
+
+    if (bf16_) {
+        model_->to(torch::kBFloat16);
+    }
+    // Folds parameters and batch norms into constants, then fuses ops for the CPU backend (oneDNN).
+    // quantize_jit already did the equivalent for INT8 models:
+    if (!config.get<bool>("image_processor.int8.enabled")) {
+        auto frozen_model = torch::jit::freeze(*model_);
+        model_ = std::make_shared<torch::jit::script::Module>(torch::jit::optimize_for_inference(frozen_model));
+    }
+
+    spdlog::info("CPU inference: {} intra-op / {} inter-op threads, {}, {}",
+                 torch::get_num_threads(), torch::get_num_interop_threads(),
+                 channels_last_ ? "channels-last" : "contiguous",
+                 config.get<bool>("image_processor.int8.enabled") ? "int8" : bf16_ ? "bf16" : "fp32");
+}
 
+void ImageProcessor::Process(ObjectDatabase &db) {
+    size_t up_to_date_count = 0;
+    std::vector<boost::filesystem::path> paths;
     for (const auto &object: db.get_objects()) {
-        if (object->type_ == Object::Type::IMAGE) {
-            paths_to_process_.push_back(object->path_);
+        if (NeedsFeatures(*object)) {
+            paths.push_back(object->path_);
+        } else if (object->type_ == Object::Type::IMAGE) {
+            ++up_to_date_count;
         }
     }
+    spdlog::info("{} images have up-to-date stored features, {} need processing", up_to_date_count, paths.size());
+    if (paths.empty()) {
+        return;
+    }
 
-    std::vector<std::thread> loading_threads;
-    for (size_t i = 0; i < threads_; ++i) {
-        loading_threads.emplace_back(&ImageProcessor::ImageLoaderThread, this);
+    // Runs on the processing thread; the database serializes set_features with other processors:
+    auto job = Start([this, &db](const boost::filesystem::path &path, std::span<const float> features) {
+        db.set_features(db.find_by_path(path), features, model_id_);
+    });
+    for (const auto &path: paths) {
+        if (!Submit(*job, path)) {
+            break;
+        }
     }
+    Finish(*job);
+}
 
-    std::thread processing_thread(&ImageProcessor::ImageProcessingThread, this, std::ref(db));
+std::shared_ptr<ImageProcessor::Job> ImageProcessor::Start(FeaturesCallback on_features, bool raw) {
+    std::lock_guard<std::mutex> lock(jobs_mutex_);
+    auto job = std::make_shared<Job>(Job{next_job_id_++, std::move(on_features), raw, 0});
+    jobs_.emplace(job->id, job);
+    return job;
+}
 
-    for (auto &thread: loading_threads) {
-        thread.join();
+bool ImageProcessor::Submit(Job &job, const boost::filesystem::path &path) {
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex_);
+        ++job.outstanding;
+    }
+    ++submitted_images_count_;
+    if (!requests_.push({path, job.id})) {
+        complete(job.id);
+        return false;
     }
+    request_queue_depth_.set(static_cast<int64_t>(requests_.size()));
+    return true;
+}
 
-    continue_processing_ = false;
+void ImageProcessor::Finish(Job &job) {
+    // Copied under the lock, the processing thread keeps updating them for other jobs:
+    size_t drift_checked_count;
+    double drift_cosine_sum;
+    double drift_cosine_min;
+    {
+        std::unique_lock<std::mutex> lock(jobs_mutex_);
+        job_progress_.wait(lock, [this, &job] { return job.outstanding == 0 || processing_error_; });
+        jobs_.erase(job.id);
+        if (processing_error_) {
+            std::rethrow_exception(processing_error_);
+        }
+        drift_checked_count = drift_checked_count_;
+        drift_cosine_sum = drift_cosine_sum_;
+        drift_cosine_min = drift_cosine_min_;
+    }
 
-    processing_thread.join();
+    // Totals of all jobs so far, the loaders and the model are shared:
+    const double inference_time = static_cast<double>(inference_time_us_.load()) / 1e6;
+    spdlog::info("Inference on {} images took {:.1f}s ({:.1f} images/s)", processed_images_count_.load(),
+                 inference_time,
+                 inference_time > 0 ? static_cast<double>(processed_images_count_) / inference_time : 0.0);
+    if (drift_checked_count > 0) {
+        spdlog::info("Cosine similarity to the fp32 reference over {} images: mean {:.6f}, min {:.6f}",
+                     drift_checked_count, drift_cosine_sum / static_cast<double>(drift_checked_count),
+                     drift_cosine_min);
+    }
+
+    const double decode_time = static_cast<double>(decode_time_us_) / 1e6;
+    spdlog::info("Loaders decoded {} images in {:.1f}s of decode time ({:.1f} images/s per thread, reduced decode {})",
+                 decoded_images_count_.load(), decode_time,
+                 decode_time > 0 ? static_cast<double>(decoded_images_count_) / decode_time : 0.0,
+                 reduced_decode_ ? "on" : "off");
 }
 
-void ImageProcessor::reset() {
-    continue_processing_ = true;
-    processed_images_count_ = 0;
+void ImageProcessor::complete(size_t job_id) {
+    bool done;
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex_);
+        auto it = jobs_.find(job_id);
+        if (it == jobs_.end()) {
+            // Finished early because processing failed:
+            return;
+        }
+        done = --it->second->outstanding == 0;
+    }
+    if (done) {
+        job_progress_.notify_all();
+    }
+}
 
-    paths_to_process_.clear();
-    paths_to_process_index_ = 0;
+std::shared_ptr<ImageProcessor::Job> ImageProcessor::find_job(size_t job_id) {
+    std::lock_guard<std::mutex> lock(jobs_mutex_);
+    return jobs_.at(job_id);
+}
+
+bool ImageProcessor::NeedsFeatures(const Object &object) const {
+    if (object.type_ != Object::Type::IMAGE) {
+        return false;
+    }
+    const auto &image_object = static_cast<const ImageObject &>(object);
+    return !image_object.has_features() || image_object.model_id != model_id_;
+}
+
+uint64_t ImageProcessor::GetModelId() const {
+    return model_id_;
+}
 
-    batch_paths_.clear();
-    batch_tensors_.clear();
+void ImageProcessor::CheckDrift(const torch::Tensor &images, const torch::Tensor &output) {
+    const int64_t count = std::min<int64_t>(images.size(0),
+                                            static_cast<int64_t>(drift_check_images_ - drift_checked_count_));
+    std::vector<torch::jit::IValue> input = {images.narrow(0, 0, count).contiguous()};
+    torch::NoGradGuard no_grad;
+    torch::Tensor reference = reference_model_->forward(input).toTensor();
+    reference = reference.to(torch::kCPU, torch::kFloat32).reshape({count, -1});
+
+    torch::Tensor cosine = torch::cosine_similarity(output.narrow(0, 0, count), reference, 1).to(torch::kDouble);
+    const double cosine_sum = cosine.sum().item<double>();
+    const double cosine_min = cosine.min().item<double>();
+    std::lock_guard<std::mutex> lock(jobs_mutex_);
+    drift_cosine_sum_ += cosine_sum;
+    drift_cosine_min_ = std::min(drift_cosine_min_, cosine_min);
+    drift_checked_count_ += count;
 }
 
-cv::Mat ImageProcessor::LoadImage(const boost::filesystem::path &file_path) {
-    auto image = cv::imread(file_path.string());
+cv::Mat ImageProcessor::LoadImage(const boost::filesystem::path &file_path) const {
+    // A file just moved into a database may still be on its way there:
+    ctx_.get_file_transfer().WaitFor(file_path);
+    // Likely decoded already, for the perceptual hash:
+    if (auto *image_cache = ctx_.get_image_cache()) {
+        return image_cache->Get(file_path);
+    }
+    auto image = reduced_decode_ ? DecodeImage(file_path, cv::IMREAD_COLOR, kInputSize)
+                                 : cv::imread(file_path.string());
     if (image.empty()) {
         throw std::runtime_error("Image is empty!");
     }
     return image;
 }
 
-void ImageProcessor::ImageProcessingThread(const ObjectDatabase &db) {
+void ImageProcessor::ImageProcessingThread() {
     // Print progress bar right away:
-    spdlog::info("Processed {}/{} images\033[A", processed_images_count_, paths_to_process_.size());
-    processed_images_count_ = 0;
+    spdlog::info("Processed {}/{} images\033[A", processed_images_count_.load(), submitted_images_count_.load());
     while (true) {
-        std::vector<torch::Tensor> tensors;
-        std::vector<boost::filesystem::path> paths;
-
-        {
-            std::lock_guard<std::mutex> lock(batch_mutex_);
-            tensors.swap(batch_tensors_);
-            paths.swap(batch_paths_);
+        // Runs as soon as a slot is full, or batch_deadline_ into a partial one:
+        Span batch_wait(metrics_, "batch_wait", &batch_wait_seconds_);
+        auto batch = batch_ring_->pop_batch(batch_deadline_);
+        if (!batch) {
+            break;
         }
-
-        if (tensors.empty()) {
-            if (!continue_processing_) {
-                break;
-            }
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            continue;
+        batch_wait.stop();
+        batch_size_.observe(static_cast<double>(batch->paths.size()));
+
+        auto inference_start = std::chrono::steady_clock::now();
+        Span forward(metrics_, "forward", &forward_seconds_);
+
+        // Channels-last batches are NHWC in memory, the permuted view is the NCHW tensor the model expects:
+        torch::Tensor images = channels_last_ ? batch->images.permute({0, 3, 1, 2}) : batch->images;
+        // A no-op on the CPU; from pinned memory the copy to the device doesn't block:
+        torch::Tensor input_tensor = images.to(device_, /*non_blocking=*/true);
+        if (bf16_) {
+            input_tensor = input_tensor.to(torch::kBFloat16);
         }
 
-        std::cout.flush();
-
-        torch::Tensor input_tensor = torch::stack(tensors).contiguous().to(device_);
-
         // Process the images with the model
         std::vector<torch::jit::IValue> input = {input_tensor};
         torch::NoGradGuard no_grad;
         torch::Tensor output = model_->forward(input).toTensor();
 
-        // Convert the output tensor to a std::vector<float> and return it
-        output = output.to(torch::kCPU);
+        // Flatten the output to one row of features per image and hand the rows to the database:
+        output = output.to(torch::kCPU, torch::kFloat32).reshape({output.size(0), -1}).contiguous();
+        forward.stop();
+        inference_time_us_ += std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - inference_start).count();
 
-        for (int i = 0; i < output.size(0); i++) {
-            torch::Tensor single_output = output[i];
+        if (reference_model_ && drift_checked_count_ < drift_check_images_) {
+            CheckDrift(images, output);
+        }
 
-            auto image_object = std::dynamic_pointer_cast<ImageObject>(db.find_by_path(paths[i]));
-            if (!image_object) {
-                throw std::runtime_error("Failed to find image object: " + paths[i].string());
-            }
+        // The whole batch at once, a single matrix multiply:
+        torch::Tensor projected;
+        if (projection_) {
+            Span project(metrics_, "project", &project_seconds_);
+            projected = projection_->Apply(output).contiguous();
+        }
 
-            image_object->features = std::vector<float>(single_output.data_ptr<float>(),
-                                                        single_output.data_ptr<float>() + single_output.numel());
+        const auto feature_count = static_cast<size_t>(output.size(1));
+        const float *output_data = output.data_ptr<float>();
+        for (int i = 0; i < output.size(0); i++) {
+            auto job = find_job(batch->tags[i]);
+            if (projected.defined() && !job->raw) {
+                const auto projected_count = static_cast<size_t>(projected.size(1));
+                job->on_features(batch->paths[i], std::span<const float>(
+                        projected.data_ptr<float>() + i * projected_count, projected_count));
+            } else {
+                job->on_features(batch->paths[i], std::span<const float>(
+                        output_data + i * feature_count, feature_count));
+            }
+            complete(batch->tags[i]);
         }
 
-        processed_images_count_ += paths.size();
+        processed_images_count_ += batch->paths.size();
+        // The features are copied out and the slot's input isn't referenced anymore:
+        batch_ring_->release(batch->slot);
 
-        spdlog::info("Processed {}/{} images\033[A", processed_images_count_, paths_to_process_.size());
+        spdlog::info("Processed {}/{} images\033[A", processed_images_count_.load(), submitted_images_count_.load());
     }
 
-    spdlog::info("Processed {}/{} images", processed_images_count_, paths_to_process_.size());
+    spdlog::info("Processed {}/{} images", processed_images_count_.load(), submitted_images_count_.load());
 }
 
 void ImageProcessor::ImageLoaderThread() {
-    boost::filesystem::path image_path;
     while (true) {
-        // check if we can load more images:
-        {
-            std::lock_guard<std::mutex> lock(paths_to_process_mutex_);
-            if (paths_to_process_index_ >= paths_to_process_.size()) {
-                break;
-            }
-            image_path = paths_to_process_[paths_to_process_index_++];
+        // Ends when the processor is destroyed or processing failed:
+        auto request = requests_.pop();
+        if (!request) {
+            break;
         }
+        const auto &image_path = request->path;
+        request_queue_depth_.set(static_cast<int64_t>(requests_.size()));
 
         cv::Mat resized_image;
 
         // load image:
         try {
+            Span load(metrics_, "load", &load_seconds_);
             auto image = LoadImage(image_path);
-            cv::resize(image, resized_image, cv::Size(224, 224));
+            decode_time_us_ += static_cast<uint64_t>(load.stop() * 1e6);
+            ++decoded_images_count_;
+            Span resize(metrics_, "resize", &resize_seconds_);
+            cv::resize(image, resized_image, cv::Size(kInputSize, kInputSize));
         } catch (const std::exception &e) {
+            load_failures_.add();
             spdlog::warn("Failed to load image {}: {}", image_path.string(), e.what());
             // Update the progress bar, so it's always visible:
-            spdlog::info("Processed {}/{} images\033[A", processed_images_count_, paths_to_process_.size());
+            spdlog::info("Processed {}/{} images\033[A", processed_images_count_.load(),
+                         submitted_images_count_.load());
+            complete(request->job_id);
             continue;
         }
 
-        // Convert to tensor
-        torch::Tensor image_tensor = torch::from_blob(resized_image.data,
-                                                      {resized_image.rows, resized_image.cols, 3},
-                                                      torch::kByte);
-        image_tensor = image_tensor.permute({2, 0, 1}); // Rearrange dimensions to CxHxW
-
-        // Normalize
-        image_tensor = image_tensor.to(torch::kFloat32).div(255);
-        image_tensor[0] = image_tensor[0].sub_(0.485).div_(0.229);
-        image_tensor[1] = image_tensor[1].sub_(0.456).div_(0.224);
-        image_tensor[2] = image_tensor[2].sub_(0.406).div_(0.225);
-
-        // Add to batch, but wait if the batch is full:
-        while (true) {
-            batch_mutex_.lock();
-            if (batch_paths_.size() >= batch_size_limit_) {
-                batch_mutex_.unlock();
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                continue;
-            }
-            batch_paths_.push_back(image_path);
-            batch_tensors_.push_back(image_tensor);
-            batch_mutex_.unlock();
+        Span acquire_wait(metrics_, "acquire_wait", &acquire_wait_seconds_);
+        auto position = batch_ring_->acquire();
+        if (!position) {
+            // Processing was cancelled:
             break;
         }
+        acquire_wait.stop();
+        {
+            Span normalize(metrics_, "normalize", &normalize_seconds_);
+            write_normalized(resized_image, batch_ring_->image(*position).data_ptr<float>(), channels_last_);
+        }
+        batch_ring_->commit(*position, image_path, request->job_id);
     }
-}
+}
\ No newline at end of file
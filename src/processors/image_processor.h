@@ -1,27 +1,102 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <unordered_map>
+
 #include <torch/torch.h>
 #include <torch/script.h>
 #include <opencv2/opencv.hpp>
 #include <boost/filesystem.hpp>
 
+#include <bounded_queue.h>
+#include <feature_projection.h>
+#include <metrics.h>
+#include <processors/batch_ring.h>
 #include <processors/processor.h>
 #include <utils.h>
 
 class Context;
+class Object;
 
 class ImageProcessor : public Processor {
 public:
+    using FeaturesCallback = std::function<void(const boost::filesystem::path &, std::span<const float>)>;
+
+    // A set of submitted images whose features go to the same callback:
+    struct Job {
+        size_t id;
+        FeaturesCallback on_features;
+        // Gets the model output even if there is a feature projection:
+        bool raw;
+        // Submitted images whose features weren't delivered yet (or that failed to load), guarded by jobs_mutex_:
+        size_t outstanding;
+    };
+
+    // Side of the square model input:
+    static constexpr int kInputSize = 224;
+
     explicit ImageProcessor(Context &ctx);
 
-    void Process(const ObjectDatabase &db) override;
+    // Where the feature projection of the configured model is fitted to, next to the model:
+    static boost::filesystem::path ProjectionPath(const boost::property_tree::ptree &config);
+
+    // Stops the loaders and the processing thread.
+    ~ImageProcessor() override;
+
+    void Process(ObjectDatabase &db) override;
+
+    // Streaming interface, Process is built on it. The loaders and the processing thread are started once with the
+    // processor and shared by all jobs, so several jobs (databases) can be in flight at once.
+    //
+    // Start opens a job, Submit queues an image of it (blocking while the loaders are behind) and Finish waits until
+    // every image submitted to the job went through, rethrowing a processing error. `on_features` gets the features
+    // of each image, on the processing thread: projected if there is a feature projection, unless `raw`. Images that
+    // fail to load are logged and skipped. Submit returns false once processing failed.
+    std::shared_ptr<Job> Start(FeaturesCallback on_features, bool raw = false);
+
+    bool Submit(Job &job, const boost::filesystem::path &path);
+
+    void Finish(Job &job);
+
+    // Whether the object is an image without features of the current model:
+    [[nodiscard]] bool NeedsFeatures(const Object &object) const;
+
+    [[nodiscard]] uint64_t GetModelId() const;
 
 private:
-    void reset();
+    struct Request {
+        boost::filesystem::path path;
+        size_t job_id;
+    };
+
+    // Called once per submitted image, after its features were delivered or it failed to load:
+    void complete(size_t job_id);
+
+    [[nodiscard]] std::shared_ptr<Job> find_job(size_t job_id);
+
+    // What the model id combines with the model file: everything that changes the features the model computes
+    // (preprocessing version, bf16, how images are decoded, whether they come from the image cache). Features of
+    // different variants are never mixed.
+    [[nodiscard]] uint64_t ModelVariant() const;
+
+    // Freezes and optimizes the model for CPU inference, see the "image_processor.cpu_inference" config section:
+    void ConfigureCpuInference();
 
-    static cv::Mat LoadImage(const boost::filesystem::path &file_path);
+    // Loads the feature projection at ProjectionPath, if there is one, and gives its features their own model id:
+    void LoadProjection();
 
-    void ImageProcessingThread(const ObjectDatabase &db);
+    // Compares the model output of a batch to the one of the unoptimized fp32 model:
+    void CheckDrift(const torch::Tensor &images, const torch::Tensor &output);
+
+    // From the shared image cache when it is enabled:
+    [[nodiscard]] cv::Mat LoadImage(const boost::filesystem::path &file_path) const;
+
+    void ImageProcessingThread();
 
     void ImageLoaderThread();
 
@@ -29,21 +104,70 @@ private:
 
     torch::Device device_;
     std::shared_ptr<torch::jit::script::Module> model_;
+    uint64_t model_id_;
+    // See the "projection" config section, null if disabled:
+    std::unique_ptr<FeatureProjection> projection_;
 
     // Settings:
     size_t threads_;
     size_t batch_size_limit_;
+    // How long a started batch waits for more images before it runs anyway:
+    std::chrono::milliseconds batch_deadline_;
+    // Preallocated batches, bounds the memory used for images to batch_slots * batch_size_limit images:
+    size_t batch_slots_;
+    // Decode JPEGs at a reduced resolution that still covers the model input:
+    bool reduced_decode_;
+    // Batches are laid out NHWC and handed to the model as channels-last tensors:
+    bool channels_last_;
+    // The model runs in bfloat16:
+    bool bf16_;
+    // Number of images whose features are also computed with reference_model_:
+    size_t drift_check_images_;
 
     // Inner stuff:
 
-    bool continue_processing_;
-    size_t processed_images_count_;
-
-    std::vector<boost::filesystem::path> paths_to_process_;
-    size_t paths_to_process_index_;
-    std::mutex paths_to_process_mutex_;
-
-    std::vector<boost::filesystem::path> batch_paths_;
-    std::vector<torch::Tensor> batch_tensors_;
-    std::mutex batch_mutex_;
+    std::atomic<size_t> processed_images_count_;
+
+    // Loader throughput:
+    std::atomic<size_t> decoded_images_count_;
+    std::atomic<uint64_t> decode_time_us_;
+
+    // Inference throughput:
+    std::atomic<uint64_t> inference_time_us_;
+
+    // Per-stage metrics:
+    Metrics &metrics_;
+    Histogram &load_seconds_;
+    Histogram &resize_seconds_;
+    Histogram &normalize_seconds_;
+    Histogram &acquire_wait_seconds_;
+    Histogram &batch_wait_seconds_;
+    Histogram &forward_seconds_;
+    Histogram &project_seconds_;
+    Histogram &batch_size_;
+    Gauge &request_queue_depth_;
+    Counter &load_failures_;
+
+    // The model as loaded (fp32, unoptimized), only kept for the drift check:
+    std::shared_ptr<torch::jit::script::Module> reference_model_;
+    // Written by the processing thread under jobs_mutex_, read by Finish under it:
+    size_t drift_checked_count_;
+    double drift_cosine_sum_;
+    double drift_cosine_min_;
+
+    std::atomic<size_t> submitted_images_count_;
+    BoundedQueue<Request> requests_;
+
+    std::mutex jobs_mutex_;
+    std::condition_variable job_progress_;
+    std::unordered_map<size_t, std::shared_ptr<Job>> jobs_;
+    size_t next_job_id_;
+    // Set when the processing thread failed; the processor is unusable from then on:
+    std::exception_ptr processing_error_;
+
+    std::vector<std::thread> loading_threads_;
+    std::thread processing_thread_;
+
+    // Loaders write preprocessed images straight into the batches the model runs on:
+    std::unique_ptr<BatchRing> batch_ring_;
 };
\ No newline at end of file
@@ -0,0 +1,87 @@
+#include "perceptual_hash_processor.h"
+
+#include <context.h>
+#include <image_decode.h>
+#include <object_database.h>
+
+PerceptualHashProcessor::PerceptualHashProcessor(Context &ctx)
+        : Processor("Perceptual Hash Processor"),
+          ctx_(ctx),
+          threads_(ctx_.get_config_tree().get<size_t>("perceptual_hash_processor.threads")) {
+
+}
+
+void PerceptualHashProcessor::Process(ObjectDatabase &db) {
+    std::vector<std::shared_ptr<Object>> objects_to_process;
+    for (const auto &object: db.get_objects()) {
+        if (object->type_ == Object::Type::IMAGE && !static_cast<const ImageObject &>(*object).perceptual_hash) {
+            objects_to_process.push_back(object);
+        }
+    }
+    spdlog::info("{} images need a perceptual hash", objects_to_process.size());
+    if (objects_to_process.empty()) {
+        return;
+    }
+
+    const size_t hashed_count = ProcessObjects(db, objects_to_process);
+    spdlog::info("Hashed {}/{} images", hashed_count, objects_to_process.size());
+}
+
+size_t PerceptualHashProcessor::ProcessObjects(ObjectDatabase &db,
+                                               const std::vector<std::shared_ptr<Object>> &objects) {
+    std::vector<std::shared_ptr<Object>> objects_to_process;
+    for (const auto &object: objects) {
+        if (object->type_ == Object::Type::IMAGE && !static_cast<const ImageObject &>(*object).perceptual_hash) {
+            objects_to_process.push_back(object);
+        }
+    }
+
+    std::vector<std::optional<uint64_t>> hashes(objects_to_process.size());
+    // Decoding is what takes the time, on the workers shared with the other processors:
+    ctx_.get_worker_pool().ParallelFor(objects_to_process.size(), [&](size_t i) {
+        try {
+            hashes[i] = DifferenceHash(LoadImage(objects_to_process[i]->path_));
+        } catch (const std::exception &e) {
+            spdlog::warn("Failed to load image {}: {}", objects_to_process[i]->path_.string(), e.what());
+        }
+    }, threads_);
+
+    size_t hashed_count = 0;
+    for (size_t i = 0; i < objects_to_process.size(); ++i) {
+        if (hashes[i]) {
+            db.set_perceptual_hash(objects_to_process[i], *hashes[i]);
+            ++hashed_count;
+        }
+    }
+    return hashed_count;
+}
+
+cv::Mat PerceptualHashProcessor::LoadImage(const boost::filesystem::path &file_path) const {
+    // Decoded at the size the image processor needs, which then gets it for free:
+    if (auto *image_cache = ctx_.get_image_cache()) {
+        cv::Mat gray_image;
+        cv::cvtColor(image_cache->Get(file_path), gray_image, cv::COLOR_BGR2GRAY);
+        return gray_image;
+    }
+    auto image = DecodeImage(file_path, cv::IMREAD_GRAYSCALE, kMinDecodeSize);
+    if (image.empty()) {
+        throw std::runtime_error("Image is empty!");
+    }
+    return image;
+}
+
+uint64_t PerceptualHashProcessor::DifferenceHash(const cv::Mat &gray_image) {
+    cv::Mat small;
+    cv::resize(gray_image, small, cv::Size(9, 8), 0, 0, cv::INTER_AREA);
+
+    uint64_t hash = 0;
+    for (int y = 0; y < 8; ++y) {
+        const auto *row = small.ptr<uint8_t>(y);
+        for (int x = 0; x < 8; ++x) {
+            if (row[x] > row[x + 1]) {
+                hash |= uint64_t(1) << (y * 8 + x);
+            }
+        }
+    }
+    return hash;
+}
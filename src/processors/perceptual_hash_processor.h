@@ -0,0 +1,41 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <boost/filesystem.hpp>
+
+#include <processors/processor.h>
+#include <utils.h>
+
+class Context;
+class Object;
+
+// Computes a 64-bit difference hash (dHash) of every image. Re-encodes and resizes of the same picture end up
+// within a few bits of each other, which settles most duplicates long before the CNN features are needed.
+class PerceptualHashProcessor : public Processor {
+public:
+    // The hash only needs 9x8 pixels, but downscaling from a few more averages out decoder noise:
+    static constexpr int kMinDecodeSize = 32;
+
+    explicit PerceptualHashProcessor(Context &ctx);
+
+    void Process(ObjectDatabase &db) override;
+
+    // Hashes the given image objects of `db` that have no perceptual hash yet. Returns the number hashed.
+    size_t ProcessObjects(ObjectDatabase &db, const std::vector<std::shared_ptr<Object>> &objects);
+
+    // Bit (y * 8 + x) is set when pixel (x, y) of a 9x8 downscale of the image is brighter than its right neighbour.
+    static uint64_t DifferenceHash(const cv::Mat &gray_image);
+
+private:
+    // Decodes at the lowest resolution the format allows (see DecodeImage), or takes the image from the shared image
+    // cache when it is enabled:
+    [[nodiscard]] cv::Mat LoadImage(const boost::filesystem::path &file_path) const;
+
+    Context &ctx_;
+
+    // Settings:
+    size_t threads_;
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 class ObjectDatabase;
 
@@ -14,7 +15,13 @@ public:
         return name_;
     }
 
-    virtual void Process(const ObjectDatabase &db) = 0;
+    // Names of the processors whose results this one reads; the scheduler runs them on a database first.
+    [[nodiscard]] virtual std::vector<std::string> GetDependencies() const {
+        return {};
+    }
+
+    // May be called for several databases at once, see ProcessorScheduler.
+    virtual void Process(ObjectDatabase &db) = 0;
 
     virtual ~Processor() = default;
 
@@ -0,0 +1,120 @@
+#include "processor_scheduler.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <spdlog/spdlog.h>
+
+#include <object_database.h>
+#include <utils.h>
+
+ProcessorScheduler::ProcessorScheduler(size_t parallel_tasks)
+        : pool_(std::max<size_t>(parallel_tasks, 1)) {
+
+}
+
+void ProcessorScheduler::Run(const std::vector<std::shared_ptr<Processor>> &processors,
+                             const std::vector<ObjectDatabase *> &databases) {
+    std::unordered_map<std::string, size_t> processor_indices;
+    for (size_t i = 0; i < processors.size(); ++i) {
+        processor_indices.emplace(processors[i]->GetName(), i);
+    }
+    // processor index -> indices of the processors that depend on it:
+    std::vector<std::vector<size_t>> dependents(processors.size());
+    std::vector<size_t> dependency_counts(processors.size(), 0);
+    for (size_t i = 0; i < processors.size(); ++i) {
+        for (const auto &dependency: processors[i]->GetDependencies()) {
+            auto it = processor_indices.find(dependency);
+            if (it == processor_indices.end()) {
+                throw std::runtime_error(processors[i]->GetName() + " depends on " + dependency +
+                                         ", which isn't enabled");
+            }
+            dependents[it->second].push_back(i);
+            ++dependency_counts[i];
+        }
+    }
+    // Kahn's algorithm, just to reject cycles before anything runs:
+    {
+        auto remaining = dependency_counts;
+        std::vector<size_t> ready;
+        for (size_t i = 0; i < processors.size(); ++i) {
+            if (remaining[i] == 0) {
+                ready.push_back(i);
+            }
+        }
+        size_t ordered_count = 0;
+        while (!ready.empty()) {
+            const size_t i = ready.back();
+            ready.pop_back();
+            ++ordered_count;
+            for (size_t dependent: dependents[i]) {
+                if (--remaining[dependent] == 0) {
+                    ready.push_back(dependent);
+                }
+            }
+        }
+        if (ordered_count != processors.size()) {
+            throw std::runtime_error("Processor dependencies are circular");
+        }
+    }
+
+    // Task (processor p, database d) is p * databases.size() + d:
+    std::mutex mutex;
+    std::condition_variable all_done;
+    std::vector<size_t> waiting_for(processors.size() * databases.size());
+    for (size_t p = 0; p < processors.size(); ++p) {
+        for (size_t d = 0; d < databases.size(); ++d) {
+            waiting_for[p * databases.size() + d] = dependency_counts[p];
+        }
+    }
+    size_t running_count = 0;
+    std::exception_ptr error;
+
+    // Processors may log from their own threads, so stderr is silenced once for the whole run:
+    StderrSuppressor stderr_suppressor;
+
+    // Requires mutex:
+    std::function<void(size_t, size_t)> start = [&](size_t p, size_t d) {
+        ++running_count;
+        pool_.Submit([&, p, d]() {
+            std::exception_ptr task_error;
+            try {
+                spdlog::info("Processing {} with processor: {}", databases[d]->get_dir().generic_string(),
+                             processors[p]->GetName());
+                processors[p]->Process(*databases[d]);
+            } catch (...) {
+                task_error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (task_error && !error) {
+                error = task_error;
+            }
+            if (!error) {
+                for (size_t dependent: dependents[p]) {
+                    if (--waiting_for[dependent * databases.size() + d] == 0) {
+                        start(dependent, d);
+                    }
+                }
+            }
+            if (--running_count == 0) {
+                all_done.notify_all();
+            }
+        });
+    };
+
+    std::unique_lock<std::mutex> lock(mutex);
+    for (size_t p = 0; p < processors.size(); ++p) {
+        if (dependency_counts[p] == 0) {
+            for (size_t d = 0; d < databases.size(); ++d) {
+                start(p, d);
+            }
+        }
+    }
+    all_done.wait(lock, [&running_count] { return running_count == 0; });
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <processors/processor.h>
+#include <thread_pool.h>
+
+class ObjectDatabase;
+
+// Runs processors over databases as a DAG of (processor, database) tasks.
+//
+// A task starts as soon as the processors it depends on (Processor::GetDependencies) are done with the same database,
+// so the databases are processed at the same time and independent processors run side by side. Processors storing
+// results into the same database concurrently rely on ObjectDatabase serializing set_features and
+// set_perceptual_hash.
+class ProcessorScheduler {
+public:
+    // At most `parallel_tasks` tasks run at a time.
+    explicit ProcessorScheduler(size_t parallel_tasks);
+
+    // Returns once every task is done. If a task throws, no new tasks are started and the first error is rethrown
+    // once the running ones are done. Throws std::runtime_error on unknown or circular dependencies.
+    void Run(const std::vector<std::shared_ptr<Processor>> &processors, const std::vector<ObjectDatabase *> &databases);
+
+private:
+    ThreadPool pool_;
+};
@@ -0,0 +1,399 @@
+#include "similarity_index.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <random>
+
+#include <spdlog/spdlog.h>
+
+#include <object_database.h>
+#include <utils.h>
+#include <vector_kernels.h>
+
+namespace {
+    // An IVF index trains once it has this many vectors per list, on at most kMaxTrainingSamplesPerList per list:
+    constexpr size_t kTrainingSamplesPerList = 39;
+    constexpr size_t kMaxTrainingSamplesPerList = 64;
+    constexpr size_t kTrainingIterations = 10;
+
+    // Queries compared against the same tile of rows at once, and the number of rows in a tile:
+    constexpr size_t kQueryBlock = 16;
+    constexpr size_t kRowTile = 256;
+
+    // Normalized full precision features of an image object, empty for everything else:
+    std::vector<float> query_features(const Object &object) {
+        if (object.type_ != Object::Type::IMAGE) {
+            return {};
+        }
+        const auto &image_object = static_cast<const ImageObject &>(object);
+        if (!image_object.has_features()) {
+            return {};
+        }
+        std::vector<float> features(image_object.feature_matrix->dim());
+        image_object.feature_matrix->load_query(image_object.feature_row, features.data());
+        return features;
+    }
+}
+
+void SimilarityIndex::add_all(const std::vector<std::shared_ptr<Object>> &objects) {
+    for (const auto &object: objects) {
+        add(object);
+    }
+}
+
+std::vector<std::vector<std::shared_ptr<Object>>>
+SimilarityIndex::search_batch(const std::vector<std::shared_ptr<Object>> &queries, float threshold) const {
+    std::vector<std::vector<std::shared_ptr<Object>>> results;
+    results.reserve(queries.size());
+    for (const auto &query: queries) {
+        results.push_back(search(*query, threshold));
+    }
+    return results;
+}
+
+std::optional<size_t> SimilarityIndex::row_of(const Object &object) const {
+    if (object.type_ != Object::Type::IMAGE) {
+        return std::nullopt;
+    }
+    const auto &image_object = static_cast<const ImageObject &>(object);
+    if (!image_object.has_features() || image_object.feature_matrix != &matrix_) {
+        return std::nullopt;
+    }
+    return image_object.feature_row;
+}
+
+std::unique_ptr<SimilarityIndex> SimilarityIndex::Create(const boost::property_tree::ptree &config,
+                                                         const FeatureMatrix &matrix) {
+    const auto type = config.get<std::string>("similarity_index.type");
+    if (type == "brute_force") {
+        return std::make_unique<BruteForceIndex>(matrix);
+    }
+    if (type == "ivf") {
+        return std::make_unique<IvfIndex>(matrix,
+                                          config.get<size_t>("similarity_index.lists"),
+                                          config.get<size_t>("similarity_index.probes"));
+    }
+    throw std::runtime_error("Unknown similarity index type: " + type);
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// BruteForceIndex:
+// ---------------------------------------------------------------------------------------------------------------------
+
+BruteForceIndex::BruteForceIndex(const FeatureMatrix &matrix)
+        : SimilarityIndex(matrix) {
+
+}
+
+void BruteForceIndex::add(const std::shared_ptr<Object> &object) {
+    auto row = row_of(*object);
+    if (!row || rows_.contains(object.get())) {
+        return;
+    }
+    if (*row >= row_objects_.size()) {
+        row_objects_.resize(std::max(*row + 1, row_objects_.size() * 2));
+    }
+    row_objects_[*row] = object;
+    rows_.emplace(object.get(), *row);
+}
+
+void BruteForceIndex::remove(const std::shared_ptr<Object> &object) {
+    auto it = rows_.find(object.get());
+    if (it == rows_.end()) {
+        return;
+    }
+    row_objects_[it->second].reset();
+    rows_.erase(it);
+}
+
+bool BruteForceIndex::contains(const Object &object) const {
+    return rows_.contains(&object);
+}
+
+std::vector<std::shared_ptr<Object>> BruteForceIndex::search(const Object &query, float threshold) const {
+    std::vector<std::shared_ptr<Object>> result;
+    auto features = query_features(query);
+    if (features.empty() || rows_.empty()) {
+        return result;
+    }
+    if (features.size() != matrix_.dim()) {
+        throw std::invalid_argument("Vectors are of unequal length");
+    }
+    const float features_l1 = l1_norm(features.data(), features.size());
+    const size_t rows = std::min(row_objects_.size(), matrix_.rows());
+    for (size_t row = 0; row < rows; ++row) {
+        const auto &object = row_objects_[row];
+        if (object && object.get() != &query &&
+            matrix_.reaches(features.data(), features_l1, row, matrix_.dot(features.data(), row), threshold)) {
+            result.push_back(object);
+        }
+    }
+    return result;
+}
+
+std::vector<std::vector<std::shared_ptr<Object>>>
+BruteForceIndex::search_batch(const std::vector<std::shared_ptr<Object>> &queries, float threshold) const {
+    std::vector<std::vector<std::shared_ptr<Object>>> results(queries.size());
+    if (rows_.empty()) {
+        return results;
+    }
+    const size_t dim = matrix_.dim();
+    const size_t rows = std::min(row_objects_.size(), matrix_.rows());
+
+    std::vector<float> block(kQueryBlock * dim);
+    std::vector<float> block_l1(kQueryBlock);
+    std::vector<float> scores(kQueryBlock * kRowTile);
+    std::vector<size_t> block_queries;
+    for (size_t begin = 0; begin < queries.size(); begin += kQueryBlock) {
+        // Gather the queries of this block into one contiguous buffer (they may live in another database):
+        block_queries.clear();
+        for (size_t i = begin; i < std::min(begin + kQueryBlock, queries.size()); ++i) {
+            auto features = query_features(*queries[i]);
+            if (features.empty()) {
+                continue;
+            }
+            if (features.size() != dim) {
+                throw std::invalid_argument("Vectors are of unequal length");
+            }
+            std::copy(features.begin(), features.end(),
+                      block.begin() + static_cast<std::ptrdiff_t>(block_queries.size() * dim));
+            block_l1[block_queries.size()] = l1_norm(features.data(), dim);
+            block_queries.push_back(i);
+        }
+        if (block_queries.empty()) {
+            continue;
+        }
+
+        for (size_t tile = 0; tile < rows; tile += kRowTile) {
+            const size_t tile_rows = std::min(kRowTile, rows - tile);
+            matrix_.dot_block(block.data(), dim, block_queries.size(), tile, tile_rows, scores.data());
+            for (size_t q = 0; q < block_queries.size(); ++q) {
+                const auto &query = queries[block_queries[q]];
+                const float *query_features = block.data() + q * dim;
+                for (size_t r = 0; r < tile_rows; ++r) {
+                    const auto &object = row_objects_[tile + r];
+                    if (object && object != query &&
+                        matrix_.reaches(query_features, block_l1[q], tile + r, scores[q * tile_rows + r], threshold)) {
+                        results[block_queries[q]].push_back(object);
+                    }
+                }
+            }
+        }
+    }
+    return results;
+}
+
+size_t BruteForceIndex::size() const {
+    return rows_.size();
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// IvfIndex:
+// ---------------------------------------------------------------------------------------------------------------------
+
+IvfIndex::IvfIndex(const FeatureMatrix &matrix, size_t lists, size_t probes)
+        : SimilarityIndex(matrix),
+          lists_count_(std::max<size_t>(lists, 1)),
+          probes_(std::clamp<size_t>(probes, 1, lists_count_)),
+          lists_(1) {
+
+}
+
+bool IvfIndex::trained() const {
+    return !centroids_.empty();
+}
+
+uint32_t IvfIndex::nearest_list(size_t row) const {
+    if (!trained()) {
+        return 0;
+    }
+    const size_t dim = matrix_.dim();
+    uint32_t best = 0;
+    float best_score = -std::numeric_limits<float>::infinity();
+    for (uint32_t list = 0; list < lists_count_; ++list) {
+        // The centroid is the query, so the row is read in its stored form:
+        float list_score = matrix_.dot(centroids_.data() + list * dim, row);
+        if (list_score > best_score) {
+            best = list;
+            best_score = list_score;
+        }
+    }
+    return best;
+}
+
+void IvfIndex::append(uint32_t list, const std::shared_ptr<Object> &object, size_t row) {
+    auto &target = lists_[list];
+    locations_[object.get()] = {list, static_cast<uint32_t>(target.objects.size())};
+    target.objects.push_back(object);
+    target.rows.push_back(row);
+}
+
+void IvfIndex::add(const std::shared_ptr<Object> &object) {
+    auto row = row_of(*object);
+    if (!row || locations_.contains(object.get())) {
+        return;
+    }
+    append(nearest_list(*row), object, *row);
+
+    if (!trained() && locations_.size() >= kTrainingSamplesPerList * lists_count_) {
+        train(lists_[0].rows);
+        redistribute();
+    }
+}
+
+void IvfIndex::add_all(const std::vector<std::shared_ptr<Object>> &objects) {
+    std::vector<std::shared_ptr<Object>> to_add;
+    std::vector<size_t> rows;
+    for (const auto &object: objects) {
+        auto row = row_of(*object);
+        if (row && !locations_.contains(object.get())) {
+            to_add.push_back(object);
+            rows.push_back(*row);
+        }
+    }
+
+    if (!trained() && locations_.size() + to_add.size() >= kTrainingSamplesPerList * lists_count_) {
+        // Train on everything we have, indexed or not:
+        std::vector<size_t> samples(lists_[0].rows);
+        samples.insert(samples.end(), rows.begin(), rows.end());
+        train(samples);
+        redistribute();
+    }
+
+    std::vector<uint32_t> assignments(to_add.size());
+    ParallelFor(to_add.size(), [&](size_t i) {
+        assignments[i] = nearest_list(rows[i]);
+    });
+    for (size_t i = 0; i < to_add.size(); ++i) {
+        append(assignments[i], to_add[i], rows[i]);
+    }
+}
+
+void IvfIndex::train(const std::vector<size_t> &sample_rows) {
+    // Spherical k-means on (at most kMaxTrainingSamplesPerList * lists) samples:
+    const size_t dim = matrix_.dim();
+    std::mt19937 rng(42);
+    std::vector<size_t> samples(sample_rows);
+    std::shuffle(samples.begin(), samples.end(), rng);
+    samples.resize(std::min(samples.size(), kMaxTrainingSamplesPerList * lists_count_));
+
+    centroids_.assign(lists_count_ * dim, 0.0f);
+    for (size_t list = 0; list < lists_count_; ++list) {
+        matrix_.decode_row(samples[list % samples.size()], centroids_.data() + list * dim);
+    }
+
+    std::vector<uint32_t> assignments(samples.size());
+    for (size_t iteration = 0; iteration < kTrainingIterations; ++iteration) {
+        ParallelFor(samples.size(), [&](size_t i) {
+            assignments[i] = nearest_list(samples[i]);
+        });
+
+        std::vector<float> sums(lists_count_ * dim, 0.0f);
+        std::vector<size_t> counts(lists_count_, 0);
+        std::vector<float> sample(dim);
+        for (size_t i = 0; i < samples.size(); ++i) {
+            matrix_.decode_row(samples[i], sample.data());
+            float *sum = sums.data() + assignments[i] * dim;
+            for (size_t d = 0; d < dim; ++d) {
+                sum[d] += sample[d];
+            }
+            ++counts[assignments[i]];
+        }
+        for (size_t list = 0; list < lists_count_; ++list) {
+            float *centroid = centroids_.data() + list * dim;
+            if (counts[list] == 0) {
+                // Reseed empty clusters with a random sample:
+                matrix_.decode_row(samples[rng() % samples.size()], centroid);
+                continue;
+            }
+            const float *sum = sums.data() + list * dim;
+            float magnitude = std::sqrt(dot_product(sum, sum, dim));
+            for (size_t d = 0; d < dim; ++d) {
+                centroid[d] = magnitude > 0.0f ? sum[d] / magnitude : 0.0f;
+            }
+        }
+    }
+    spdlog::debug("Trained {} IVF lists on {} samples", lists_count_, samples.size());
+}
+
+void IvfIndex::redistribute() {
+    List untrained = std::move(lists_[0]);
+    lists_.assign(lists_count_, List());
+    locations_.clear();
+
+    std::vector<uint32_t> assignments(untrained.objects.size());
+    ParallelFor(untrained.objects.size(), [&](size_t i) {
+        assignments[i] = nearest_list(untrained.rows[i]);
+    });
+    for (size_t i = 0; i < untrained.objects.size(); ++i) {
+        append(assignments[i], untrained.objects[i], untrained.rows[i]);
+    }
+}
+
+void IvfIndex::remove(const std::shared_ptr<Object> &object) {
+    auto it = locations_.find(object.get());
+    if (it == locations_.end()) {
+        return;
+    }
+    auto [list, position] = it->second;
+    locations_.erase(it);
+
+    // Swap-remove, the last object of the list takes the freed position:
+    auto &target = lists_[list];
+    const size_t last = target.objects.size() - 1;
+    if (position != last) {
+        target.objects[position] = std::move(target.objects[last]);
+        target.rows[position] = target.rows[last];
+        locations_[target.objects[position].get()] = {list, position};
+    }
+    target.objects.pop_back();
+    target.rows.pop_back();
+}
+
+bool IvfIndex::contains(const Object &object) const {
+    return locations_.contains(&object);
+}
+
+std::vector<std::shared_ptr<Object>> IvfIndex::search(const Object &query, float threshold) const {
+    std::vector<std::shared_ptr<Object>> result;
+    auto features = query_features(query);
+    if (features.empty() || locations_.empty()) {
+        return result;
+    }
+    const size_t dim = matrix_.dim();
+    if (features.size() != dim) {
+        throw std::invalid_argument("Vectors are of unequal length");
+    }
+
+    std::vector<uint32_t> probed_lists = {0};
+    if (trained()) {
+        std::vector<std::pair<float, uint32_t>> list_scores(lists_count_);
+        for (uint32_t list = 0; list < lists_count_; ++list) {
+            list_scores[list] = {dot_product(features.data(), centroids_.data() + list * dim, dim), list};
+        }
+        std::partial_sort(list_scores.begin(), list_scores.begin() + static_cast<std::ptrdiff_t>(probes_),
+                          list_scores.end(), std::greater<>());
+        probed_lists.clear();
+        for (size_t i = 0; i < probes_; ++i) {
+            probed_lists.push_back(list_scores[i].second);
+        }
+    }
+
+    const float features_l1 = l1_norm(features.data(), dim);
+    for (uint32_t list: probed_lists) {
+        const auto &target = lists_[list];
+        for (size_t i = 0; i < target.objects.size(); ++i) {
+            const size_t row = target.rows[i];
+            if (target.objects[i].get() != &query &&
+                matrix_.reaches(features.data(), features_l1, row, matrix_.dot(features.data(), row), threshold)) {
+                result.push_back(target.objects[i]);
+            }
+        }
+    }
+    return result;
+}
+
+size_t IvfIndex::size() const {
+    return locations_.size();
+}
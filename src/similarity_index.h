@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <feature_matrix.h>
+
+class Object;
+
+class ImageObject;
+
+// Answers "which indexed objects have similarity() >= threshold with this one" queries.
+// Indexed objects are image objects with features in the database's FeatureMatrix; everything else is ignored.
+class SimilarityIndex {
+public:
+    explicit SimilarityIndex(const FeatureMatrix &matrix) : matrix_(matrix) {}
+
+    virtual ~SimilarityIndex() = default;
+
+    virtual void add(const std::shared_ptr<Object> &object) = 0;
+
+    virtual void add_all(const std::vector<std::shared_ptr<Object>> &objects);
+
+    virtual void remove(const std::shared_ptr<Object> &object) = 0;
+
+    [[nodiscard]] virtual bool contains(const Object &object) const = 0;
+
+    [[nodiscard]] virtual std::vector<std::shared_ptr<Object>> search(const Object &query, float threshold) const = 0;
+
+    [[nodiscard]] virtual std::vector<std::vector<std::shared_ptr<Object>>>
+    search_batch(const std::vector<std::shared_ptr<Object>> &queries, float threshold) const;
+
+    [[nodiscard]] virtual size_t size() const = 0;
+
+    // Builds the backend selected by the "similarity_index" config section.
+    static std::unique_ptr<SimilarityIndex> Create(const boost::property_tree::ptree &config,
+                                                   const FeatureMatrix &matrix);
+
+protected:
+    // Row of `object` in matrix_, or nullopt if it has no features there:
+    [[nodiscard]] std::optional<size_t> row_of(const Object &object) const;
+
+    const FeatureMatrix &matrix_;
+};
+
+// Scans every row of the matrix, gives exactly the same results as calling similarity() in a loop.
+class BruteForceIndex : public SimilarityIndex {
+public:
+    explicit BruteForceIndex(const FeatureMatrix &matrix);
+
+    void add(const std::shared_ptr<Object> &object) override;
+
+    void remove(const std::shared_ptr<Object> &object) override;
+
+    [[nodiscard]] bool contains(const Object &object) const override;
+
+    [[nodiscard]] std::vector<std::shared_ptr<Object>> search(const Object &query, float threshold) const override;
+
+    // Compares blocks of queries against tiles of rows, so each tile is read from memory once per block:
+    [[nodiscard]] std::vector<std::vector<std::shared_ptr<Object>>>
+    search_batch(const std::vector<std::shared_ptr<Object>> &queries, float threshold) const override;
+
+    [[nodiscard]] size_t size() const override;
+
+private:
+    // Indexed by matrix row, null for rows that aren't indexed:
+    std::vector<std::shared_ptr<Object>> row_objects_;
+    std::unordered_map<const Object *, size_t> rows_;
+};
+
+// Inverted file index: spherical k-means splits the vectors into `lists` clusters, a query only scans the
+// `probes` clusters whose centroids are closest to it.
+//
+// Near duplicates are almost the same vector, so they land in the same (or a neighbouring) cluster and
+// high-threshold queries (like 0.999) return the same matches as the brute force index.
+// Until there are enough vectors to train on, everything lives in a single list, which is exact.
+class IvfIndex : public SimilarityIndex {
+public:
+    IvfIndex(const FeatureMatrix &matrix, size_t lists, size_t probes);
+
+    void add(const std::shared_ptr<Object> &object) override;
+
+    // Trains (if there is enough data) and assigns all objects in parallel:
+    void add_all(const std::vector<std::shared_ptr<Object>> &objects) override;
+
+    void remove(const std::shared_ptr<Object> &object) override;
+
+    [[nodiscard]] bool contains(const Object &object) const override;
+
+    [[nodiscard]] std::vector<std::shared_ptr<Object>> search(const Object &query, float threshold) const override;
+
+    [[nodiscard]] size_t size() const override;
+
+private:
+    struct List {
+        std::vector<size_t> rows;
+        std::vector<std::shared_ptr<Object>> objects;
+    };
+
+    struct Location {
+        uint32_t list;
+        uint32_t position;
+    };
+
+    [[nodiscard]] bool trained() const;
+
+    [[nodiscard]] uint32_t nearest_list(size_t row) const;
+
+    void append(uint32_t list, const std::shared_ptr<Object> &object, size_t row);
+
+    void train(const std::vector<size_t> &sample_rows);
+
+    // Moves everything from the single untrained list into the trained lists:
+    void redistribute();
+
+    size_t lists_count_;
+    size_t probes_;
+
+    std::vector<float> centroids_;
+    std::vector<List> lists_;
+    std::unordered_map<const Object *, Location> locations_;
+};
@@ -0,0 +1,54 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(size_t thread_count)
+        : stopping_(false) {
+    if (thread_count == 0) {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < thread_count; ++i) {
+        threads_.emplace_back(&ThreadPool::Worker, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    task_queued_.notify_all();
+    for (auto &thread: threads_) {
+        thread.join();
+    }
+}
+
+std::future<void> ThreadPool::Submit(std::function<void()> task) {
+    std::packaged_task<void()> packaged_task(std::move(task));
+    auto future = packaged_task.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(packaged_task));
+    }
+    task_queued_.notify_one();
+    return future;
+}
+
+size_t ThreadPool::size() const {
+    return threads_.size();
+}
+
+void ThreadPool::Worker() {
+    while (true) {
+        std::packaged_task<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            task_queued_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+            if (tasks_.empty()) {
+                return;
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        // Exceptions end up in the task's future:
+        task();
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that live as long as the pool, for work that would otherwise start and join threads
+// on every call.
+class ThreadPool {
+public:
+    // 0 threads: one per core.
+    explicit ThreadPool(size_t thread_count);
+
+    // Runs the tasks that are still queued, then joins the workers.
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // The future rethrows what the task threw.
+    std::future<void> Submit(std::function<void()> task);
+
+    // Runs f(0) ... f(count - 1) split into contiguous chunks over at most `max_chunks` workers (0: all of them) and
+    // waits for them, rethrowing the first exception. Chunks have at least `min_chunk_size` items: the default suits
+    // cheap items, for slow ones (waiting for the disk) a few are worth a task. Must not be called from a task of this
+    // pool, which could wait for itself.
+    template<typename F>
+    void ParallelFor(size_t count, F &&f, size_t max_chunks = 0, size_t min_chunk_size = 256) {
+        size_t chunk_count = max_chunks == 0 ? threads_.size() : std::min(max_chunks, threads_.size());
+        chunk_count = std::min(chunk_count, (count + min_chunk_size - 1) / min_chunk_size);
+        if (chunk_count <= 1) {
+            for (size_t i = 0; i < count; ++i) {
+                f(i);
+            }
+            return;
+        }
+        std::vector<std::future<void>> chunks;
+        chunks.reserve(chunk_count);
+        for (size_t c = 0; c < chunk_count; ++c) {
+            chunks.push_back(Submit([&f, c, count, chunk_count]() {
+                for (size_t i = c * count / chunk_count; i < (c + 1) * count / chunk_count; ++i) {
+                    f(i);
+                }
+            }));
+        }
+        // Every chunk has to be done before f goes out of scope, even if an earlier one failed:
+        std::exception_ptr error;
+        for (auto &chunk: chunks) {
+            try {
+                chunk.get();
+            } catch (...) {
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    [[nodiscard]] size_t size() const;
+
+private:
+    void Worker();
+
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable task_queued_;
+    std::deque<std::packaged_task<void()>> tasks_;
+    bool stopping_;
+};
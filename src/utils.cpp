@@ -1,5 +1,25 @@
 #include "utils.h"
 
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+
+namespace {
+    void sync_path(const boost::filesystem::path &path, int flags) {
+        const int fd = open(path.c_str(), flags | O_CLOEXEC);
+        if (fd < 0 || fsync(fd) != 0) {
+            const int error = errno;
+            if (fd >= 0) {
+                close(fd);
+            }
+            throw std::runtime_error("Failed to sync " + path.generic_string() + ": " + std::strerror(error));
+        }
+        close(fd);
+    }
+}
+
 void PrintConfigTree(const boost::property_tree::ptree &tree, int indent) {
     const std::string indentation(indent * 2, ' ');
 
@@ -15,3 +35,12 @@ void PrintConfigTree(const boost::property_tree::ptree &tree, int indent) {
         }
     }
 }
+
+void RenameDurably(const boost::filesystem::path &temp_path, const boost::filesystem::path &path) {
+    // Otherwise the rename can reach the disk before the data, leaving an empty or partial file under the new name:
+    sync_path(temp_path, O_RDONLY);
+    boost::filesystem::rename(temp_path, path);
+    // And the rename itself can be lost:
+    const auto dir = path.has_parent_path() ? path.parent_path() : boost::filesystem::path(".");
+    sync_path(dir, O_RDONLY | O_DIRECTORY);
+}
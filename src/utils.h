@@ -4,10 +4,44 @@
 #include <unistd.h>
 #include <stack>
 #include <format>
+#include <thread>
+#include <vector>
+#include <boost/filesystem.hpp>
 #include <boost/property_tree/ptree.hpp>
 
 void PrintConfigTree(const boost::property_tree::ptree &tree, int indent);
 
+// Renames the fully written `temp_path` over `path` so that after a crash or power loss `path` is either the old file
+// or the complete new one: fsyncs the file before the rename and its directory after it. Throws std::runtime_error.
+void RenameDurably(const boost::filesystem::path &temp_path, const boost::filesystem::path &path);
+
+// Runs f(0) ... f(count - 1) split into contiguous chunks over `thread_count` threads (0: one per core).
+template<typename F>
+void ParallelFor(size_t count, F &&f, size_t thread_count = 0) {
+    if (thread_count == 0) {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    // Not worth a thread for less than a few hundred items:
+    thread_count = std::min(thread_count, (count + 255) / 256);
+    if (thread_count <= 1) {
+        for (size_t i = 0; i < count; ++i) {
+            f(i);
+        }
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&f, t, count, thread_count]() {
+            for (size_t i = t * count / thread_count; i < (t + 1) * count / thread_count; ++i) {
+                f(i);
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+}
+
 
 struct StderrSuppressor {
     StderrSuppressor() {
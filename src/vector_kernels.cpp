@@ -0,0 +1,514 @@
+#include "vector_kernels.h"
+
+#include <bit>
+#include <cmath>
+
+#include <immintrin.h>
+
+uint16_t float_to_half(float value) {
+    // Rebias the exponent and round the mantissa in the integer domain; subnormals are rounded by adding a float
+    // whose exponent lines the mantissa up with the half subnormal one:
+    constexpr uint32_t kInfinity = 255u << 23;
+    constexpr uint32_t kHalfOverflow = (127u + 16u) << 23;
+    constexpr uint32_t kHalfMinNormal = 113u << 23;
+    constexpr uint32_t kSubnormalMagic = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+
+    uint32_t bits = std::bit_cast<uint32_t>(value);
+    const uint32_t sign = bits & 0x80000000u;
+    bits ^= sign;
+    uint16_t half;
+    if (bits >= kHalfOverflow) {
+        half = bits > kInfinity ? 0x7e00 : 0x7c00;
+    } else if (bits < kHalfMinNormal) {
+        const float rounded = std::bit_cast<float>(bits) + std::bit_cast<float>(kSubnormalMagic);
+        half = static_cast<uint16_t>(std::bit_cast<uint32_t>(rounded) - kSubnormalMagic);
+    } else {
+        const uint32_t mantissa_odd = (bits >> 13) & 1u;
+        bits += ((15u - 127u) << 23) + 0xfffu + mantissa_odd;
+        half = static_cast<uint16_t>(bits >> 13);
+    }
+    return static_cast<uint16_t>(half | (sign >> 16));
+}
+
+float half_to_float(uint16_t value) {
+    constexpr uint32_t kExponentMask = 0x7c00u << 13;
+    uint32_t bits = (value & 0x7fffu) << 13;
+    const uint32_t exponent = bits & kExponentMask;
+    bits += (127u - 15u) << 23;
+    if (exponent == kExponentMask) {
+        // Infinity or NaN:
+        bits += (128u - 16u) << 23;
+    } else if (exponent == 0) {
+        // Zero or subnormal, renormalized by the float unit:
+        bits += 1u << 23;
+        bits = std::bit_cast<uint32_t>(std::bit_cast<float>(bits) - std::bit_cast<float>(113u << 23));
+    }
+    return std::bit_cast<float>(bits | (static_cast<uint32_t>(value & 0x8000u) << 16));
+}
+
+namespace {
+    // Queries processed together against one row, so each row is loaded once per group:
+    constexpr size_t kQueryGroup = 4;
+
+    // A dot product and its query group version for rows of type T:
+    template<typename T>
+    struct DotKernels {
+        float (*dot)(const float *a, const T *b, size_t n);
+
+        void (*dot_group)(const float *const *queries, const T *row, size_t n, float *out);
+    };
+
+    struct Kernels {
+        DotKernels<float> f32;
+        DotKernels<uint16_t> f16;
+        DotKernels<int8_t> i8;
+        const char *isa;
+    };
+
+    // ----------------------------------------------------------------------------------------------------------------
+    // Scalar:
+    // ----------------------------------------------------------------------------------------------------------------
+
+    float dot_scalar(const float *a, const float *b, size_t n) {
+        float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            sum[0] += a[i] * b[i];
+            sum[1] += a[i + 1] * b[i + 1];
+            sum[2] += a[i + 2] * b[i + 2];
+            sum[3] += a[i + 3] * b[i + 3];
+        }
+        for (; i < n; ++i) {
+            sum[0] += a[i] * b[i];
+        }
+        return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+    }
+
+    void dot_group_scalar(const float *const *queries, const float *row, size_t n, float *out) {
+        for (size_t q = 0; q < kQueryGroup; ++q) {
+            out[q] = dot_scalar(queries[q], row, n);
+        }
+    }
+
+    float dot_f16_scalar(const float *a, const uint16_t *b, size_t n) {
+        float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            sum[0] += a[i] * half_to_float(b[i]);
+            sum[1] += a[i + 1] * half_to_float(b[i + 1]);
+            sum[2] += a[i + 2] * half_to_float(b[i + 2]);
+            sum[3] += a[i + 3] * half_to_float(b[i + 3]);
+        }
+        for (; i < n; ++i) {
+            sum[0] += a[i] * half_to_float(b[i]);
+        }
+        return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+    }
+
+    void dot_group_f16_scalar(const float *const *queries, const uint16_t *row, size_t n, float *out) {
+        for (size_t q = 0; q < kQueryGroup; ++q) {
+            out[q] = dot_f16_scalar(queries[q], row, n);
+        }
+    }
+
+    float dot_i8_scalar(const float *a, const int8_t *b, size_t n) {
+        float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            sum[0] += a[i] * static_cast<float>(b[i]);
+            sum[1] += a[i + 1] * static_cast<float>(b[i + 1]);
+            sum[2] += a[i + 2] * static_cast<float>(b[i + 2]);
+            sum[3] += a[i + 3] * static_cast<float>(b[i + 3]);
+        }
+        for (; i < n; ++i) {
+            sum[0] += a[i] * static_cast<float>(b[i]);
+        }
+        return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+    }
+
+    void dot_group_i8_scalar(const float *const *queries, const int8_t *row, size_t n, float *out) {
+        for (size_t q = 0; q < kQueryGroup; ++q) {
+            out[q] = dot_i8_scalar(queries[q], row, n);
+        }
+    }
+
+    // ----------------------------------------------------------------------------------------------------------------
+    // AVX2 + FMA:
+    // ----------------------------------------------------------------------------------------------------------------
+
+    __attribute__((target("avx2,fma")))
+    float horizontal_sum_avx2(__m256 v) {
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+        return _mm_cvtss_f32(sum);
+    }
+
+    __attribute__((target("avx2,fma")))
+    float dot_avx2(const float *a, const float *b, size_t n) {
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+            sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+        }
+        for (; i + 8 <= n; i += 8) {
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+        }
+        float sum = horizontal_sum_avx2(_mm256_add_ps(sum0, sum1));
+        for (; i < n; ++i) {
+            sum += a[i] * b[i];
+        }
+        return sum;
+    }
+
+    __attribute__((target("avx2,fma")))
+    void dot_group_avx2(const float *const *queries, const float *row, size_t n, float *out) {
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        __m256 sum2 = _mm256_setzero_ps();
+        __m256 sum3 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256 r = _mm256_loadu_ps(row + i);
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(queries[0] + i), r, sum0);
+            sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(queries[1] + i), r, sum1);
+            sum2 = _mm256_fmadd_ps(_mm256_loadu_ps(queries[2] + i), r, sum2);
+            sum3 = _mm256_fmadd_ps(_mm256_loadu_ps(queries[3] + i), r, sum3);
+        }
+        out[0] = horizontal_sum_avx2(sum0);
+        out[1] = horizontal_sum_avx2(sum1);
+        out[2] = horizontal_sum_avx2(sum2);
+        out[3] = horizontal_sum_avx2(sum3);
+        for (; i < n; ++i) {
+            for (size_t q = 0; q < kQueryGroup; ++q) {
+                out[q] += queries[q][i] * row[i];
+            }
+        }
+    }
+
+    // Half floats are widened with F16C, int8 with a sign extension to int32 and a conversion, 8 at a time:
+
+    __attribute__((target("avx2,fma,f16c")))
+    __m256 load_f16_avx2(const uint16_t *b) {
+        return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b)));
+    }
+
+    __attribute__((target("avx2,fma")))
+    __m256 load_i8_avx2(const int8_t *b) {
+        return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(b))));
+    }
+
+    __attribute__((target("avx2,fma,f16c")))
+    float dot_f16_avx2(const float *a, const uint16_t *b, size_t n) {
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), load_f16_avx2(b + i), sum0);
+            sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), load_f16_avx2(b + i + 8), sum1);
+        }
+        for (; i + 8 <= n; i += 8) {
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), load_f16_avx2(b + i), sum0);
+        }
+        float sum = horizontal_sum_avx2(_mm256_add_ps(sum0, sum1));
+        for (; i < n; ++i) {
+            sum += a[i] * half_to_float(b[i]);
+        }
+        return sum;
+    }
+
+    __attribute__((target("avx2,fma,f16c")))
+    void dot_group_f16_avx2(const float *const *queries, const uint16_t *row, size_t n, float *out) {
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        __m256 sum2 = _mm256_setzero_ps();
+        __m256 sum3 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256 r = load_f16_avx2(row + i);
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(queries[0] + i), r, sum0);
+            sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(queries[1] + i), r, sum1);
+            sum2 = _mm256_fmadd_ps(_mm256_loadu_ps(queries[2] + i), r, sum2);
+            sum3 = _mm256_fmadd_ps(_mm256_loadu_ps(queries[3] + i), r, sum3);
+        }
+        out[0] = horizontal_sum_avx2(sum0);
+        out[1] = horizontal_sum_avx2(sum1);
+        out[2] = horizontal_sum_avx2(sum2);
+        out[3] = horizontal_sum_avx2(sum3);
+        for (; i < n; ++i) {
+            for (size_t q = 0; q < kQueryGroup; ++q) {
+                out[q] += queries[q][i] * half_to_float(row[i]);
+            }
+        }
+    }
+
+    __attribute__((target("avx2,fma")))
+    float dot_i8_avx2(const float *a, const int8_t *b, size_t n) {
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), load_i8_avx2(b + i), sum0);
+            sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), load_i8_avx2(b + i + 8), sum1);
+        }
+        for (; i + 8 <= n; i += 8) {
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), load_i8_avx2(b + i), sum0);
+        }
+        float sum = horizontal_sum_avx2(_mm256_add_ps(sum0, sum1));
+        for (; i < n; ++i) {
+            sum += a[i] * static_cast<float>(b[i]);
+        }
+        return sum;
+    }
+
+    __attribute__((target("avx2,fma")))
+    void dot_group_i8_avx2(const float *const *queries, const int8_t *row, size_t n, float *out) {
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        __m256 sum2 = _mm256_setzero_ps();
+        __m256 sum3 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256 r = load_i8_avx2(row + i);
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(queries[0] + i), r, sum0);
+            sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(queries[1] + i), r, sum1);
+            sum2 = _mm256_fmadd_ps(_mm256_loadu_ps(queries[2] + i), r, sum2);
+            sum3 = _mm256_fmadd_ps(_mm256_loadu_ps(queries[3] + i), r, sum3);
+        }
+        out[0] = horizontal_sum_avx2(sum0);
+        out[1] = horizontal_sum_avx2(sum1);
+        out[2] = horizontal_sum_avx2(sum2);
+        out[3] = horizontal_sum_avx2(sum3);
+        for (; i < n; ++i) {
+            for (size_t q = 0; q < kQueryGroup; ++q) {
+                out[q] += queries[q][i] * static_cast<float>(row[i]);
+            }
+        }
+    }
+
+    // ----------------------------------------------------------------------------------------------------------------
+    // AVX-512:
+    // ----------------------------------------------------------------------------------------------------------------
+
+    __attribute__((target("avx512f")))
+    float horizontal_sum_avx512(__m512 v) {
+        // Not _mm512_reduce_add_ps or _mm512_castps512_ps256: GCC implements them with extracts into undefined
+        // registers, which draw bogus "maybe uninitialized" warnings. The maskz extracts are the same instructions.
+        const __m256 low = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, _mm512_castps_pd(v), 0));
+        const __m256 high = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, _mm512_castps_pd(v), 1));
+        __m256 sum = _mm256_add_ps(low, high);
+        __m128 quarter = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+        quarter = _mm_add_ps(quarter, _mm_movehl_ps(quarter, quarter));
+        quarter = _mm_add_ss(quarter, _mm_movehdup_ps(quarter));
+        return _mm_cvtss_f32(quarter);
+    }
+
+    __attribute__((target("avx512f")))
+    float dot_avx512(const float *a, const float *b, size_t n) {
+        __m512 sum0 = _mm512_setzero_ps();
+        __m512 sum1 = _mm512_setzero_ps();
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+            sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), sum1);
+        }
+        for (; i + 16 <= n; i += 16) {
+            sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+        }
+        if (i < n) {
+            __mmask16 mask = static_cast<__mmask16>((1u << (n - i)) - 1);
+            sum1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), sum1);
+        }
+        return horizontal_sum_avx512(_mm512_add_ps(sum0, sum1));
+    }
+
+    __attribute__((target("avx512f")))
+    void dot_group_avx512(const float *const *queries, const float *row, size_t n, float *out) {
+        __m512 sum0 = _mm512_setzero_ps();
+        __m512 sum1 = _mm512_setzero_ps();
+        __m512 sum2 = _mm512_setzero_ps();
+        __m512 sum3 = _mm512_setzero_ps();
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m512 r = _mm512_loadu_ps(row + i);
+            sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(queries[0] + i), r, sum0);
+            sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(queries[1] + i), r, sum1);
+            sum2 = _mm512_fmadd_ps(_mm512_loadu_ps(queries[2] + i), r, sum2);
+            sum3 = _mm512_fmadd_ps(_mm512_loadu_ps(queries[3] + i), r, sum3);
+        }
+        if (i < n) {
+            __mmask16 mask = static_cast<__mmask16>((1u << (n - i)) - 1);
+            __m512 r = _mm512_maskz_loadu_ps(mask, row + i);
+            sum0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, queries[0] + i), r, sum0);
+            sum1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, queries[1] + i), r, sum1);
+            sum2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, queries[2] + i), r, sum2);
+            sum3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, queries[3] + i), r, sum3);
+        }
+        out[0] = horizontal_sum_avx512(sum0);
+        out[1] = horizontal_sum_avx512(sum1);
+        out[2] = horizontal_sum_avx512(sum2);
+        out[3] = horizontal_sum_avx512(sum3);
+    }
+
+    // The remainder of less than 16 elements is done in scalar code: the masked loads of 16-bit and 8-bit elements
+    // would need AVX-512BW.
+
+    // The maskz forms are the same instructions, without GCC's bogus "maybe uninitialized" warnings (see
+    // image_kernels.cpp):
+
+    __attribute__((target("avx512f")))
+    __m512 load_f16_avx512(const uint16_t *b) {
+        return _mm512_maskz_cvtph_ps(0xFFFF, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b)));
+    }
+
+    __attribute__((target("avx512f")))
+    __m512 load_i8_avx512(const int8_t *b) {
+        return _mm512_maskz_cvtepi32_ps(
+                0xFFFF, _mm512_maskz_cvtepi8_epi32(0xFFFF, _mm_loadu_si128(reinterpret_cast<const __m128i *>(b))));
+    }
+
+    template<typename T, __m512 (*load)(const T *), float (*convert)(T)>
+    __attribute__((target("avx512f")))
+    float dot_converted_avx512(const float *a, const T *b, size_t n) {
+        __m512 sum0 = _mm512_setzero_ps();
+        __m512 sum1 = _mm512_setzero_ps();
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), load(b + i), sum0);
+            sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), load(b + i + 16), sum1);
+        }
+        for (; i + 16 <= n; i += 16) {
+            sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), load(b + i), sum0);
+        }
+        float sum = horizontal_sum_avx512(_mm512_add_ps(sum0, sum1));
+        for (; i < n; ++i) {
+            sum += a[i] * convert(b[i]);
+        }
+        return sum;
+    }
+
+    template<typename T, __m512 (*load)(const T *), float (*convert)(T)>
+    __attribute__((target("avx512f")))
+    void dot_group_converted_avx512(const float *const *queries, const T *row, size_t n, float *out) {
+        __m512 sum0 = _mm512_setzero_ps();
+        __m512 sum1 = _mm512_setzero_ps();
+        __m512 sum2 = _mm512_setzero_ps();
+        __m512 sum3 = _mm512_setzero_ps();
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m512 r = load(row + i);
+            sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(queries[0] + i), r, sum0);
+            sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(queries[1] + i), r, sum1);
+            sum2 = _mm512_fmadd_ps(_mm512_loadu_ps(queries[2] + i), r, sum2);
+            sum3 = _mm512_fmadd_ps(_mm512_loadu_ps(queries[3] + i), r, sum3);
+        }
+        out[0] = horizontal_sum_avx512(sum0);
+        out[1] = horizontal_sum_avx512(sum1);
+        out[2] = horizontal_sum_avx512(sum2);
+        out[3] = horizontal_sum_avx512(sum3);
+        for (; i < n; ++i) {
+            for (size_t q = 0; q < kQueryGroup; ++q) {
+                out[q] += queries[q][i] * convert(row[i]);
+            }
+        }
+    }
+
+    float int8_to_float(int8_t value) {
+        return static_cast<float>(value);
+    }
+
+    Kernels select_kernels() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return {{dot_avx512, dot_group_avx512},
+                    {dot_converted_avx512<uint16_t, load_f16_avx512, half_to_float>,
+                     dot_group_converted_avx512<uint16_t, load_f16_avx512, half_to_float>},
+                    {dot_converted_avx512<int8_t, load_i8_avx512, int8_to_float>,
+                     dot_group_converted_avx512<int8_t, load_i8_avx512, int8_to_float>},
+                    "AVX-512"};
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            if (__builtin_cpu_supports("f16c")) {
+                return {{dot_avx2, dot_group_avx2}, {dot_f16_avx2, dot_group_f16_avx2},
+                        {dot_i8_avx2, dot_group_i8_avx2}, "AVX2"};
+            }
+            return {{dot_avx2, dot_group_avx2}, {dot_f16_scalar, dot_group_f16_scalar},
+                    {dot_i8_avx2, dot_group_i8_avx2}, "AVX2 (without F16C)"};
+        }
+        return {{dot_scalar, dot_group_scalar}, {dot_f16_scalar, dot_group_f16_scalar},
+                {dot_i8_scalar, dot_group_i8_scalar}, "scalar"};
+    }
+
+    const Kernels &kernels() {
+        static const Kernels selected = select_kernels();
+        return selected;
+    }
+
+    template<typename T>
+    void dot_block(const DotKernels<T> &k, const float *queries, size_t query_stride, size_t query_count,
+                   const T *rows, size_t row_stride, size_t row_count, size_t n, float *out) {
+        size_t q = 0;
+        for (; q + kQueryGroup <= query_count; q += kQueryGroup) {
+            const float *group[kQueryGroup];
+            for (size_t i = 0; i < kQueryGroup; ++i) {
+                group[i] = queries + (q + i) * query_stride;
+            }
+            float result[kQueryGroup];
+            for (size_t r = 0; r < row_count; ++r) {
+                k.dot_group(group, rows + r * row_stride, n, result);
+                for (size_t i = 0; i < kQueryGroup; ++i) {
+                    out[(q + i) * row_count + r] = result[i];
+                }
+            }
+        }
+        for (; q < query_count; ++q) {
+            for (size_t r = 0; r < row_count; ++r) {
+                out[q * row_count + r] = k.dot(queries + q * query_stride, rows + r * row_stride, n);
+            }
+        }
+    }
+}
+
+float dot_product(const float *a, const float *b, size_t n) {
+    return kernels().f32.dot(a, b, n);
+}
+
+void dot_product_block(const float *queries, size_t query_stride, size_t query_count,
+                       const float *rows, size_t row_stride, size_t row_count,
+                       size_t n, float *out) {
+    dot_block(kernels().f32, queries, query_stride, query_count, rows, row_stride, row_count, n, out);
+}
+
+float dot_product_f16(const float *a, const uint16_t *b, size_t n) {
+    return kernels().f16.dot(a, b, n);
+}
+
+float dot_product_i8(const float *a, const int8_t *b, size_t n) {
+    return kernels().i8.dot(a, b, n);
+}
+
+void dot_product_block_f16(const float *queries, size_t query_stride, size_t query_count,
+                           const uint16_t *rows, size_t row_stride, size_t row_count,
+                           size_t n, float *out) {
+    dot_block(kernels().f16, queries, query_stride, query_count, rows, row_stride, row_count, n, out);
+}
+
+void dot_product_block_i8(const float *queries, size_t query_stride, size_t query_count,
+                          const int8_t *rows, size_t row_stride, size_t row_count,
+                          size_t n, float *out) {
+    dot_block(kernels().i8, queries, query_stride, query_count, rows, row_stride, row_count, n, out);
+}
+
+float l1_norm(const float *a, size_t n) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        sum += std::abs(a[i]);
+    }
+    return sum;
+}
+
+const char *vector_kernels_isa() {
+    return kernels().isa;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Dot product kernels over float vectors, and over float queries against rows stored as IEEE half floats or as
+// int8. The implementation (AVX-512, AVX2+FMA(+F16C) or scalar) is picked once at runtime from what the CPU
+// supports, so the same binary runs everywhere.
+
+[[nodiscard]] float dot_product(const float *a, const float *b, size_t n);
+
+// out[q * row_count + r] = dot(queries[q], rows[r]) for a block of queries against a block of rows.
+// Queries and rows are row-major with the given strides (in floats).
+void dot_product_block(const float *queries, size_t query_stride, size_t query_count,
+                       const float *rows, size_t row_stride, size_t row_count,
+                       size_t n, float *out);
+
+// dot(a, b) with b stored as half floats:
+[[nodiscard]] float dot_product_f16(const float *a, const uint16_t *b, size_t n);
+
+// dot(a, b) with b stored as int8; the caller applies b's scale:
+[[nodiscard]] float dot_product_i8(const float *a, const int8_t *b, size_t n);
+
+// dot_product_block against half float rows (row_stride in elements):
+void dot_product_block_f16(const float *queries, size_t query_stride, size_t query_count,
+                           const uint16_t *rows, size_t row_stride, size_t row_count,
+                           size_t n, float *out);
+
+// dot_product_block against int8 rows (row_stride in elements), unscaled:
+void dot_product_block_i8(const float *queries, size_t query_stride, size_t query_count,
+                          const int8_t *rows, size_t row_stride, size_t row_count,
+                          size_t n, float *out);
+
+// Sum of the absolute values of a, for error bounds of the int8 kernels:
+[[nodiscard]] float l1_norm(const float *a, size_t n);
+
+// IEEE 754 half float conversions, rounding to nearest even:
+[[nodiscard]] uint16_t float_to_half(float value);
+
+[[nodiscard]] float half_to_float(uint16_t value);
+
+// Name of the instruction set the kernels were dispatched to, for logging.
+[[nodiscard]] const char *vector_kernels_isa();
@@ -0,0 +1,302 @@
+#!/usr/bin/env python3
+"""End-to-end throughput and correctness check of image_warrior on a synthetic photo corpus.
+
+Generates a reproducible corpus (same seed and options, same files) of smooth random photos as JPEGs and PNGs of mixed
+sizes in nested directories, where a controlled fraction of the files are duplicates of others:
+    exact       byte-identical copies
+    reencoded   decoded and encoded again as JPEG at another quality
+    resized     downscaled to half the size
+and a tiny stand-in TorchScript feature extractor (8x8 average pooling), so no real model is needed.
+
+Then runs image_warrior on a fresh copy of the corpus with the settings of --config (paths, model and threshold
+replaced) and reports the wall time, images/s, peak RSS and time per phase (from the log). The run passes when every
+group of duplicates ended up in output_dir exactly once, nothing was left in input_dir and the optional budgets hold;
+the exit status is non-zero otherwise.
+
+Needs torch, numpy and opencv-python:
+    tools/e2e_benchmark.py --binary build/image_warrior --images 2000 --report e2e_report.json
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import shutil
+import subprocess
+import sys
+import time
+
+import cv2
+import numpy as np
+import torch
+
+IMAGE_EXTENSIONS = {".jpg", ".jpeg", ".png"}
+# (width, height) of the generated photos, picked at random:
+SIZES = [(640, 480), (1280, 960), (1920, 1080), (3000, 2000), (4000, 3000)]
+PNG_FRACTION = 0.25
+
+# Log lines that start each phase, in the order they appear:
+BATCH_PHASES = [
+    ("load", "Loading input database..."),
+    ("update", "Updating input database..."),
+    ("initialize", "Initializing processors..."),
+    ("exact_duplicates", "Removing exact duplicates..."),
+    ("prefilter", "Processing input and output database..."),
+    ("perceptual_duplicates", "Resolving perceptual duplicates..."),
+    ("process", "Processing input and output database..."),
+    ("save", "Saving database features..."),
+    ("move_unique", "Copying unique objects..."),
+    ("final_save", "Saving database features..."),
+]
+STREAM_PHASES = [
+    ("load", "Loading input database..."),
+    ("stream", "Updating output database..."),
+    ("save", "Saving database features..."),
+]
+
+
+class TinyFeatures(torch.nn.Module):
+    """Stand-in for the real model: the normalized input averaged down to 8x8, 192 features."""
+
+    def forward(self, images: torch.Tensor) -> torch.Tensor:
+        return torch.nn.functional.adaptive_avg_pool2d(images, 8).flatten(1)
+
+
+def file_hash(path):
+    with open(path, "rb") as file:
+        return hashlib.sha1(file.read()).hexdigest()
+
+
+def random_photo(rng, width, height):
+    """A smooth random color field with some grain, which compresses and hashes like a photo."""
+    grid = rng.integers(0, 256, size=(rng.integers(4, 9), rng.integers(4, 9), 3), dtype=np.uint8)
+    photo = cv2.resize(grid, (width, height), interpolation=cv2.INTER_CUBIC)
+    grain = rng.integers(-8, 9, size=photo.shape, dtype=np.int16)
+    return np.clip(photo.astype(np.int16) + grain, 0, 255).astype(np.uint8)
+
+
+def random_directory(rng, root, depth):
+    parts = [f"d{rng.integers(0, 4)}" for _ in range(rng.integers(0, depth + 1))]
+    directory = os.path.join(root, *parts)
+    os.makedirs(directory, exist_ok=True)
+    return directory
+
+
+def generate_corpus(args, corpus_dir):
+    """Writes the corpus and returns the manifest: file hash -> duplicate group, plus the counts."""
+    rng = np.random.default_rng(args.seed)
+    counts = {kind: round(args.images * getattr(args, f"{kind}_fraction"))
+              for kind in ("exact", "reencoded", "resized")}
+    unique_count = args.images - sum(counts.values())
+    if unique_count <= 0:
+        sys.exit("The duplicate fractions leave no unique images")
+
+    groups = {}
+    originals = []
+    for i in range(unique_count):
+        width, height = SIZES[rng.integers(0, len(SIZES))]
+        photo = random_photo(rng, width, height)
+        extension = ".png" if rng.random() < PNG_FRACTION else ".jpg"
+        path = os.path.join(random_directory(rng, corpus_dir, args.depth), f"photo_{i}{extension}")
+        cv2.imwrite(path, photo, [cv2.IMWRITE_JPEG_QUALITY, 92])
+        groups[file_hash(path)] = i
+        originals.append((i, path, photo))
+
+    duplicates = [kind for kind, count in counts.items() for _ in range(count)]
+    rng.shuffle(duplicates)
+    for j, kind in enumerate(duplicates):
+        group, original_path, photo = originals[rng.integers(0, len(originals))]
+        path = os.path.join(random_directory(rng, corpus_dir, args.depth), f"copy_{j}")
+        if kind == "exact":
+            path += os.path.splitext(original_path)[1]
+            shutil.copyfile(original_path, path)
+        elif kind == "reencoded":
+            path += ".jpg"
+            cv2.imwrite(path, photo, [cv2.IMWRITE_JPEG_QUALITY, 75])
+        else:
+            path += ".jpg"
+            half = cv2.resize(photo, (photo.shape[1] // 2, photo.shape[0] // 2), interpolation=cv2.INTER_AREA)
+            cv2.imwrite(path, half, [cv2.IMWRITE_JPEG_QUALITY, 92])
+        groups.setdefault(file_hash(path), group)
+
+    return {"groups": groups, "unique": unique_count, "duplicates": counts, "images": args.images}
+
+
+def load_corpus(args):
+    """The corpus for these options, generated on first use and reused after that."""
+    fractions = f"{args.exact_fraction}_{args.reencoded_fraction}_{args.resized_fraction}"
+    key = f"{args.images}_{fractions}_{args.depth}_{args.seed}"
+    corpus_dir = os.path.join(args.work_dir, f"corpus_{key}")
+    manifest_path = corpus_dir + ".json"
+    if os.path.exists(manifest_path):
+        with open(manifest_path) as file:
+            return corpus_dir, json.load(file)
+
+    shutil.rmtree(corpus_dir, ignore_errors=True)
+    os.makedirs(corpus_dir)
+    print(f"Generating {args.images} images in {corpus_dir}...")
+    start = time.perf_counter()
+    manifest = generate_corpus(args, corpus_dir)
+    print(f"Generated in {time.perf_counter() - start:.1f}s")
+    # Written last, so an interrupted generation is redone:
+    with open(manifest_path, "w") as file:
+        json.dump(manifest, file)
+    return corpus_dir, manifest
+
+
+def write_config(args, run_dir, model_path):
+    with open(args.config) as file:
+        config = json.load(file)
+    config["input_dir"] = os.path.join(run_dir, "input")
+    config["output_dir"] = os.path.join(run_dir, "output")
+    config["log_level"] = "info"
+    config["dedupe"]["similarity_threshold"] = args.similarity_threshold
+    config["perceptual_hash_processor"]["enabled"] = True
+    image_processor = config["image_processor"]
+    image_processor["enabled"] = True
+    image_processor["model_path"] = model_path
+    image_processor["int8"]["enabled"] = False
+    image_processor["cpu_inference"]["enabled"] = True
+    image_processor["cpu_inference"]["drift_check_images"] = 0
+    config_path = os.path.join(run_dir, "config.json")
+    with open(config_path, "w") as file:
+        json.dump(config, file, indent=2)
+    return config_path
+
+
+def run(args, config_path, run_dir):
+    """Runs image_warrior, returns the wall time, peak RSS in MiB, phase times and the time to the first move."""
+    phases = STREAM_PHASES if args.stream else BATCH_PHASES
+    command = [os.path.abspath(args.binary), "--config", config_path] + (["--stream"] if args.stream else [])
+    log_path = os.path.join(run_dir, "image_warrior.log")
+
+    start = time.perf_counter()
+    phase_starts = []
+    first_move = None
+    with open(log_path, "w") as log, subprocess.Popen(command, cwd=run_dir, stdout=subprocess.PIPE,
+                                                      stderr=subprocess.STDOUT, text=True, errors="replace") as process:
+        for line in process.stdout:
+            now = time.perf_counter() - start
+            log.write(line)
+            if len(phase_starts) < len(phases) and phases[len(phase_starts)][1] in line:
+                phase_starts.append(now)
+            if first_move is None and "First object moved after" in line:
+                first_move = now
+        _, status, usage = os.wait4(process.pid, 0)
+        process.returncode = os.waitstatus_to_exitcode(status)
+    seconds = time.perf_counter() - start
+    if process.returncode != 0:
+        sys.exit(f"image_warrior exited with {process.returncode}, see {log_path}")
+
+    phase_seconds = {}
+    for i, phase_start in enumerate(phase_starts):
+        phase_end = phase_starts[i + 1] if i + 1 < len(phase_starts) else seconds
+        phase_seconds[phases[i][0]] = round(phase_end - phase_start, 3)
+    # ru_maxrss is in KiB on Linux:
+    return seconds, usage.ru_maxrss / 1024, phase_seconds, first_move
+
+
+def image_files(directory):
+    for root, _, files in os.walk(directory):
+        for name in files:
+            if os.path.splitext(name)[1].lower() in IMAGE_EXTENSIONS:
+                yield os.path.join(root, name)
+
+
+def check_results(manifest, run_dir):
+    """One file per duplicate group in output_dir and none left in input_dir, as a list of problems."""
+    problems = []
+    found = {}
+    for path in image_files(os.path.join(run_dir, "output")):
+        group = manifest["groups"].get(file_hash(path))
+        if group is None:
+            problems.append(f"Unexpected file in output: {path}")
+            continue
+        found.setdefault(group, []).append(path)
+    for group, paths in found.items():
+        if len(paths) > 1:
+            problems.append(f"Duplicates kept in output: {', '.join(paths)}")
+    missing = manifest["unique"] - len(found)
+    if missing > 0:
+        problems.append(f"{missing} of {manifest['unique']} distinct images missing from output")
+    left = list(image_files(os.path.join(run_dir, "input")))
+    if left:
+        problems.append(f"{len(left)} images left in input, e.g. {left[0]}")
+    return problems
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--binary", required=True, help="the image_warrior executable")
+    parser.add_argument("--config", default="config.json", help="settings to run with, paths are replaced")
+    parser.add_argument("--work-dir", default="e2e", help="corpora, the model and the runs go here")
+    parser.add_argument("--report", help="write the results as JSON here")
+    parser.add_argument("--stream", action="store_true", help="run image_warrior --stream")
+    parser.add_argument("--images", type=int, default=2000)
+    parser.add_argument("--exact-fraction", type=float, default=0.1)
+    parser.add_argument("--reencoded-fraction", type=float, default=0.1)
+    parser.add_argument("--resized-fraction", type=float, default=0.1)
+    parser.add_argument("--depth", type=int, default=4, help="maximum directory nesting")
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument("--similarity-threshold", type=float, default=0.99,
+                        help="for the stand-in model, the one in --config is tuned for the real one")
+    parser.add_argument("--max-seconds", type=float, help="budget for the whole run")
+    parser.add_argument("--min-images-per-second", type=float, help="budget for the whole run")
+    parser.add_argument("--max-rss-mb", type=float, help="budget for the peak RSS")
+    args = parser.parse_args()
+
+    os.makedirs(args.work_dir, exist_ok=True)
+    corpus_dir, manifest = load_corpus(args)
+
+    model_path = os.path.abspath(os.path.join(args.work_dir, "tiny_features.pt"))
+    if not os.path.exists(model_path):
+        torch.jit.script(TinyFeatures().eval()).save(model_path)
+
+    run_dir = os.path.abspath(os.path.join(args.work_dir, "run"))
+    shutil.rmtree(run_dir, ignore_errors=True)
+    shutil.copytree(corpus_dir, os.path.join(run_dir, "input"))
+    os.makedirs(os.path.join(run_dir, "output"))
+    config_path = write_config(args, run_dir, model_path)
+
+    seconds, peak_rss_mb, phase_seconds, first_move = run(args, config_path, run_dir)
+    images_per_second = manifest["images"] / seconds
+    print(f"{manifest['images']} images in {seconds:.2f}s: {images_per_second:.1f} images/s, "
+          f"peak RSS {peak_rss_mb:.0f} MiB")
+    for phase, phase_time in phase_seconds.items():
+        print(f"    {phase}: {phase_time:.2f}s")
+    if first_move is not None:
+        print(f"First object moved after {first_move:.2f}s")
+
+    problems = check_results(manifest, run_dir)
+    if args.max_seconds is not None and seconds > args.max_seconds:
+        problems.append(f"Took {seconds:.2f}s, budget is {args.max_seconds}s")
+    if args.min_images_per_second is not None and images_per_second < args.min_images_per_second:
+        problems.append(f"{images_per_second:.1f} images/s, budget is {args.min_images_per_second}")
+    if args.max_rss_mb is not None and peak_rss_mb > args.max_rss_mb:
+        problems.append(f"Peak RSS {peak_rss_mb:.0f} MiB, budget is {args.max_rss_mb} MiB")
+    for problem in problems:
+        print(problem, file=sys.stderr)
+
+    if args.report:
+        report = {
+            "mode": "stream" if args.stream else "batch",
+            "images": manifest["images"],
+            "unique": manifest["unique"],
+            "duplicates": manifest["duplicates"],
+            "seed": args.seed,
+            "seconds": round(seconds, 3),
+            "images_per_second": round(images_per_second, 2),
+            "peak_rss_mb": round(peak_rss_mb, 1),
+            "phases": phase_seconds,
+            "first_move_seconds": None if first_move is None else round(first_move, 3),
+            "problems": problems,
+        }
+        with open(args.report, "w") as file:
+            json.dump(report, file, indent=2)
+
+    print("FAILED" if problems else "PASSED")
+    sys.exit(1 if problems else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+"""Static INT8 quantization of the image_warrior feature extractor.
+
+Takes the TorchScript model at image_processor.model_path, calibrates static INT8 quantization (TorchScript graph
+mode, fbgemm/x86 backend) on a sample of the images in input_dir and saves the quantized TorchScript, which
+image_warrior loads when image_processor.int8.enabled is set.
+
+Quantization changes the features, so it also measures how the duplicate decisions change: pairs of sample images
+with cosine similarity >= dedupe.similarity_threshold under the fp32 model are the duplicate pairs, the recall is the
+fraction of them the INT8 model still finds.
+
+Needs torch, numpy and opencv-python:
+    tools/quantize_model.py --config config.json --calibration-images 512 --evaluation-images 2048
+"""
+
+import argparse
+import json
+import os
+import random
+import sys
+import time
+
+import cv2
+import numpy as np
+import torch
+from torch.ao.quantization import get_default_qconfig, quantize_jit
+
+# Must match ImageProcessor (src/processors/image_processor.cpp):
+INPUT_SIZE = 224
+MEAN = np.array([0.485, 0.456, 0.406], dtype=np.float32)
+STD = np.array([0.229, 0.224, 0.225], dtype=np.float32)
+IMAGE_EXTENSIONS = {".jpg", ".jpeg", ".png", ".gif", ".bmp", ".tiff", ".tif", ".jfif", ".webp"}
+
+
+def find_images(directory):
+    paths = []
+    for root, _, files in os.walk(directory):
+        for name in files:
+            if os.path.splitext(name)[1].lower() in IMAGE_EXTENSIONS:
+                paths.append(os.path.join(root, name))
+    return paths
+
+
+def load_image(path):
+    """Decodes and preprocesses like the image processor: resize to 224x224, BGR -> RGB, ImageNet normalization."""
+    image = cv2.imread(path, cv2.IMREAD_COLOR)
+    if image is None:
+        return None
+    image = cv2.resize(image, (INPUT_SIZE, INPUT_SIZE))
+    image = cv2.cvtColor(image, cv2.COLOR_BGR2RGB).astype(np.float32) / 255.0
+    image = (image - MEAN) / STD
+    return torch.from_numpy(image.transpose(2, 0, 1).copy())
+
+
+def batches(paths, batch_size):
+    batch = []
+    for path in paths:
+        image = load_image(path)
+        if image is None:
+            print(f"Skipping unreadable image: {path}", file=sys.stderr)
+            continue
+        batch.append(image)
+        if len(batch) == batch_size:
+            yield torch.stack(batch)
+            batch = []
+    if batch:
+        yield torch.stack(batch)
+
+
+@torch.no_grad()
+def features(model, paths, batch_size):
+    rows = []
+    start = time.perf_counter()
+    for batch in batches(paths, batch_size):
+        rows.append(model(batch).reshape(batch.shape[0], -1).float())
+    elapsed = time.perf_counter() - start
+    result = torch.nn.functional.normalize(torch.cat(rows), dim=1)
+    return result, result.shape[0] / elapsed
+
+
+def duplicate_pairs(normalized, threshold):
+    similarity = normalized @ normalized.T
+    first, second = torch.triu_indices(len(normalized), len(normalized), offset=1)
+    mask = similarity[first, second] >= threshold
+    return set(zip(first[mask].tolist(), second[mask].tolist()))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--config", default="config.json")
+    parser.add_argument("--output", help="defaults to image_processor.int8.model_path")
+    parser.add_argument("--calibration-images", type=int, default=512)
+    parser.add_argument("--evaluation-images", type=int, default=2048)
+    parser.add_argument("--batch-size", type=int, default=32)
+    parser.add_argument("--seed", type=int, default=0)
+    args = parser.parse_args()
+
+    with open(args.config) as file:
+        config = json.load(file)
+    model_path = config["image_processor"]["model_path"]
+    output_path = args.output or config["image_processor"]["int8"]["model_path"]
+    threshold = float(config["dedupe"]["similarity_threshold"])
+
+    paths = find_images(config["input_dir"])
+    random.Random(args.seed).shuffle(paths)
+    calibration_paths = paths[:args.calibration_images]
+    evaluation_paths = paths[args.calibration_images:args.calibration_images + args.evaluation_images]
+    if not calibration_paths or not evaluation_paths:
+        sys.exit(f"Not enough images in {config['input_dir']} for calibration and evaluation")
+    print(f"{len(paths)} images, calibrating on {len(calibration_paths)}, evaluating on {len(evaluation_paths)}")
+
+    torch.backends.quantized.engine = "x86" if "x86" in torch.backends.quantized.supported_engines else "fbgemm"
+    model = torch.jit.load(model_path, map_location="cpu").eval()
+
+    def calibrate(prepared_model, _):
+        with torch.no_grad():
+            for batch in batches(calibration_paths, args.batch_size):
+                prepared_model(batch)
+
+    qconfig = get_default_qconfig(torch.backends.quantized.engine)
+    quantized_model = quantize_jit(model, {"": qconfig}, calibrate, [None])
+    quantized_model.save(output_path)
+    print(f"Saved quantized model to {output_path}")
+
+    fp32_features, fp32_speed = features(model, evaluation_paths, args.batch_size)
+    int8_features, int8_speed = features(quantized_model, evaluation_paths, args.batch_size)
+    print(f"fp32: {fp32_speed:.1f} images/s, int8: {int8_speed:.1f} images/s (including decoding)")
+
+    cosine = (fp32_features * int8_features).sum(dim=1)
+    print(f"Cosine similarity int8 vs fp32: mean {cosine.mean():.6f}, min {cosine.min():.6f}")
+
+    fp32_pairs = duplicate_pairs(fp32_features, threshold)
+    int8_pairs = duplicate_pairs(int8_features, threshold)
+    found = len(fp32_pairs & int8_pairs)
+    print(f"Duplicate pairs at {threshold}: fp32 {len(fp32_pairs)}, int8 {len(int8_pairs)}")
+    if fp32_pairs:
+        print(f"Recall {found / len(fp32_pairs):.4f} ({found}/{len(fp32_pairs)})")
+    if int8_pairs:
+        print(f"Precision {found / len(int8_pairs):.4f} ({found}/{len(int8_pairs)})")
+
+
+if __name__ == "__main__":
+    main()